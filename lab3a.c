@@ -6,19 +6,244 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "lab3a.h"
 
-int inodeCount;
-int blockCount;
-int blockSize;
-int fragmentSize;
-int blocksPerGroup; 
-int inodesPerGroup;
-int fragmentsPerGroup;
-int firstDataBlock;
+//Number of worker threads used by the parallel phases (-j)
+static int threadCount = 1;
 
-int numGroups;
+//Number of indirect block reads kept outstanding while walking indirect trees (--io-depth)
+static int ioDepth = 32;
 
-int bytesPerInode;
+//Format of the output tables, set by --format
+enum { FORMAT_CSV, FORMAT_COLUMNAR };
+static int outputFormat = FORMAT_CSV;
+
+//Set by --bitmap-ranges: bitmap.csv lists runs of free entries rather than each one
+static int bitmapRanges = 0;
+
+//Sidecar index of --incremental, 0 when not given
+static const char* indexPath = 0;
+
+//Set by --check: the scan's results are cross-checked for consistency into check.txt
+static int checkConsistency = 0;
+
+//Set by --stats-json and --progress. While set, time blocked on I/O is measured and rows
+//written to the CSVs are counted.
+static int collectStats = 0;
+
+//Counts of the work done by one thread. A thread only ever updates its own counters, so
+//counting is a plain add on the hot paths; the stores are relaxed atomics only because the
+//progress reporter reads them while they change. Worker threads fold theirs into
+//retiredCounters when they finish.
+struct scanCounters {
+	unsigned long long bytesRead; //Fetched from the image, by read calls or the mapping
+	unsigned long long syscalls; //Reads, writes, io_uring calls and readahead hints
+	unsigned long long inodes;
+	unsigned long long directoryEntries;
+	unsigned long long indirectBlocks;
+	unsigned long long rows;
+	unsigned long long ioNanoseconds; //Blocked reading the image
+	unsigned long long outputNanoseconds; //Blocked writing the CSVs
+	struct scanCounters* next; //Next thread in liveCounters
+};
+
+static __thread struct scanCounters threadCounters;
+static struct scanCounters* liveCounters = 0;
+static struct scanCounters retiredCounters;
+static pthread_mutex_t countersLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void countEvents(unsigned long long* counter, unsigned long long amount) {
+	__atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long currentNanoseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//Adds source's counts into total, which must not be a live thread's counters
+static void addCounters(struct scanCounters* total, struct scanCounters* source) {
+	total->bytesRead += __atomic_load_n(&source->bytesRead, __ATOMIC_RELAXED);
+	total->syscalls += __atomic_load_n(&source->syscalls, __ATOMIC_RELAXED);
+	total->inodes += __atomic_load_n(&source->inodes, __ATOMIC_RELAXED);
+	total->directoryEntries += __atomic_load_n(&source->directoryEntries, __ATOMIC_RELAXED);
+	total->indirectBlocks += __atomic_load_n(&source->indirectBlocks, __ATOMIC_RELAXED);
+	total->rows += __atomic_load_n(&source->rows, __ATOMIC_RELAXED);
+	total->ioNanoseconds += __atomic_load_n(&source->ioNanoseconds, __ATOMIC_RELAXED);
+	total->outputNanoseconds +=
+		__atomic_load_n(&source->outputNanoseconds, __ATOMIC_RELAXED);
+}
+
+//Makes the calling thread's counters visible to sumCounters
+static void registerThreadCounters() {
+	pthread_mutex_lock(&countersLock);
+	threadCounters.next = liveCounters;
+	liveCounters = &threadCounters;
+	pthread_mutex_unlock(&countersLock);
+}
+
+//Folds the calling thread's counters into retiredCounters, before the thread exits
+static void retireThreadCounters() {
+	pthread_mutex_lock(&countersLock);
+	struct scanCounters** link = &liveCounters;
+	while (*link != &threadCounters)
+		link = &(*link)->next;
+	*link = threadCounters.next;
+	addCounters(&retiredCounters, &threadCounters);
+	pthread_mutex_unlock(&countersLock);
+}
+
+//Totals the counters of every thread so far
+static void sumCounters(struct scanCounters* total) {
+	memset(total, 0, sizeof(*total));
+	pthread_mutex_lock(&countersLock);
+	addCounters(total, &retiredCounters);
+	for (struct scanCounters* counters = liveCounters; counters != 0; counters = counters->next)
+		addCounters(total, counters);
+	pthread_mutex_unlock(&countersLock);
+}
+
+//Memory that lives as long as some stage of the scan comes from arenas: allocating is a
+//pointer bump into a large chunk, and everything in an arena is released at once. Each
+//image's scanArena holds what is needed until it is done, and the fused scan gives each
+//group an arena that is dropped once the group's rows are written. Arenas are not 
+//thread safe.
+#define ARENA_FIRST_CHUNK (64 << 10)
+#define ARENA_LAST_CHUNK (4 << 20) //Chunks double in size up to this
+#define ARENA_HEADER_SIZE 32 //sizeof(struct arenaChunk), rounded up to keep alignment
+
+struct arenaChunk {
+	struct arenaChunk* previous;
+	size_t size; //Bytes after the header
+	size_t used;
+};
+
+struct arena {
+	struct arenaChunk* current; //The chunk being filled, 0 if nothing was allocated
+	size_t nextChunkSize;
+};
+
+
+//Chunks are mapped directly, so they start out zeroed, the pages of a chunk only take up
+//memory once something is written to them, and freeing an arena gives them back at once
+static struct arenaChunk* newArenaChunk(size_t size) {
+	long pageSize = sysconf(_SC_PAGESIZE);
+	size_t mappedSize = (ARENA_HEADER_SIZE + size + pageSize - 1) / pageSize * pageSize;
+	void* memory = mmap(0, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 
+		-1, 0);
+	if (memory == MAP_FAILED) {
+		fprintf(stderr, "Memory allocation error in newArenaChunk\n");
+		exit(1);
+	}
+	struct arenaChunk* chunk = memory;
+	chunk->size = mappedSize - ARENA_HEADER_SIZE;
+	return chunk;
+}
+
+//Returns size zeroed bytes, aligned for any type. Exits on failure.
+static void* arenaAlloc(struct arena* arena, size_t size) {
+	size = (size + 15) & ~(size_t) 15;
+	struct arenaChunk* chunk = arena->current;
+	if (chunk != 0 && chunk->size - chunk->used >= size) {
+		void* memory = (char*) chunk + ARENA_HEADER_SIZE + chunk->used;
+		chunk->used += size;
+		return memory;
+	}
+
+	//Anything too big for the chunks gets one of its own, kept behind the current chunk 
+	//so the space left in that isn't lost
+	if (size > ARENA_LAST_CHUNK / 4) {
+		struct arenaChunk* large = newArenaChunk(size);
+		large->used = size;
+		if (chunk != 0) {
+			large->previous = chunk->previous;
+			chunk->previous = large;
+		}
+		else arena->current = large;
+		return (char*) large + ARENA_HEADER_SIZE;
+	}
+
+	size_t chunkSize = arena->nextChunkSize > 0 ? arena->nextChunkSize : ARENA_FIRST_CHUNK;
+	while (chunkSize < size)
+		chunkSize *= 2;
+	arena->nextChunkSize = chunkSize < ARENA_LAST_CHUNK ? chunkSize * 2 : chunkSize;
+	chunk = newArenaChunk(chunkSize);
+	chunk->previous = arena->current;
+	chunk->used = size;
+	arena->current = chunk;
+	return (char*) chunk + ARENA_HEADER_SIZE;
+}
+
+//Releases everything allocated from the arena
+static void freeArena(struct arena* arena) {
+	struct arenaChunk* chunk = arena->current;
+	while (chunk != 0) {
+		struct arenaChunk* previous = chunk->previous;
+		munmap(chunk, ARENA_HEADER_SIZE + chunk->size);
+		chunk = previous;
+	}
+	arena->current = 0;
+	arena->nextChunkSize = 0;
+}
+
+//A growable list of inode numbers. Inode numbers fit in 32 bits, so they are stored that
+//way, which halves the lists on big file systems.
+struct inodeList {
+	uint32_t* inodes;
+	unsigned long count;
+	unsigned long capacity;
+};
+
+//Makes room for at least count more inodes
+static void reserveInodes(struct inodeList* list, unsigned long count) {
+	if (list->capacity - list->count >= count)
+		return;
+	unsigned long capacity = list->capacity > 0 ? list->capacity : 64;
+	while (capacity - list->count < count)
+		capacity *= 2;
+	list->inodes = realloc(list->inodes, capacity * sizeof(uint32_t));
+	if (list->inodes == 0) {
+		fprintf(stderr, "Memory allocation error in reserveInodes\n");
+		exit(1);
+	}
+	list->capacity = capacity;
+}
+
+static inline void appendInode(struct inodeList* list, uint32_t inode) {
+	if (list->count == list->capacity)
+		reserveInodes(list, 1);
+	list->inodes[list->count++] = inode;
+}
+
+static void appendInodes(struct inodeList* list, const struct inodeList* source) {
+	reserveInodes(list, source->count);
+	memcpy(list->inodes + list->count, source->inodes, source->count * sizeof(uint32_t));
+	list->count += source->count;
+}
+
+static void freeInodeList(struct inodeList* list) {
+	free(list->inodes);
+	list->inodes = 0;
+	list->count = 0;
+	list->capacity = 0;
+}
 
 /*
 int * containedBlockCount;
@@ -32,630 +257,6498 @@ struct groupDescriptorFields {
 	int freeBlockCount;
 	int freeInodeCount;
 	int directoryCount;
-	char* inodeBitmapBlock;
-	char* blockBitmapBlock;
-	char* inodeTableBlock;
+	uint32_t inodeBitmapBlock;
+	uint32_t blockBitmapBlock;
+	uint32_t inodeTableBlock;
+	int uninitialized; //GROUP_INODE_UNINIT and GROUP_BLOCK_UNINIT, for bitmaps not written
+	unsigned long allocatedListStart; //Index of this group's first entry in allocatedInodes
+	unsigned long allocatedListCount; //Number of allocated inodes in this group
 };
 
-struct groupDescriptorFields* groupDescriptors;
 
-//A list of the inode numbers of allocated inodes
-unsigned long* listOfAllocatedInodes;
-unsigned long allocatedInodeCount;
+//On-disk layouts of the ext2 structures we decode. Every multi-byte field is stored little
+//endian and must be passed through le16/le32 before use.
+struct ext2SuperBlock {
+	uint32_t inodeCount;
+	uint32_t blockCount;
+	uint32_t reservedBlockCount;
+	uint32_t freeBlockCount;
+	uint32_t freeInodeCount;
+	uint32_t firstDataBlock;
+	uint32_t logBlockSize;
+	int32_t logFragmentSize;
+	uint32_t blocksPerGroup;
+	uint32_t fragmentsPerGroup;
+	uint32_t inodesPerGroup;
+	uint32_t mountTime;
+	uint32_t writeTime;
+	uint16_t mountCount;
+	uint16_t maxMountCount;
+	uint16_t magic;
+	uint16_t state;
+	uint16_t errors;
+	uint16_t minorRevision;
+	uint32_t lastCheck;
+	uint32_t checkInterval;
+	uint32_t creatorOS;
+	uint32_t revision;
+	uint16_t defaultReservedUID;
+	uint16_t defaultReservedGID;
+	uint32_t firstInode;
+	uint16_t inodeSize;
+	uint16_t blockGroupNumber;
+	uint32_t featureCompat;
+	uint32_t featureIncompat;
+	uint32_t featureReadOnlyCompat;
+	uint8_t uuid[16];
+	char volumeName[16];
+	char lastMounted[64];
+	uint32_t compressionAlgorithms;
+	uint8_t preallocateBlocks;
+	uint8_t preallocateDirectoryBlocks;
+	uint16_t reservedDescriptorBlocks; //Kept free after the descriptors to grow them
+	uint8_t journalUUID[16];
+	uint32_t journalInode;
+	uint32_t journalDevice;
+	uint32_t lastOrphan;
+	uint32_t hashSeed[4];
+	uint8_t defaultHashVersion;
+	uint8_t journalBackupType;
+	uint16_t descriptorSize; //Bytes per group descriptor, if the 64 bit feature is set
+	uint32_t defaultMountOptions;
+	uint32_t firstMetaGroup;
+	uint32_t creationTime;
+	uint32_t journalBlocks[17];
+	uint32_t blockCountHigh; //Upper 32 bits of blockCount, if the 64 bit feature is set
+} __attribute__((packed));
 
-//A list of the inode numbers that point to directories
-unsigned long* listOfDirectoryInodes;
-unsigned long directoryInodeCount;
+//Incompatible features, which change how the file system has to be read. Only the ones
+//below are understood; the rest are listed in the superblock of file systems that are
+//not ext2, ext3 or ext4 as mke2fs makes them.
+#define FEATURE_INCOMPAT_FILETYPE 0x2
+#define FEATURE_INCOMPAT_RECOVER 0x4 //The journal needs replaying, which is left undone
+#define FEATURE_INCOMPAT_EXTENTS 0x40
+#define FEATURE_INCOMPAT_64BIT 0x80
+#define FEATURE_INCOMPAT_MMP 0x100
+#define FEATURE_INCOMPAT_FLEX_BG 0x200
+#define FEATURE_INCOMPAT_EA_INODE 0x400
+#define FEATURE_INCOMPAT_CSUM_SEED 0x2000
+#define FEATURE_INCOMPAT_LARGEDIR 0x4000
+#define SUPPORTED_INCOMPAT_FEATURES (FEATURE_INCOMPAT_FILETYPE | FEATURE_INCOMPAT_RECOVER \
+	| FEATURE_INCOMPAT_EXTENTS | FEATURE_INCOMPAT_64BIT | FEATURE_INCOMPAT_MMP \
+	| FEATURE_INCOMPAT_FLEX_BG | FEATURE_INCOMPAT_EA_INODE | FEATURE_INCOMPAT_CSUM_SEED \
+	| FEATURE_INCOMPAT_LARGEDIR)
 
-//A list of the inode numbers that contain single, double, and triple indirect pointers
-unsigned long* listOfIndirectInodes;
-unsigned long indirectInodeCount;
+//Read only compatible features that matter here
+#define FEATURE_RO_COMPAT_SPARSE_SUPER 0x1 //Superblock backups only in groups 0, 1 and
+	//powers of 3, 5 and 7
+#define FEATURE_RO_COMPAT_GDT_CSUM 0x10
+#define FEATURE_RO_COMPAT_METADATA_CSUM 0x400
 
+struct ext2GroupDescriptor {
+	uint32_t blockBitmapBlock;
+	uint32_t inodeBitmapBlock;
+	uint32_t inodeTableBlock;
+	uint16_t freeBlockCount;
+	uint16_t freeInodeCount;
+	uint16_t directoryCount;
+	uint16_t flags;
+	uint8_t reserved[12];
+} __attribute__((packed));
 
-//Since the file format is in a little endian format, it is useful to turn those bytes into 
-//a big endian format (expected by the csv) procedurally. This function does this.
-ssize_t preadLittleEndian(int fd, unsigned char* buffer, size_t count, off_t offset) {
-	int readCount = pread(fd, buffer, count, offset);
-	for (int i = 0; i < readCount / 2; i++) {
-		unsigned char temp = buffer[i];
-		buffer[i] = buffer[readCount - i - 1];
-		buffer[readCount - i - 1] = temp;
-	}
-	return readCount;
-}
+//Descriptor flags for groups whose bitmaps haven't been written yet, used by file systems
+//with descriptor checksums. Such a bitmap reads as if nothing but the group's own 
+//metadata was in use.
+#define GROUP_INODE_UNINIT 0x1
+#define GROUP_BLOCK_UNINIT 0x2
 
-//Returns the corresponding integer from a big-endian buffer containing the raw bytes
-unsigned int getIntFromBuffer(unsigned char* buffer, size_t count) {
-	unsigned int returnInt = 0;
-	for (int i = 0; i < count; i++) {
-		returnInt = (returnInt << 8) + buffer[i];
-	}
-	return returnInt;
-}
+//With the 64 bit feature, descriptors are descriptorSize bytes (usually 64) and hold the
+//upper halves of their fields after the ext2 ones
+struct ext4GroupDescriptor {
+	struct ext2GroupDescriptor low;
+	uint32_t blockBitmapBlockHigh;
+	uint32_t inodeBitmapBlockHigh;
+	uint32_t inodeTableBlockHigh;
+	uint16_t freeBlockCountHigh;
+	uint16_t freeInodeCountHigh;
+	uint16_t directoryCountHigh;
+	uint8_t reserved[14];
+} __attribute__((packed));
 
-//Returns the byte offset for a specific inode. Assumes inode group descriptor 
-//is initialized.
-unsigned long getInodeByteOffset(unsigned long inodeNumber) {
-	unsigned long blockGroup = (inodeNumber - 1) / inodesPerGroup;
-	unsigned long localInodeIndex = (inodeNumber - 1) % inodesPerGroup;
+struct ext2Inode {
+	uint16_t mode;
+	uint16_t uid;
+	uint32_t size;
+	uint32_t accessTime;
+	uint32_t creationTime;
+	uint32_t modificationTime;
+	uint32_t deletionTime;
+	uint16_t gid;
+	uint16_t linkCount;
+	uint32_t sectorCount; //In 512 byte units, regardless of block size
+	uint32_t flags;
+	uint32_t osDependent1;
+	uint32_t block[15];
+	uint32_t generation;
+	uint32_t fileACL;
+	uint32_t sizeHigh; //Upper 32 bits of the size for regular files
+	uint32_t fragmentAddress;
+	uint8_t osDependent2[12];
+} __attribute__((packed));
 
-	unsigned long inodeByteOffset = 
-		getIntFromBuffer(groupDescriptors[blockGroup].inodeTableBlock, 4)
-			* blockSize //The byte offset of the inode table for this particular inode
-						//(created by block number of that table * bytes per block)
-		+ localInodeIndex * bytesPerInode; //The number of bytes into the table this
-										   //inode resides
-	return inodeByteOffset;
-}		
+//Inodes with EXTENTS_FLAG set in their flags (only looked at with the extents feature) map
+//their blocks with an extent tree instead of block pointers. i_block then holds the root
+//node: a header, followed by up to 4 entries. Every other node takes up a block. Nodes
+//above the leaves hold index entries, each pointing at the node for the logical blocks 
+//from its logicalBlock on; leaves hold extents, runs of consecutive blocks.
+#define EXTENTS_FLAG 0x80000
+#define EXTENT_MAGIC 0xF30A
+#define MAX_EXTENT_DEPTH 5 //The deepest tree the kernel makes
+#define UNINITIALIZED_EXTENT_LENGTH 32768 //Longer extents are allocated but not written
 
-void readSuperBlock(int fd) {
-	FILE* writeFileStream = fopen("super.csv", "w+");
+struct ext4ExtentHeader {
+	uint16_t magic;
+	uint16_t entryCount;
+	uint16_t maxEntries;
+	uint16_t depth; //0 for a leaf
+	uint32_t generation;
+} __attribute__((packed));
 
-	int superBlockOffset = 1024;
+struct ext4ExtentIndex {
+	uint32_t logicalBlock;
+	uint32_t childLow;
+	uint16_t childHigh;
+	uint16_t unused;
+} __attribute__((packed));
 
-	//Read magic number
-	unsigned char* buffer = malloc(64); 
-	preadLittleEndian(fd, buffer, 2, superBlockOffset + 56); 
-		//1080 is where the magic number resides
-		//no error checking
-	buffer[2] = '\0';
+struct ext4Extent {
+	uint32_t logicalBlock;
+	uint16_t length; //Above UNINITIALIZED_EXTENT_LENGTH if uninitialized
+	uint16_t startHigh;
+	uint32_t startLow;
+} __attribute__((packed));
 
-	fprintf(writeFileStream, "%02x%02x,", 
-		buffer[0], buffer[1]);
+struct ext2DirectoryEntry {
+	uint32_t inode;
+	uint16_t recordLength;
+	uint8_t nameLength;
+	uint8_t fileType;
+	char name[];
+} __attribute__((packed));
 
-	//Read and store total number of inodes
-	preadLittleEndian(fd, buffer, 4, superBlockOffset); //Offset for inode count
-	inodeCount = getIntFromBuffer(buffer, 4);
-	fprintf(writeFileStream, "%d,", inodeCount);
+//Converts a little endian on-disk field to host order. On little endian hosts these are
+//no-ops, so decoding a field is a single (possibly unaligned) load.
+static inline uint16_t le16(uint16_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return value;
+#else
+	return __builtin_bswap16(value);
+#endif
+}
 
-	//Read and store total number of blocks
-	preadLittleEndian(fd, buffer, 4, superBlockOffset + 4); //Offset for block count
-	blockCount = getIntFromBuffer(buffer, 4);
-	fprintf(writeFileStream, "%d,", blockCount);
+static inline uint32_t le32(uint32_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return value;
+#else
+	return __builtin_bswap32(value);
+#endif
+}
 
-	//Read and store block size
-	preadLittleEndian(fd, buffer, 4, superBlockOffset + 24); //Offset for block size
-	blockSize = 1024 << getIntFromBuffer(buffer, 4);
-	fprintf(writeFileStream, "%d,", blockSize);
+static inline uint64_t le64(uint64_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return value;
+#else
+	return __builtin_bswap64(value);
+#endif
+}
 
-	//Read and store fragment size
-	preadLittleEndian(fd, buffer, 4, superBlockOffset + 28); //Offset for fragment size
-	fragmentSize = getIntFromBuffer(buffer, 4);
-	if (fragmentSize > 0) {
-		fragmentSize = 1024 << fragmentSize;
-	}
-	else fragmentSize = 1024 >> -1 * fragmentSize;
-	fprintf(writeFileStream, "%d,", fragmentSize);
+//The image is accessed through a read-only memory mapping whenever possible, so every
+//field can be decoded straight from the mapped bytes instead of costing a syscall. If the
+//image cannot be mapped (e.g. it is larger than the address space) or --cache-mb asks for
+//it, reads go through the block cache instead, into a per-thread window.
+#define IMAGE_WINDOW_SIZE (4 << 20) //Bytes fetched per buffered read
+static __thread unsigned char* imageWindow;
+static __thread size_t imageWindowCapacity;
+static __thread off_t imageWindowStart;
+static __thread size_t imageWindowLength; //0 after the thread moves on to another image
 
-	//Read and store blocks per group
-	preadLittleEndian(fd, buffer, 4, superBlockOffset + 32); //Offset for blocks per group
-	blocksPerGroup = getIntFromBuffer(buffer, 4);
-	fprintf(writeFileStream, "%d,", blocksPerGroup);
+//Images that can't be read at random (a pipe, stdin given as "-", or a gzip, zstd or xz
+//file, which is decompressed by a child process) are streamed: read once, front to back,
+//by the fused scan, which visits metadata in block order. Blocks that the scan skips over
+//are kept in the block cache in case it comes back for them; the cache doubles as a 
+//look-behind buffer. A block it pushes out is written to a sparse spill file, unless the
+//block is known not to be needed: free according to its group's bitmap, metadata that is
+//never read (backup superblocks, unused inode table blocks) or the contents of a regular
+//file. Blocks the scan asks for are marked as not needed once it is done with them.
+struct imageStream {
+	int active;
+	pid_t decompressor; //0 if the stream isn't being decompressed, or has finished
+	const char* decompressorName;
+	unsigned char* buffer; //Bytes read from the stream whose blocks haven't been passed
+	size_t bufferStart; //Offset in buffer of the next block
+	size_t bufferLength;
+	int ended;
+	unsigned long nextBlock; //Blocks before this one have been passed
+	unsigned long blockSize; //From the superblock, read when the stream is opened
+	unsigned long blockCount;
+	unsigned char* discard; //Bitset of blocks whose contents are not needed
+	unsigned char* spilled; //Bitset of blocks in the spill file
+	unsigned char* scratch; //A block fetched from the cache or the spill file
+	int spillFD; //-1 until something is spilled
+	unsigned long spilledBlocks;
+	unsigned long long bytesRead;
+};
 
-	//Read and store inodes per group
-	preadLittleEndian(fd, buffer, 4, superBlockOffset + 40); //Offset for inodes per group
-	inodesPerGroup = getIntFromBuffer(buffer, 4);
-	fprintf(writeFileStream, "%d,", inodesPerGroup);
+//Reads that don't go through the mapping are served from a fixed-budget cache of whole
+//blocks, shared by every phase and thread, so metadata that several phases need (inode
+//table blocks, directory and indirect blocks) is only read from the image once. Slots are
+//recycled with the CLOCK policy.
+#define DEFAULT_CACHE_MB 64
 
-	//Read and store fragments per group
-	preadLittleEndian(fd, buffer, 4, superBlockOffset + 36); //Offset for fragments per group
-	fragmentsPerGroup = getIntFromBuffer(buffer, 4);
-	fprintf(writeFileStream, "%d,", fragmentsPerGroup);
+struct blockCache {
+	pthread_mutex_t lock;
+	unsigned long slotCount; //0 until initBlockCache; reads bypass the cache until then
+	unsigned char* data; //slotCount blocks
+	unsigned long* slotBlock; //Block held by each slot
+	unsigned char* slotUsed;
+	unsigned char* referenced; //CLOCK reference bits
+	long* nextInBucket; //Hash chains threaded through the slots, -1 terminated
+	long* buckets;
+	unsigned long bucketMask;
+	unsigned long clockHand;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
 
-	//Read and store first data block, as well as newline
-	preadLittleEndian(fd, buffer, 4, superBlockOffset + 20); //Offset for fist data block
-	firstDataBlock = getIntFromBuffer(buffer, 4);
-	fprintf(writeFileStream, "%d\n", firstDataBlock);
+static int cacheMegabytes = DEFAULT_CACHE_MB;
 
-	//Get the inode size: needed later
-	preadLittleEndian(fd, buffer, 2, superBlockOffset + 88); //Offset for bytes per inode
-	bytesPerInode = getIntFromBuffer(buffer, 2);
+struct dataExtent {
+	off_t start;
+	off_t end;
+};
 
-	fflush(writeFileStream);
-}
+//A range of the image the phased scan is about to read, see readMetadataPlan
+struct metadataRange {
+	off_t start;
+	off_t end;
+	unsigned char* data; //Its bytes in planBuffer once read, 0 before and if mapped
+};
 
-void readGroupDescriptor(int fd) {
-	FILE* writeFileStream = fopen("group.csv", "w+");
+//Sparse files with more extents than this are read as if they had no holes
+#define MAX_DATA_EXTENTS (1 << 20)
+//Largest hole that getImageBytes can hand out from a mapped image without touching it
+#define ZERO_REGION_SIZE IMAGE_WINDOW_SIZE
 
-	unsigned char* buffer = malloc(16); 
+//Everything known about the image being scanned. Each thread works on one image at a 
+//time, the one image points to; runInParallel's workers share their caller's.
+struct imageContext {
+	//Geometry, from the superblock
+	int inodeCount;
+	int blockCount;
+	int blockSize;
+	int fragmentSize;
+	int blocksPerGroup; 
+	int inodesPerGroup;
+	int fragmentsPerGroup;
+	int firstDataBlock;
+	int numGroups;
+	int bytesPerInode;
+	int firstInode; //First inode that isn't reserved
+	int descriptorSize;
+	int reservedDescriptorBlocks;
+	uint32_t featureIncompat;
+	uint32_t featureReadOnlyCompat;
 
-	//offset for group descriptor
-	int startGroupDescriptor = (firstDataBlock + 1) * blockSize;
+	struct arena scanArena;
+	struct groupDescriptorFields* groupDescriptors;
+	const struct blockSizeDecoders* decoders; //Chosen by selectBlockSizeDecoders
+	//What --check and the lookup index collect during the scan, 0 without either
+	struct consistencyCheck* check;
+	int buildLookupIndex; //Set to build lookupIndex after the scan
+	struct lab3aIndex* lookupIndex; //Left for the caller to free
+	//The inode numbers of allocated inodes, of directories, and of inodes with single, 
+	//double or triple indirect pointers or with extent tree nodes in blocks of their own
+	struct inodeList allocatedInodes;
+	struct inodeList directoryInodes;
+	struct inodeList indirectInodes;
 
-	//Calculate number of block groups
-	numGroups = (blockCount / blocksPerGroup);
-	int lastBlockSize = (blockCount % blocksPerGroup);
+	int imageFD;
+	off_t imageSize;
+	unsigned char* imageMap; //0 if the image could not be mapped
+	//The byte ranges of the image file that hold data, in order, if it is a sparse file.
+	//Everything else is a hole and reads as zero.
+	struct dataExtent* dataExtents;
+	unsigned long dataExtentCount;
+	const unsigned char* zeroRegion; //ZERO_REGION_SIZE zero bytes, if mapped and sparse
+	//The metadata plan of the groups being decoded: ranges in order, merged once read, and
+	//the bytes asked for before merging
+	struct metadataRange* plannedRanges;
+	unsigned long plannedRangeCount;
+	unsigned long plannedRangeCapacity;
+	size_t plannedBytes;
+	unsigned char* planBuffer; //Kept from one plan to the next
+	size_t planBufferCapacity;
+	struct imageStream imageStream;
+	struct blockCache blockCache;
+	char outputDirectory[4096]; //Where the tables go, "." by default
+	int discardTables; //The tables are written to /dev/null, for a lookup index alone
+};
 
-	if (lastBlockSize > 0)
-		numGroups++;
+static __thread struct imageContext* image;
 
-	//printf("num groups %d, leftover blocks %d, blocks per group %d\n", numGroups, blockCount % blocksPerGroup, blocksPerGroup);
+//Sets up an empty context, writing to outputDirectory
+static void initImageContext(struct imageContext* context, const char* outputDirectory) {
+	memset(context, 0, sizeof(*context));
+	context->imageFD = -1;
+	context->imageStream.spillFD = -1;
+	pthread_mutex_init(&context->blockCache.lock, 0);
+	snprintf(context->outputDirectory, sizeof(context->outputDirectory), "%s", 
+		outputDirectory);
+}
 
-	groupDescriptors = malloc(numGroups * sizeof(struct groupDescriptorFields));
-	if (groupDescriptors == 0) {
-		fprintf(stderr, "Memory allocation error at 161\n");
-	}
+static inline int testStreamBit(const unsigned char* bits, unsigned long block) {
+	return block < image->imageStream.blockCount && (bits[block / 8] >> (block % 8)) & 1;
+}
 
-	int i;
-	//read and store group descriptor values for each group
-	for (i = 0; i < numGroups; i++){
-		//Read and store number of free blocks
-		preadLittleEndian(fd, buffer, 2, startGroupDescriptor + (32*i) + 12); //Offset for free blocks
-		groupDescriptors[i].freeBlockCount = getIntFromBuffer(buffer, 2);
+static inline void setStreamBit(unsigned char* bits, unsigned long block) {
+	if (block < image->imageStream.blockCount)
+		bits[block / 8] |= 1 << (block % 8);
+}
 
-		//Calculate number of contained blocks
-		if (i == numGroups - 1 && lastBlockSize > 0)
-			groupDescriptors[i].containedBlockCount = lastBlockSize;
-		else
-			groupDescriptors[i].containedBlockCount = blocksPerGroup;
+//Marks count blocks starting at first as not needed
+static void discardStreamBlocks(unsigned long first, unsigned long count) {
+	struct imageStream* imageStream = &image->imageStream;
+	if (first >= imageStream->blockCount)
+		return;
+	if (count > imageStream->blockCount - first)
+		count = imageStream->blockCount - first;
+	for (unsigned long block = first; block < first + count; block++)
+		setStreamBit(image->imageStream.discard, block);
+}
 
-		//Read and store number of free inodes
-		preadLittleEndian(fd, buffer, 2, startGroupDescriptor + (32*i) + 14); //Offset for free inodes
-		groupDescriptors[i].freeInodeCount = getIntFromBuffer(buffer, 2);
+//Saves a block the scan has passed and may still need. Exits on failure.
+static void spillStreamBlock(unsigned long block, const unsigned char* data) {
+	struct imageStream* imageStream = &image->imageStream;
+	if (testStreamBit(imageStream->discard, block) 
+			|| testStreamBit(imageStream->spilled, block))
+		return;
+	if (imageStream->spillFD == -1) {
+		//Unlinked straight away, so it goes away with the process
+		const char* directory = getenv("TMPDIR");
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/lab3a-spill-XXXXXX", 
+			directory != 0 ? directory : "/tmp");
+		imageStream->spillFD = mkstemp(path);
+		if (imageStream->spillFD == -1) {
+			perror(path);
+			exit(1);
+		}
+		unlink(path);
+	}
+	//Each block is stored at its own offset; the rest of the file stays a hole
+	if (pwrite(imageStream->spillFD, data, imageStream->blockSize, 
+			(off_t) block * imageStream->blockSize) != (ssize_t) imageStream->blockSize) {
+		perror("Error writing the spill file");
+		exit(1);
+	}
+	countEvents(&threadCounters.syscalls, 1);
+	setStreamBit(imageStream->spilled, block);
+	imageStream->spilledBlocks++;
+}
 
-		//Read and store number of directories
-		preadLittleEndian(fd, buffer, 2, startGroupDescriptor + (32*i) + 16); //Offset for directories
-		groupDescriptors[i].directoryCount = getIntFromBuffer(buffer, 2);
+static inline unsigned long hashBlock(unsigned long block) {
+	return (block * 0x9E3779B97F4A7C15ULL) >> 17;
+}
 
-		//allocate space for hex values
-		groupDescriptors[i].inodeBitmapBlock = malloc(4 * sizeof(char));
-		groupDescriptors[i].blockBitmapBlock = malloc(4 * sizeof(char));
-		groupDescriptors[i].inodeTableBlock = malloc(4 * sizeof(char));
+//Sizes the cache for the configured budget. Needs blockSize, so call after readSuperBlock.
+static void initBlockCache() {
+	struct blockCache* blockCache = &image->blockCache;
+	unsigned long slots = ((unsigned long) cacheMegabytes << 20) / image->blockSize;
+	if (slots == 0)
+		slots = 1;
+	unsigned long bucketCount = 1;
+	while (bucketCount < slots)
+		bucketCount <<= 1;
 
-		preadLittleEndian(fd, groupDescriptors[i].inodeBitmapBlock, 4, startGroupDescriptor + (32*i) + 4); //Offset for inode bitmap block
-		groupDescriptors[i].inodeBitmapBlock[4] = '\0';
+	blockCache->data = arenaAlloc(&image->scanArena, slots * image->blockSize);
+	blockCache->slotBlock = arenaAlloc(&image->scanArena, slots * sizeof(unsigned long));
+	blockCache->slotUsed = arenaAlloc(&image->scanArena, slots);
+	blockCache->referenced = arenaAlloc(&image->scanArena, slots);
+	blockCache->nextInBucket = arenaAlloc(&image->scanArena, slots * sizeof(long));
+	blockCache->buckets = arenaAlloc(&image->scanArena, bucketCount * sizeof(long));
+	for (unsigned long i = 0; i < bucketCount; i++)
+		blockCache->buckets[i] = -1;
+	blockCache->bucketMask = bucketCount - 1;
+	blockCache->slotCount = slots;
+}
 
-		preadLittleEndian(fd, groupDescriptors[i].blockBitmapBlock, 4, startGroupDescriptor + (32*i)); //Offset for inode bitmap block
-		groupDescriptors[i].blockBitmapBlock[4] = '\0';
+//Returns the slot holding block, or -1. Caller holds the lock.
+static long findCacheSlot(unsigned long block) {
+	struct blockCache* blockCache = &image->blockCache;
+	long slot = blockCache->buckets[hashBlock(block) & blockCache->bucketMask];
+	while (slot != -1 && blockCache->slotBlock[slot] != block)
+		slot = blockCache->nextInBucket[slot];
+	return slot;
+}
 
-		preadLittleEndian(fd, groupDescriptors[i].inodeTableBlock, 4, startGroupDescriptor + (32*i) + 8); //Offset for inode table block
-		groupDescriptors[i].inodeTableBlock[4] = '\0';
+//Copies a block into the cache, evicting another if needed. Caller holds the lock.
+static void insertCacheBlock(unsigned long block, const unsigned char* data) {
+	struct blockCache* blockCache = &image->blockCache;
+	if (findCacheSlot(block) != -1)
+		return; //Another thread got there first
 
-		//print stuff
-		fprintf(writeFileStream, "%d,%d,%d,%d,", 
-			groupDescriptors[i].containedBlockCount, groupDescriptors[i].freeBlockCount, 
-			groupDescriptors[i].freeInodeCount, groupDescriptors[i].directoryCount);
-
-		const char * temp = groupDescriptors[i].inodeBitmapBlock;
-		int j;
-
-		fprintf(writeFileStream, "%x,", getIntFromBuffer(groupDescriptors[i].inodeBitmapBlock, 4));
-		fprintf(writeFileStream, "%x,", getIntFromBuffer(groupDescriptors[i].blockBitmapBlock, 4));
-		fprintf(writeFileStream, "%x\n", getIntFromBuffer(groupDescriptors[i].inodeTableBlock, 4));
-		/*
-		int start = 0;
-		for (j = 0; j < 4; j++){
-			if (groupDescriptors[i].inodeBitmapBlock[j] != 0 | start == 1){
-				fprintf(writeFileStream, "%02x", groupDescriptors[i].inodeBitmapBlock[j]);
-				start = 1;
-			}
-		}
-		start = 0;
-		fprintf(writeFileStream, ",");
-		for (j = 0; j < 4; j++){
-			if (groupDescriptors[i].blockBitmapBlock[j] != 0 | start == 1){
-				fprintf(writeFileStream, "%02x", groupDescriptors[i].blockBitmapBlock[j]);
-				start = 1;
-			}
-		}
-		start = 0;
-		fprintf(writeFileStream, ",");
-		for (j = 0; j < 4; j++){
-			if (groupDescriptors[i].inodeTableBlock[j] != 0 | start == 1){
-				fprintf(writeFileStream, "%02x", groupDescriptors[i].inodeTableBlock[j]);
-				start = 1;
-			}
-		}
-		*/
-		//fprintf(writeFileStream, "\n");
+	//Advance the clock hand past recently used slots, clearing their reference bits
+	while (blockCache->slotUsed[blockCache->clockHand] 
+			&& blockCache->referenced[blockCache->clockHand]) {
+		blockCache->referenced[blockCache->clockHand] = 0;
+		blockCache->clockHand = (blockCache->clockHand + 1) % blockCache->slotCount;
 	}
-}
-
-//Prints the block number of a free block and the map that free information came from
-//into the corresponding csv. 
-void readFreeBitmapEntry(int fd) {
-	FILE* writeFileStream = fopen("bitmap.csv", "w+");
-
-	listOfAllocatedInodes = malloc(inodeCount * sizeof(unsigned long));
-	if (listOfAllocatedInodes == 0) {
-		fprintf(stderr, "Memory allocation error at 213\n");
-	}
-	allocatedInodeCount = 0;
-
-	//For each group...
-	for (int group = 0; group < numGroups; group++) {
-		struct groupDescriptorFields fields = groupDescriptors[group];
-		//For the data bitmap...
-		//Extract data bitmap location
-		unsigned long blockBitmapBlock = getIntFromBuffer(fields.blockBitmapBlock, 4);
-		
-
-		//CRITICAL ASSUMPTION: BLOCK BITMAP CONTAINS METADATA BLOCKS
-		//CRITICAL ASSUMPTION: EMPTY BLOCK IS NOT INCLUDED IN BLOCK BITMAP
-
-
-		//Obtain which index the first data block of this group corresponds to
-		//unsigned long dataBlockStartOffset = inodeTableBlock 
-		//	+ (bytesPerInode * inodesPerGroup + blockSize - 1) / blockSize;
-			//The block number of the start of the inode table + the size of the inode table
-			//in blocks
-		unsigned long dataBlockStartOffset = 
-			1 + group * groupDescriptors[0].containedBlockCount;
-		unsigned long blockBitmapByteOffset = blockBitmapBlock * blockSize;
-
-		for (int i = 0; i < fields.containedBlockCount; i++) {
-			unsigned char buffer;
-			pread(fd, &buffer, 1, blockBitmapByteOffset + i / 8);
-			unsigned int bitmask = 0x1 << (i % 8);
-			if (!(bitmask & buffer)) {
-				//Found an empty data block, mark accordingly
-				fprintf(writeFileStream, "%lx,%lu\n", blockBitmapBlock,
-					dataBlockStartOffset + i);
-			}
-		}
+	long slot = blockCache->clockHand;
+	blockCache->clockHand = (blockCache->clockHand + 1) % blockCache->slotCount;
 
+	if (blockCache->slotUsed[slot]) {
+		//A streamed block can't be read again, so keep it if it may still be needed
+		if (image->imageStream.active)
+			spillStreamBlock(blockCache->slotBlock[slot], 
+				blockCache->data + (size_t) slot * image->blockSize);
 
-		//For the inode bitmap...
-		//Extract inode bitmap location
-		unsigned long inodeBitmapBlock = getIntFromBuffer(fields.inodeBitmapBlock, 4);
+		//Unlink the victim from its hash chain
+		long* link = &blockCache->buckets[hashBlock(blockCache->slotBlock[slot]) 
+			& blockCache->bucketMask];
+		while (*link != slot)
+			link = &blockCache->nextInBucket[*link];
+		*link = blockCache->nextInBucket[slot];
+		blockCache->evictions++;
+	}
 
-		//Obtain some inode block offset start location //TODO
-		unsigned long inodeStartOffset = 1 + group * inodesPerGroup;
-		unsigned long inodeByteStartOffset = inodeBitmapBlock * blockSize;
+	long* bucket = &blockCache->buckets[hashBlock(block) & blockCache->bucketMask];
+	blockCache->slotBlock[slot] = block;
+	blockCache->slotUsed[slot] = 1;
+	blockCache->referenced[slot] = 1;
+	blockCache->nextInBucket[slot] = *bucket;
+	*bucket = slot;
+	memcpy(blockCache->data + (size_t) slot * image->blockSize, data, image->blockSize);
+}
 
-		for (int i = 0; i < inodesPerGroup; i++) {
-			unsigned char buffer;
-			pread(fd, &buffer, 1, inodeByteStartOffset + i / 8);
-			unsigned int bitmask = 0x1 << (i % 8);
-			if (!(bitmask & buffer)) {
-				//Found an empty data block, mark accordingly
-				fprintf(writeFileStream, "%lx,%lu\n", inodeBitmapBlock,
-					inodeStartOffset + i);
-			}
-			else {
-				listOfAllocatedInodes[allocatedInodeCount] = inodeStartOffset + i;
-				allocatedInodeCount++;
-			}
-		}
+//Copies block into dest and returns 1 if it is cached, otherwise returns 0
+static int copyCachedBlock(unsigned long block, unsigned char* dest) {
+	struct blockCache* blockCache = &image->blockCache;
+	pthread_mutex_lock(&blockCache->lock);
+	long slot = findCacheSlot(block);
+	if (slot != -1) {
+		memcpy(dest, blockCache->data + (size_t) slot * image->blockSize, image->blockSize);
+		blockCache->referenced[slot] = 1;
+		blockCache->hits++;
 	}
-	fflush(writeFileStream);
+	else blockCache->misses++;
+	pthread_mutex_unlock(&blockCache->lock);
+	return slot != -1;
 }
 
-//Reads in inodes, populates pointers to denote found indoes with certain properties, 
-//and creates the csv
-void readInodes(int fd) {
-	FILE* writeFileStream = fopen("inode.csv", "w+");
+static void cacheBlock(unsigned long block, const unsigned char* data) {
+	struct blockCache* blockCache = &image->blockCache;
+	pthread_mutex_lock(&blockCache->lock);
+	insertCacheBlock(block, data);
+	pthread_mutex_unlock(&blockCache->lock);
+}
 
-	listOfDirectoryInodes = malloc(allocatedInodeCount * sizeof(unsigned long));
-	directoryInodeCount = 0;
+//Returns the program that decompresses an image starting with magic, or 0 if it isn't
+//compressed
+static const char* getDecompressor(const unsigned char* magic, ssize_t length) {
+	if (length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return "gzip";
+	if (length >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+		return "zstd";
+	if (length >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+		return "xz";
+	return 0;
+}
 
-	if (listOfDirectoryInodes == 0) {
-		fprintf(stderr, "Memory allocation error at 281\n");
+//Replaces imageFD with a pipe from a child running "decompressor -dc" on it
+static void startDecompressor(const char* decompressor, const char* programName) {
+	struct imageStream* imageStream = &image->imageStream;
+	int pipeFDs[2];
+	if (pipe(pipeFDs) == -1) {
+		perror(programName);
+		exit(1);
+	}
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror(programName);
+		exit(1);
 	}
+	if (pid == 0) {
+		dup2(image->imageFD, 0);
+		dup2(pipeFDs[1], 1);
+		close(pipeFDs[0]);
+		close(pipeFDs[1]);
+		execlp(decompressor, decompressor, "-dc", (char*) 0);
+		perror(decompressor);
+		_exit(127);
+	}
+	close(pipeFDs[1]);
+	close(image->imageFD);
+	image->imageFD = pipeFDs[0];
+	imageStream->decompressor = pid;
+	imageStream->decompressorName = decompressor;
+}
 
-	listOfIndirectInodes = malloc(allocatedInodeCount * sizeof(unsigned long));
-	indirectInodeCount = 0;
+//Reads from the stream until count bytes past the next block are buffered. Whatever
+//lies past the end of the stream reads as zero.
+static void fillStream(size_t count) {
+	struct imageStream* imageStream = &image->imageStream;
+	if (imageStream->bufferLength - imageStream->bufferStart >= count)
+		return;
+	memmove(imageStream->buffer, imageStream->buffer + imageStream->bufferStart, 
+		imageStream->bufferLength - imageStream->bufferStart);
+	imageStream->bufferLength -= imageStream->bufferStart;
+	imageStream->bufferStart = 0;
 
-	if (listOfIndirectInodes == 0) {
-		fprintf(stderr, "Memory allocation error at 282\n");
+	unsigned long long start = collectStats ? currentNanoseconds() : 0;
+	while (!imageStream->ended && imageStream->bufferLength < IMAGE_WINDOW_SIZE) {
+		ssize_t readCount = read(image->imageFD, 
+			imageStream->buffer + imageStream->bufferLength, 
+			IMAGE_WINDOW_SIZE - imageStream->bufferLength);
+		countEvents(&threadCounters.syscalls, 1);
+		if (readCount == -1 && errno == EINTR)
+			continue;
+		if (readCount <= 0) {
+			imageStream->ended = 1;
+			break;
+		}
+		imageStream->bufferLength += readCount;
+		imageStream->bytesRead += readCount;
+		countEvents(&threadCounters.bytesRead, readCount);
+		if (imageStream->bufferLength >= count)
+			break;
 	}
+	if (collectStats)
+		countEvents(&threadCounters.ioNanoseconds, currentNanoseconds() - start);
 
-	//From the list of populated inodes created in readFreeBitmapEntry, iterate through
-	//populated list. 
+	//A decompressor that stops early has failed, unless the image really is that short
+	if (imageStream->ended && imageStream->decompressor != 0) {
+		int status;
+		waitpid(imageStream->decompressor, &status, 0);
+		imageStream->decompressor = 0;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Error decompressing the image: %s failed\n", 
+				imageStream->decompressorName);
+			exit(1);
+		}
+	}
+	if (imageStream->bufferLength < count) {
+		memset(imageStream->buffer + imageStream->bufferLength, 0, 
+			count - imageStream->bufferLength);
+		imageStream->bufferLength = count;
+	}
+}
 
-	for (int i = 0; i < allocatedInodeCount; i++) {
-		unsigned long currentInodeNumber = listOfAllocatedInodes[i];
-		//Locate the inode from the inode number
-		unsigned long inodeByteOffset = getInodeByteOffset(currentInodeNumber);
+//Sets up streaming from imageFD. The superblock is read ahead of time for the block size 
+//and count, which size everything else. Returns -1 if it isn't an ext2 image.
+static int openImageStream(const char* path) {
+	struct imageStream* imageStream = &image->imageStream;
+	imageStream->active = 1;
+	imageStream->buffer = arenaAlloc(&image->scanArena, IMAGE_WINDOW_SIZE);
+	fillStream(2048);
+	const struct ext2SuperBlock* superBlock = 
+		(const struct ext2SuperBlock*) (imageStream->buffer + 1024);
+	if (le16(superBlock->magic) != 0xEF53 || le32(superBlock->logBlockSize) > 6) {
+		fprintf(stderr, "%s: not an ext2 image\n", path);
+		return -1;
+	}
+	imageStream->blockSize = 1024 << le32(superBlock->logBlockSize);
+	imageStream->blockCount = le32(superBlock->blockCount);
+	unsigned long bitsetSize = imageStream->blockCount / 8 + 1;
+	imageStream->discard = arenaAlloc(&image->scanArena, bitsetSize);
+	imageStream->spilled = arenaAlloc(&image->scanArena, bitsetSize);
+	imageStream->scratch = arenaAlloc(&image->scanArena, imageStream->blockSize);
+	discardStreamBlocks(0, le32(superBlock->firstDataBlock)); //The boot block
+	return 0;
+}
 
-		//Write inode number to inode.csv
-		fprintf(writeFileStream, "%lu,", currentInodeNumber);
-
-		//Get the file type of the inode. We only care about regular files 'f', 
-		//directories 'd', and symbolic links 's'. Everything else is marked with '?'.
-		unsigned char buffer[64];
-		preadLittleEndian(fd, buffer, 2, inodeByteOffset + 0); //Offset for mode info
-		unsigned int modeInfo = getIntFromBuffer(buffer, 2);
-		if ((modeInfo & 0xA000) == 0xA000) //Symbolic link 
-			fprintf(writeFileStream, "s,");
-		else if ((modeInfo & 0x8000) == 0x8000) //Regular file
-			fprintf(writeFileStream, "f,");
-		else if ((modeInfo & 0x4000) == 0x4000) { 
-			//Directory. Also needs to add this into directory 
-			//structure
-			fprintf(writeFileStream, "d,");
-			listOfDirectoryInodes[directoryInodeCount] = currentInodeNumber;
-			directoryInodeCount++;
-		}
-		else fprintf(writeFileStream, "?,");
-
-		//Print the full mode info
-		fprintf(writeFileStream, "%o,", modeInfo);
-
-		//Print owner info
-		preadLittleEndian(fd, buffer, 2, inodeByteOffset + 2); //Offset for UID
-		fprintf(writeFileStream, "%d,", getIntFromBuffer(buffer, 2));
-
-		//Print group id
-		preadLittleEndian(fd, buffer, 2, inodeByteOffset + 24); //Offset for GID
-		fprintf(writeFileStream, "%d,", getIntFromBuffer(buffer, 2));
-
-		//Print link count
-		preadLittleEndian(fd, buffer, 2, inodeByteOffset + 26); //Offset for link count
-		fprintf(writeFileStream, "%d,", getIntFromBuffer(buffer, 2));
-
-		//Creation time (hexedecimal)
-		preadLittleEndian(fd, buffer, 4, inodeByteOffset + 12); //Offset for creation time
-		fprintf(writeFileStream, "%x,", getIntFromBuffer(buffer, 4)); //Written in hex
-
-		//Modification time (hexedecimal)
-		preadLittleEndian(fd, buffer, 4, inodeByteOffset + 16); //Offset for Modification time
-		fprintf(writeFileStream, "%x,", getIntFromBuffer(buffer, 4)); //Written in hex
-
-		//Access time (hexedecimal)
-		preadLittleEndian(fd, buffer, 4, inodeByteOffset + 8); //Offset for Access time
-		fprintf(writeFileStream, "%x,", getIntFromBuffer(buffer, 4)); //Written in hex
-
-		//File size
-		preadLittleEndian(fd, buffer, 4, inodeByteOffset + 4); //Offset for lower 32 bytes
-		unsigned int lower32 = getIntFromBuffer(buffer, 4);
-		unsigned int upper32 = 0;
-		if (modeInfo & 0x8000) { //Regular file, might have higher 32
-			preadLittleEndian(fd, buffer, 4, inodeByteOffset + 108); 
-				//Offset for upper 32 bytes
-			upper32 = getIntFromBuffer(buffer, 4);
-		}
-		if (upper32 == 0) {
-			fprintf(writeFileStream, "%u,", lower32);
+//Lists the data extents of the image file with SEEK_DATA and SEEK_HOLE. Leaves the list
+//empty if the file has no holes, or if the file system can't tell.
+static void findDataExtents() {
+	unsigned long capacity = 0;
+	off_t offset = 0;
+	int known = 1;
+	while (offset < image->imageSize) {
+		off_t dataStart = lseek(image->imageFD, offset, SEEK_DATA);
+		if (dataStart == -1) {
+			//ENXIO means there is no data past offset
+			known = errno == ENXIO;
+			break;
 		}
-		else {
-			unsigned long long total = ((unsigned long long) upper32 << 32) 
-				+ (unsigned long long) lower32;
-			fprintf(writeFileStream, "%llu,", total);
-		}
-
-		//File system block count
-		preadLittleEndian(fd, buffer, 4, inodeByteOffset + 28);
-		unsigned int smallBlockChunks = getIntFromBuffer(buffer, 4);
-		//Number of file system blocks is dependent on the block size
-		unsigned int blockChunk = 
-			(smallBlockChunks * 512 + blockSize - 1) / (blockSize); //Block size rounded up
-		fprintf(writeFileStream, "%u", blockChunk); //Note no comma here due to how
-													//we do block pointer separation
-
-		//Block pointers
-		unsigned int blockPointerArrayOffset = 40;
-		int added = 0;
-		for (int j = 0; j < 15; j++) {
-			//Read the ith pointer. Each pointer is 4 bytes wide. 
-			preadLittleEndian(fd, buffer, 4, 
-				inodeByteOffset + blockPointerArrayOffset + j * 4);
-			//First add a comma, then write the pointer
-			int pointerValue = getIntFromBuffer(buffer, 4);
-			fprintf(writeFileStream, ",%x", pointerValue);
-			if (pointerValue != 0 && j >= 12 && !added) { 
-				//Pointer 12 on points to indirect pointers and we haven't already added it
-				listOfIndirectInodes[indirectInodeCount] = currentInodeNumber;
-				indirectInodeCount++;
-				added = 1;
+		off_t dataEnd = lseek(image->imageFD, dataStart, SEEK_HOLE);
+		if (dataEnd == -1 || image->dataExtentCount == MAX_DATA_EXTENTS) {
+			known = 0;
+			break;
+		}
+		if (image->dataExtentCount == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 64;
+			image->dataExtents = 
+				realloc(image->dataExtents, capacity * sizeof(struct dataExtent));
+			if (image->dataExtents == 0) {
+				fprintf(stderr, "Memory allocation error in findDataExtents\n");
+				exit(1);
 			}
 		}
-		fprintf(writeFileStream, "\n");
-		fflush(writeFileStream);
+		image->dataExtents[image->dataExtentCount++] = 
+			(struct dataExtent) { dataStart, dataEnd };
+		offset = dataEnd;
+	}
+	if (!known || image->dataExtentCount == 0 || (image->dataExtentCount == 1 
+			&& image->dataExtents[0].start == 0 
+			&& image->dataExtents[0].end >= image->imageSize)) {
+		free(image->dataExtents);
+		image->dataExtents = 0;
+		image->dataExtentCount = 0;
 	}
 }
 
-void readDirectories(int fd){
-	FILE* writeFileStream = fopen("directory.csv", "w+");
-	//For every directory inode, loop
-	//save field values here
-	int i, j;
-	unsigned long parentDirInode;
-	int entryNo;
-	int entryLen = 0; //start at offset 0 when looking at directory entries
-	int nameLen;
-	int entryInode;
-	unsigned char * name = malloc(256);
+//Returns the length of the part of [offset, offset + count) that starts at offset and is
+//either all data or all hole, setting *isHole accordingly. Bytes past the end of the 
+//image count as a hole.
+static size_t getExtentRun(off_t offset, size_t count, int* isHole) {
+	if (image->dataExtentCount == 0) {
+		*isHole = 0;
+		return count;
+	}
+	//Find the first extent that ends after offset
+	unsigned long low = 0;
+	unsigned long high = image->dataExtentCount;
+	while (low < high) {
+		unsigned long middle = (low + high) / 2;
+		if (image->dataExtents[middle].end <= offset)
+			low = middle + 1;
+		else high = middle;
+	}
+	off_t runEnd;
+	if (low < image->dataExtentCount && image->dataExtents[low].start <= offset) {
+		*isHole = 0;
+		runEnd = image->dataExtents[low].end;
+	}
+	else {
+		*isHole = 1;
+		runEnd = low < image->dataExtentCount ? image->dataExtents[low].start 
+			: offset + (off_t) count;
+	}
+	return runEnd - offset < (off_t) count ? (size_t) (runEnd - offset) : count;
+}
 
-	//int lastDirectoryEntryFound = 0;
+//Returns whether [offset, offset + count) lies entirely within holes of the image
+static inline int isImageHole(off_t offset, size_t count) {
+	int isHole;
+	return image->dataExtentCount > 0 && getExtentRun(offset, count, &isHole) == count 
+		&& isHole;
+}
 
-	unsigned char* blockNumBuffer = malloc(64);
-	/*
-	if (blockNumBuffer == 0) {
-		printf("blockNumberBoffer == 0\n");
+//Opens the disk image, mapping it unless mapImage is 0. The image is streamed if stream
+//is set, or if it can only be read front to back: "-" for stdin, a pipe or a compressed 
+//file. Returns -1 if it can't be opened.
+static int openImage(const char* path, const char* programName, int mapImage, int stream) {
+	if (strcmp(path, "-") == 0)
+		image->imageFD = 0;
+	else image->imageFD = open(path, O_RDONLY | O_LARGEFILE);
+	if (image->imageFD == -1) {
+		fprintf(stderr, "%s: %s: %s\n", programName, path, strerror(errno));
+		return -1;
 	}
-	*/
-	//unsigned char* directoryBlock = malloc(64);
-	unsigned char* generalBuffer = malloc(64);
 
-	//printf("%lu\n", directoryInodeCount);
-
-	for (i = 0; i < directoryInodeCount; i++){ // loop through directory inodes
-		//printf("%d\n", i);
-		//get parent inode number
-		parentDirInode = listOfDirectoryInodes[i];
+	struct stat status;
+	int statusKnown = fstat(image->imageFD, &status) == 0;
+	if (statusKnown && !S_ISREG(status.st_mode) && !S_ISBLK(status.st_mode))
+		stream = 1;
+	else {
+		unsigned char magic[6];
+		const char* decompressor = getDecompressor(magic, pread(image->imageFD, magic, 6, 0));
+		if (decompressor != 0) {
+			startDecompressor(decompressor, programName);
+			stream = 1;
+		}
+	}
+	if (stream) {
+		image->imageSize = 0;
+		image->imageMap = 0;
+		return openImageStream(path);
+	}
 
-		//printf("%lu\n", parentDirInode);
+	//Block devices report a size of 0 through fstat, so ask lseek instead
+	image->imageSize = lseek(image->imageFD, 0, SEEK_END);
+	//Only files allocate less than their size
+	if (statusKnown && S_ISREG(status.st_mode) 
+			&& status.st_blocks * 512 < (unsigned long long) status.st_size)
+		findDataExtents();
+	if (!mapImage || image->imageSize <= 0 
+			|| (unsigned long long) image->imageSize > (size_t) -1) {
+		image->imageMap = 0;
+		return 0;
+	}
 
-		int parentInodeOffset = getInodeByteOffset(parentDirInode);
+	void* map = mmap(0, image->imageSize, PROT_READ, MAP_SHARED, image->imageFD, 0);
+	image->imageMap = (map == MAP_FAILED) ? 0 : map;
 
-		//keep track of entry number
-		entryNo = -1;
-		entryLen = 0;
+	//Holes of a mapped image are served from anonymous memory, which reads as zero 
+	//without the kernel filling page cache pages for them
+	if (image->imageMap != 0 && image->dataExtentCount > 0) {
+		void* zeroRegion = 
+			mmap(0, ZERO_REGION_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		image->zeroRegion = (zeroRegion == MAP_FAILED) ? 0 : zeroRegion;
+	}
+	return 0;
+}
 
-		//loop through blocks pointed to by parent inode
-		for (j = 0; j < 15; j++){
-			/*
-			//check that last entry hasn't been found yet
-			if (lastDirectoryEntryFound){
+//Reads count bytes at offset straight from the image into buffer, zero filling anything 
+//past the end of the image. Holes of a sparse image are zero filled without reading them.
+static void readImageDirect(unsigned char* buffer, off_t offset, size_t count) {
+	unsigned long long start = collectStats ? currentNanoseconds() : 0;
+	size_t done = 0;
+	while (done < count) {
+		int isHole;
+		size_t runLength = getExtentRun(offset + done, count - done, &isHole);
+		size_t filled = 0;
+		while (!isHole && filled < runLength) {
+			ssize_t readCount = pread(image->imageFD, buffer + done + filled, 
+				runLength - filled, offset + done + filled);
+			countEvents(&threadCounters.syscalls, 1);
+			if (readCount <= 0)
 				break;
-			}
-			*/
-			//copy data block number from parent inode
-			preadLittleEndian(fd, blockNumBuffer, 4, parentInodeOffset + 40 + (4*j));
-			//blockNumBuffer[4] = '\0';
-			//printf("%s\n", blockNumBuffer);
-			//if pointer is zero, no more data blocks to point to
-			if (getIntFromBuffer(blockNumBuffer, 4) == 0){
-				break;
-			}
-			//find block offset with directory entries
-			int directoryBlockOffset = getIntFromBuffer(blockNumBuffer, 4) * blockSize;
-
-			//keep track of where in block the current spot is
-			int currentEntryOffset = directoryBlockOffset;
+			filled += readCount;
+		}
+		memset(buffer + done + filled, 0, runLength - filled);
+		countEvents(&threadCounters.bytesRead, filled);
+		done += runLength;
+		if (!isHole && filled < runLength)
+			break;
+	}
+	memset(buffer + done, 0, count - done);
+	if (collectStats)
+		countEvents(&threadCounters.ioNanoseconds, currentNanoseconds() - start);
+}
 
-			//for every entry, until last entry is found / reaches end of block
-			while ((currentEntryOffset - directoryBlockOffset) < blockSize){
-				//increment entry number - this is why it starts at -1, because the first entry is 0
-				entryNo++;
+//Fills dest with count blocks starting at firstBlock: from the cache where possible, and
+//otherwise with one read per run of missing blocks, which are then cached
+static void readCachedBlocks(unsigned long firstBlock, unsigned long count, unsigned char* dest) {
+	struct blockCache* blockCache = &image->blockCache;
+	pthread_mutex_lock(&blockCache->lock);
+	unsigned long i = 0;
+	while (i < count) {
+		long slot = findCacheSlot(firstBlock + i);
+		if (slot != -1) {
+			memcpy(dest + i * image->blockSize, 
+				blockCache->data + (size_t) slot * image->blockSize, image->blockSize);
+			blockCache->referenced[slot] = 1;
+			blockCache->hits++;
+			i++;
+			continue;
+		}
 
-				//printf("%d\n", currentEntryOffset);
+		unsigned long runEnd = i + 1;
+		while (runEnd < count && findCacheSlot(firstBlock + runEnd) == -1)
+			runEnd++;
+		blockCache->misses += runEnd - i;
 
-				//Read inode number of entry
-				preadLittleEndian(fd, generalBuffer, 4, currentEntryOffset);
-				entryInode = getIntFromBuffer(generalBuffer, 4);
+		//Don't hold up other threads' cache hits during the read
+		pthread_mutex_unlock(&blockCache->lock);
+		readImageDirect(dest + i * image->blockSize, 
+			(off_t) (firstBlock + i) * image->blockSize, (runEnd - i) * image->blockSize);
+		pthread_mutex_lock(&blockCache->lock);
 
-				//Read rec_len
-				preadLittleEndian(fd, generalBuffer, 2, currentEntryOffset + 4);
-				entryLen = getIntFromBuffer(generalBuffer, 2);
-				//printf("%d\n", entryLen);
+		for (; i < runEnd; i++)
+			insertCacheBlock(firstBlock + i, dest + i * image->blockSize);
+	}
+	pthread_mutex_unlock(&blockCache->lock);
+}
 
-/*
-				if (entryLen == 0)
-					break;
-					*/
+//Passes the stream's next block: it is dropped if it's known not to be needed and kept
+//in the look-behind buffer otherwise
+static void passStreamBlock() {
+	struct imageStream* imageStream = &image->imageStream;
+	unsigned long block = imageStream->nextBlock++;
+	fillStream(imageStream->blockSize);
+	const unsigned char* data = imageStream->buffer + imageStream->bufferStart;
+	imageStream->bufferStart += imageStream->blockSize;
+	if (testStreamBit(imageStream->discard, block))
+		return;
+	if (image->blockCache.slotCount > 0)
+		cacheBlock(block, data);
+	else spillStreamBlock(block, data);
+}
 
-				//If inode number is 0, stop recording info, increment current offset, move onto next entry
-				if (entryInode == 0){
-					currentEntryOffset += entryLen;
-					continue;
-				}
+//Returns the given block of a streamed image, reading forward to it if the stream hasn't
+//reached it yet. A block that was passed and not kept reads as zero if required is 0.
+//The pointer is only valid until the next call.
+static const unsigned char* getStreamBlock(unsigned long block, int required) {
+	struct imageStream* imageStream = &image->imageStream;
+	struct blockCache* blockCache = &image->blockCache;
+	const unsigned char* data;
+	if (block >= imageStream->blockCount) {
+		//A corrupt pointer past the end of the file system. Checked first, so the stream 
+		//isn't walked out to it through blocks that don't exist.
+		memset(imageStream->scratch, 0, imageStream->blockSize);
+		data = imageStream->scratch;
+	}
+	else if (block >= imageStream->nextBlock) {
+		while (imageStream->nextBlock < block)
+			passStreamBlock();
+		imageStream->nextBlock++;
+		fillStream(imageStream->blockSize);
+		data = imageStream->buffer + imageStream->bufferStart;
+		imageStream->bufferStart += imageStream->blockSize;
+		//Kept in case it's asked for again. Before the cache exists only the superblock
+		//is read, and only once.
+		if (blockCache->slotCount > 0)
+			cacheBlock(block, data);
+	}
+	else if (blockCache->slotCount > 0 && copyCachedBlock(block, imageStream->scratch))
+		data = imageStream->scratch;
+	else if (testStreamBit(imageStream->spilled, block)) {
+		if (pread(imageStream->spillFD, imageStream->scratch, imageStream->blockSize, 
+				(off_t) block * imageStream->blockSize) != (ssize_t) imageStream->blockSize) {
+			perror("Error reading the spill file");
+			exit(1);
+		}
+		countEvents(&threadCounters.syscalls, 1);
+		data = imageStream->scratch;
+	}
+	else if (!required) {
+		memset(imageStream->scratch, 0, imageStream->blockSize);
+		data = imageStream->scratch;
+	}
+	else {
+		//Only happens if the bitmaps or block pointers disagree with each other
+		fprintf(stderr, "Block %lu is needed after the stream has passed it, and it was not"
+			" kept; scan the image from a seekable file instead\n", block);
+		exit(1);
+	}
+	return data;
+}
 
-				//else, continue recording and print info
-				//get name length
-				preadLittleEndian(fd, generalBuffer, 1, currentEntryOffset + 6);
-				nameLen = getIntFromBuffer(generalBuffer, 1);
+//Copies count bytes at offset of a streamed image into buffer. Blocks after the one holding
+//offset are only needed when the scan reads past the end of a block (a directory entry 
+//that runs over), so any of them that weren't kept read as zero.
+static void readStreamBytes(unsigned char* buffer, off_t offset, size_t count) {
+	struct imageStream* imageStream = &image->imageStream;
+	size_t filled = 0;
+	while (filled < count) {
+		unsigned long block = (offset + filled) / imageStream->blockSize;
+		size_t blockOffset = (offset + filled) % imageStream->blockSize;
+		size_t length = imageStream->blockSize - blockOffset;
+		if (length > count - filled)
+			length = count - filled;
+		memcpy(buffer + filled, getStreamBlock(block, filled == 0) + blockOffset, length);
+		filled += length;
+	}
+}
 
-				//get name
-				pread(fd, name, nameLen, currentEntryOffset + 8);
-				name[nameLen] = '\0';
+//Stops reading the stream. A decompressor that is still running is left to exit on the
+//closed pipe.
+static void closeImageStream() {
+	struct imageStream* imageStream = &image->imageStream;
+	close(image->imageFD);
+	if (imageStream->decompressor != 0)
+		waitpid(imageStream->decompressor, 0, 0);
+	if (imageStream->spillFD != -1)
+		close(imageStream->spillFD);
+}
 
-				//print entry info
-				fprintf(writeFileStream, "%ld,%d,%d,%d,%d,\"%s\"\n", 
-					parentDirInode, entryNo, entryLen, nameLen, entryInode, name);
+//Releases everything the current image holds, after printing its cache and stream 
+//statistics if report is set and statistics were asked for (--stats-json or --progress)
+static void closeImage(int report) {
+	struct imageStream* imageStream = &image->imageStream;
+	struct blockCache* blockCache = &image->blockCache;
+	if (report && collectStats && blockCache->slotCount > 0)
+		fprintf(stderr, "block cache: %lu hits, %lu misses, %lu evictions\n", 
+			blockCache->hits, blockCache->misses, blockCache->evictions);
+	if (imageStream->active) {
+		if (report && collectStats)
+			fprintf(stderr, "stream: read %llu bytes, spilled %lu blocks\n", 
+				imageStream->bytesRead, imageStream->spilledBlocks);
+		closeImageStream();
+	}
+	else if (image->imageFD > 0)
+		close(image->imageFD);
+	if (image->imageMap != 0)
+		munmap(image->imageMap, image->imageSize);
+	if (image->zeroRegion != 0)
+		munmap((void*) image->zeroRegion, ZERO_REGION_SIZE);
+	free(image->dataExtents);
+	free(image->plannedRanges);
+	free(image->planBuffer);
+	freeInodeList(&image->allocatedInodes);
+	freeInodeList(&image->directoryInodes);
+	freeInodeList(&image->indirectInodes);
+	freeArena(&image->scanArena);
+	pthread_mutex_destroy(&blockCache->lock);
+}
 
-				//increment current offset
-				currentEntryOffset += entryLen;
-			} //end entry-reading loop
-		} //end block-traversing loop
-	} //end directory-traversing loop
+//Returns a pointer to count bytes at offset if a range of the metadata plan that has been
+//read holds all of them, otherwise 0
+static const unsigned char* getPlannedBytes(off_t offset, size_t count) {
+	unsigned long low = 0;
+	unsigned long high = image->plannedRangeCount;
+	while (low < high) {
+		unsigned long middle = (low + high) / 2;
+		if (image->plannedRanges[middle].end <= offset)
+			low = middle + 1;
+		else high = middle;
+	}
+	if (low == image->plannedRangeCount)
+		return 0;
+	const struct metadataRange* range = &image->plannedRanges[low];
+	if (range->data == 0 || offset < range->start || offset + (off_t) count > range->end)
+		return 0;
+	return range->data + (offset - range->start);
 }
 
-/*	Given a file descriptor of the file system image, a write stream file pointer, 
-	an unsigned block pointer to the indirect block, and the level of indirectiveness of this
-	block, recursively prints all information of this block in the format: 
-	
-	blockPointer(hex),tableEntryNumber(dec),blockPointerValue(hex, if non-zero)
-*/
-void printBlockInfo(int fd, FILE* writeFileStream, unsigned long blockPointer, int level) {
-	//Get the byte offset of the current indirect block
-	unsigned long indirectBlockByteOffset = blockPointer * blockSize;
+//Returns a pointer to count bytes of the image starting at offset. Bytes past the end of 
+//the image read as zero. When the image is mapped the pointer stays valid for the life of 
+//the program; otherwise it points into a per-thread window and is only valid until the 
+//next call from the same thread.
+static const unsigned char* getImageBytes(off_t offset, size_t count) {
+	struct imageStream* imageStream = &image->imageStream;
+	struct blockCache* blockCache = &image->blockCache;
+	if (image->imageMap != 0 && offset + (off_t) count <= image->imageSize) {
+		if (image->zeroRegion != 0 && count <= ZERO_REGION_SIZE 
+				&& isImageHole(offset, count))
+			return image->zeroRegion;
+		countEvents(&threadCounters.bytesRead, count);
+		return image->imageMap + offset;
+	}
 
-	unsigned char buffer[5];
-	//Loop through each entry of the block, printing any valid pointers found.
-	for (unsigned int i = 0; i < blockSize / 4; i++) { 
-		//Since each block pointer has size 4, you at most find blockSize / 4 entries.
+	//Serve from the metadata plan or the window if either already holds the range
+	const unsigned char* planned = getPlannedBytes(offset, count);
+	if (planned != 0)
+		return planned;
+	if (offset >= imageWindowStart 
+			&& offset + count <= imageWindowStart + imageWindowLength)
+		return imageWindow + (offset - imageWindowStart);
 
-		//Get the block pointer number
-		preadLittleEndian(fd, buffer, 4, indirectBlockByteOffset + i * 4);
-		unsigned int pointerValue = getIntFromBuffer(buffer, 4);
+	//Refill the window starting at the enclosing block boundary. Uncached reads fetch a 
+	//large window at once; cached ones only the blocks asked for.
+	off_t alignment = (image->blockSize > 0) ? image->blockSize : 1024;
+	off_t start = offset - offset % alignment;
+	size_t length = (offset - start) + count;
+	if (blockCache->slotCount > 0 || imageStream->active)
+		length = (length + alignment - 1) / alignment * alignment;
+	else if (length < IMAGE_WINDOW_SIZE)
+		length = IMAGE_WINDOW_SIZE;
 
-		//If the pointer value isn't zero, print it. Otherwise, skip it
-		if (pointerValue != 0) {
-			fprintf(writeFileStream, "%lx,%u,%x\n", blockPointer, i, pointerValue);
+	if (length > imageWindowCapacity) {
+		free(imageWindow);
+		imageWindow = malloc(length);
+		if (imageWindow == 0) {
+			fprintf(stderr, "Memory allocation error in getImageBytes\n");
+			exit(1);
 		}
+		imageWindowCapacity = length;
 	}
 
-	//If your indirect level is 1, all pointers in the table are real data blocks. Stop.
-	if (level <= 1) return;
+	if (image->imageMap != 0) {
+		//Range runs past the end of the mapping: copy what exists
+		size_t filled = 0;
+		if (start < image->imageSize)
+			filled = image->imageSize - start < length ? image->imageSize - start : length;
+		memcpy(imageWindow, image->imageMap + start, filled);
+		memset(imageWindow + filled, 0, length - filled);
+		countEvents(&threadCounters.bytesRead, filled);
+	}
+	else if (imageStream->active)
+		readStreamBytes(imageWindow, start, length);
+	else if (blockCache->slotCount > 0)
+		readCachedBlocks(start / image->blockSize, length / image->blockSize, imageWindow);
+	else readImageDirect(imageWindow, start, length);
 
-	//Loop through each entry of the block, recursively calling this function on the 
-	//corresponding pointer. 
-	for (unsigned int i = 0; i < blockSize / 4; i++) { 
-		//Since each block pointer has size 4, you at most find blockSize / 4 entries.
+	imageWindowStart = start;
+	imageWindowLength = length;
+	return imageWindow + (offset - start);
+}
 
-		//Get the block pointer number
-		preadLittleEndian(fd, buffer, 4, indirectBlockByteOffset + i * 4);
-		unsigned int pointerValue = getIntFromBuffer(buffer, 4);
+//Returns whether the opened image is an ext2 file system lab3a can scan, reporting why
+//not if it isn't
+static int isScannableImage(const char* path) {
+	const struct ext2SuperBlock* superBlock = (const struct ext2SuperBlock*) 
+		getImageBytes(1024, sizeof(struct ext2SuperBlock));
+	if (le16(superBlock->magic) != 0xEF53) {
+		fprintf(stderr, "%s: not an ext2 image\n", path);
+		return 0;
+	}
+	if ((le32(superBlock->featureIncompat) & FEATURE_INCOMPAT_64BIT) 
+			&& le32(superBlock->blockCountHigh) != 0) {
+		fprintf(stderr, "%s: file systems of more than 2^32 blocks are not supported\n", 
+			path);
+		return 0;
+	}
+	return 1;
+}
+
+//A page fault on a mapped image reads this much ahead by itself
+#define FAULT_READAHEAD_SIZE (128 << 10)
 
-		//If the pointer value isn't zero, recursively call this function with a lower level
-		//and the corresponding pointer.
-		if (pointerValue != 0) 
-			printBlockInfo(fd, writeFileStream, pointerValue, level - 1);
+//Starts reading length bytes at offset into the page cache without waiting for them:
+//through the mapping if the image is mapped, otherwise through the file. A mapped range
+//no longer than what a fault reads ahead costs a syscall for nothing, so it is left to 
+//the fault.
+static void prefetchImageRange(off_t offset, size_t length) {
+	if (isImageHole(offset, length))
+		return;
+	if (image->imageMap != 0 && offset + (off_t) length <= image->imageSize) {
+		if (length <= FAULT_READAHEAD_SIZE)
+			return;
+		long pageSize = sysconf(_SC_PAGESIZE);
+		off_t alignedOffset = offset - offset % pageSize;
+		madvise(image->imageMap + alignedOffset, length + (offset - alignedOffset), MADV_WILLNEED);
 	}
-	fflush(writeFileStream);
+	else posix_fadvise(image->imageFD, offset, length, POSIX_FADV_WILLNEED);
+	countEvents(&threadCounters.syscalls, 1);
 }
-//Reads the list of indirect nodes generated from readInodes and outputs the relevant 
-//information into the corresponding csv file
-void readIndirectBlockEntries(int fd) {
-	FILE* writeFileStream = fopen("indirect.csv", "w+");
 
-	unsigned char buffer[5];
-	for (int i = 0; i < indirectInodeCount; i++) {
-		unsigned long currentInodeNumber = listOfIndirectInodes[i];
-		//Locate the inode from the inode number
-		unsigned long inodeByteOffset = getInodeByteOffset(currentInodeNumber);
+//CSV output is accumulated in large buffers and handed to write(2) only when a buffer
+//fills up or its file is closed. Numbers are formatted by hand rather than through a
+//printf format string.
+#define OUTPUT_BUFFER_SIZE (1 << 20)
 
-		//Find the indirect pointers
-		unsigned int blockPointerArrayOffset = 40;
+struct outputBuffer {
+	int fd; //-1 for in-memory buffers, which grow instead of flushing
+	char* data;
+	size_t length;
+	size_t capacity;
+	unsigned long long flushed; //Bytes already written to the file
+	struct outputBuffer* names; //Columnar directory tables: where entry names go
+};
 
-		//Start with single indirect pointers
-		preadLittleEndian(fd, buffer, 4, 
-			inodeByteOffset + blockPointerArrayOffset + 12 * 4);
-		unsigned long pointer = getIntFromBuffer(buffer, 4);
-		if (pointer != 0)
-			printBlockInfo(fd, writeFileStream, pointer, 1);
-		
-		//Double indirect pointers
-		preadLittleEndian(fd, buffer, 4, 
-			inodeByteOffset + blockPointerArrayOffset + 13 * 4);
-		pointer = getIntFromBuffer(buffer, 4);
-		if (pointer != 0)
-			printBlockInfo(fd, writeFileStream, pointer, 2);
-		
-		//Triple indirect pointers
-		preadLittleEndian(fd, buffer, 4, 
-			inodeByteOffset + blockPointerArrayOffset + 14 * 4);
-		pointer = getIntFromBuffer(buffer, 4);
-		if (pointer != 0)
-			printBlockInfo(fd, writeFileStream, pointer, 3);
+static void initOutputBuffer(struct outputBuffer* output, int fd, size_t capacity) {
+	output->fd = fd;
+	output->length = 0;
+	output->capacity = capacity;
+	output->flushed = 0;
+	output->names = 0;
+	output->data = malloc(output->capacity);
+	if (output->data == 0) {
+		fprintf(stderr, "Memory allocation error in initOutputBuffer\n");
+		exit(1);
 	}
 }
 
-int main (int argc, const char* argv[]) {
-	if (argc != 2) {
-		fprintf(stderr, "%s: Usage: %s [disk-image-file-name]\n", 
-			argv[0], argv[0]);
+//Creates (or truncates) the named file and sets output up to write to it. Exits on failure.
+static void openOutputFile(struct outputBuffer* output, const char* path) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		perror(path);
 		exit(1);
 	}
+	initOutputBuffer(output, fd, OUTPUT_BUFFER_SIZE);
+}
+
+//Sets output up as a growable in-memory buffer, to be appended to a file later. capacity
+//is only the starting size.
+static void openMemoryOutput(struct outputBuffer* output, size_t capacity) {
+	initOutputBuffer(output, -1, capacity);
+}
+
+static void flushOutput(struct outputBuffer* output) {
+	unsigned long long start = 0;
+	if (collectStats) {
+		//Columnar rows are counted as they are written instead
+		const char* row = outputFormat == FORMAT_CSV ? output->data : 0;
+		const char* end = output->data + output->length;
+		while (row != 0 && (row = memchr(row, '\n', end - row)) != 0) {
+			countEvents(&threadCounters.rows, 1);
+			row++;
+		}
+		start = currentNanoseconds();
+	}
+	size_t written = 0;
+	while (written < output->length) {
+		ssize_t writeCount = write(output->fd, output->data + written,
+			output->length - written);
+		countEvents(&threadCounters.syscalls, 1);
+		if (writeCount == -1) {
+			perror("write");
+			exit(1);
+		}
+		written += writeCount;
+	}
+	output->flushed += output->length;
+	output->length = 0;
+	if (collectStats)
+		countEvents(&threadCounters.outputNanoseconds, currentNanoseconds() - start);
+}
+
+//Flushes any buffered output, closes the file and releases the buffer
+static void closeOutput(struct outputBuffer* output) {
+	if (output->fd != -1) {
+		flushOutput(output);
+		close(output->fd);
+	}
+	if (output->names != 0) {
+		closeOutput(output->names);
+		free(output->names);
+		output->names = 0;
+	}
+	free(output->data);
+	output->data = 0;
+	output->length = 0;
+	output->capacity = 0;
+	output->fd = -1;
+}
 
-	int diskImageFD = open(argv[1], O_RDONLY | O_LARGEFILE);
-	if (diskImageFD == -1) {
-		perror(argv[0]);
+//Makes room for at least count more bytes
+static void growOutput(struct outputBuffer* output, size_t count) {
+	if (output->fd != -1) {
+		flushOutput(output);
+		if (count <= output->capacity)
+			return;
+	}
+	while (output->capacity - output->length < count)
+		output->capacity *= 2;
+	output->data = realloc(output->data, output->capacity);
+	if (output->data == 0) {
+		fprintf(stderr, "Memory allocation error in growOutput\n");
 		exit(1);
 	}
+}
+
+static inline void reserveOutput(struct outputBuffer* output, size_t count) {
+	if (output->capacity - output->length < count)
+		growOutput(output, count);
+}
+
+static inline void outputChar(struct outputBuffer* output, char c) {
+	reserveOutput(output, 1);
+	output->data[output->length++] = c;
+}
+
+static void outputBytes(struct outputBuffer* output, const char* bytes, size_t count) {
+	reserveOutput(output, count);
+	memcpy(output->data + output->length, bytes, count);
+	output->length += count;
+}
+
+static inline void outputString(struct outputBuffer* output, const char* text) {
+	outputBytes(output, text, strlen(text));
+}
+
+//Writes value in the given base (at most 16), padded with zeros to at least minimumDigits
+static void outputUnsigned(struct outputBuffer* output, unsigned long long value, unsigned int base,
+		int minimumDigits) {
+	static const char digits[] = "0123456789abcdef";
+	char text[24]; //Enough for 64 bits in octal
+	int start = sizeof(text);
+	do {
+		text[--start] = digits[value % base];
+		value /= base;
+	} while (value != 0);
+	while ((int) sizeof(text) - start < minimumDigits)
+		text[--start] = '0';
+	outputBytes(output, text + start, sizeof(text) - start);
+}
+
+static inline void outputDecimal(struct outputBuffer* output, unsigned long long value) {
+	outputUnsigned(output, value, 10, 1);
+}
+
+static inline void outputSignedDecimal(struct outputBuffer* output, long long value) {
+	if (value < 0) {
+		outputChar(output, '-');
+		outputUnsigned(output, -(unsigned long long) value, 10, 1);
+	}
+	else outputUnsigned(output, value, 10, 1);
+}
 
-	unsigned char* buf = malloc(4);
-	preadLittleEndian(diskImageFD, buf, 4, 1064);
-	//printf("%02X:%02X:%02X:%02X\n", buf[0], buf[1], buf[2], buf[3]);
+static inline void outputHex(struct outputBuffer* output, unsigned long long value) {
+	outputUnsigned(output, value, 16, 1);
+}
+
+static inline void outputOctal(struct outputBuffer* output, unsigned long long value) {
+	outputUnsigned(output, value, 8, 1);
+}
+
+//Each output table is written either as CSV or, with --format=columnar, as a binary file
+//(super.col and so on) that can be mapped and indexed directly: a header describing the
+//columns, then each column as an array of little endian integers with one element per 
+//CSV row, starting at a multiple of COLUMN_ALIGNMENT bytes into the file so it can be
+//used as a typed array in place. Two columns differ from the CSV: free bitmap entries are
+//stored as runs, with a count column giving the length of each, and directory entry 
+//names are kept in directory.names, each as a length byte followed by the name, and 
+//referred to by their offset there.
+//
+//Rows arrive one at a time from many threads, so they are first written whole, packed 
+//one after another, to an unlinked scratch file; closeTableOutput splits them into the 
+//columns once the row count is known.
+//
+//The header is TABLE_HEADER_SIZE bytes: the magic "LAB3ACOL", the format version (u32),
+//the header size (u32), the number of rows (u64), the number of columns (u32), 4 bytes of
+//padding and the table name (16 bytes, zero padded). It is followed by one 
+//COLUMN_HEADER_SIZE entry per column: the name (24 bytes, zero padded), the offset of the
+//column's array in the file (u64), its kind and its width in bytes (one byte each) and 6
+//bytes of padding. Version 2 widened the group table's free block, free inode and 
+//directory counts to 4 bytes, as 64 byte descriptors and 64K blocks let them pass 65535;
+//version 3 stores columns instead of rows.
+#define COLUMNAR_VERSION 3
+#define TABLE_HEADER_SIZE 48
+#define COLUMN_HEADER_SIZE 40
+#define COLUMN_ALIGNMENT 8
+
+enum { TABLE_SUPER, TABLE_GROUP, TABLE_BITMAP, TABLE_INODE, TABLE_DIRECTORY, TABLE_INDIRECT };
+
+//Column kinds: 'u' unsigned, 'i' signed, 'c' a character, 's' the offset of a name in the
+//table's names file
+struct columnFormat {
+	const char* name;
+	char kind;
+	int width;
+};
+
+struct tableFormat {
+	const char* name;
+	const struct columnFormat* columns;
+	int columnCount;
+};
+
+static const struct columnFormat superColumns[] = {
+	{"magic", 'u', 2}, {"inodeCount", 'u', 4}, {"blockCount", 'u', 4}, 
+	{"blockSize", 'u', 4}, {"fragmentSize", 'u', 4}, {"blocksPerGroup", 'u', 4},
+	{"inodesPerGroup", 'u', 4}, {"fragmentsPerGroup", 'u', 4}, {"firstDataBlock", 'u', 4}
+};
+
+static const struct columnFormat groupColumns[] = {
+	{"containedBlockCount", 'u', 4}, {"freeBlockCount", 'u', 4}, {"freeInodeCount", 'u', 4},
+	{"directoryCount", 'u', 4}, {"inodeBitmapBlock", 'u', 4}, {"blockBitmapBlock", 'u', 4},
+	{"inodeTableBlock", 'u', 4}
+};
+
+static const struct columnFormat bitmapColumns[] = {
+	{"bitmapBlock", 'u', 4}, {"firstFree", 'u', 4}, {"count", 'u', 4}
+};
 
-	//printf("%d\n", getIntFromBuffer(buf, 4));
+static const struct columnFormat inodeColumns[] = {
+	{"inode", 'u', 4}, {"type", 'c', 1}, {"mode", 'u', 2}, {"owner", 'u', 2}, 
+	{"group", 'u', 2}, {"linkCount", 'u', 2}, {"creationTime", 'u', 4}, 
+	{"modificationTime", 'u', 4}, {"accessTime", 'u', 4}, {"size", 'u', 8}, 
+	{"blockCount", 'u', 4}, {"block0", 'u', 4}, {"block1", 'u', 4}, {"block2", 'u', 4},
+	{"block3", 'u', 4}, {"block4", 'u', 4}, {"block5", 'u', 4}, {"block6", 'u', 4},
+	{"block7", 'u', 4}, {"block8", 'u', 4}, {"block9", 'u', 4}, {"block10", 'u', 4},
+	{"block11", 'u', 4}, {"block12", 'u', 4}, {"block13", 'u', 4}, {"block14", 'u', 4}
+};
 
-	readSuperBlock(diskImageFD);
-	readGroupDescriptor(diskImageFD);
-	readFreeBitmapEntry(diskImageFD);
-	readInodes(diskImageFD);
-	readDirectories(diskImageFD);
-	readIndirectBlockEntries(diskImageFD);
-}
\ No newline at end of file
+static const struct columnFormat directoryColumns[] = {
+	{"parentInode", 'u', 4}, {"entry", 'i', 4}, {"entryLength", 'u', 2}, 
+	{"nameLength", 'u', 1}, {"inode", 'u', 4}, {"name", 's', 8}
+};
+
+static const struct columnFormat indirectColumns[] = {
+	{"block", 'u', 4}, {"entry", 'u', 4}, {"pointer", 'u', 4}
+};
+
+#define COLUMNS(columns) columns, sizeof(columns) / sizeof(struct columnFormat)
+
+static const struct tableFormat tableFormats[] = {
+	{"super", COLUMNS(superColumns)},
+	{"group", COLUMNS(groupColumns)},
+	{"bitmap", COLUMNS(bitmapColumns)},
+	{"inode", COLUMNS(inodeColumns)},
+	{"directory", COLUMNS(directoryColumns)},
+	{"indirect", COLUMNS(indirectColumns)}
+};
+
+static inline void outputLittleEndian(struct outputBuffer* output, uint64_t value, int width) {
+	reserveOutput(output, width);
+	for (int i = 0; i < width; i++)
+		output->data[output->length++] = (char) (value >> (8 * i));
+}
+
+//Writes text into a zero padded field of width bytes, cutting it short if needed
+static void outputPadded(struct outputBuffer* output, const char* text, int width) {
+	reserveOutput(output, width);
+	memset(output->data + output->length, 0, width);
+	memcpy(output->data + output->length, text, strnlen(text, width - 1));
+	output->length += width;
+}
+
+static unsigned int getRowSize(int table) {
+	unsigned int rowSize = 0;
+	for (int i = 0; i < tableFormats[table].columnCount; i++)
+		rowSize += tableFormats[table].columns[i].width;
+	return rowSize;
+}
+
+static unsigned int getHeaderSize(int table) {
+	return TABLE_HEADER_SIZE + tableFormats[table].columnCount * COLUMN_HEADER_SIZE;
+}
+
+static inline uint64_t alignColumn(uint64_t offset) {
+	return (offset + COLUMN_ALIGNMENT - 1) / COLUMN_ALIGNMENT * COLUMN_ALIGNMENT;
+}
+
+static void writeTableHeader(struct outputBuffer* output, int table, uint64_t rowCount) {
+	const struct tableFormat* format = &tableFormats[table];
+	outputBytes(output, "LAB3ACOL", 8);
+	outputLittleEndian(output, COLUMNAR_VERSION, 4);
+	outputLittleEndian(output, getHeaderSize(table), 4);
+	outputLittleEndian(output, rowCount, 8);
+	outputLittleEndian(output, format->columnCount, 4);
+	outputLittleEndian(output, 0, 4);
+	outputPadded(output, format->name, 16);
+
+	uint64_t offset = alignColumn(getHeaderSize(table));
+	for (int i = 0; i < format->columnCount; i++) {
+		const struct columnFormat* column = &format->columns[i];
+		outputPadded(output, column->name, 24);
+		outputLittleEndian(output, offset, 8);
+		outputChar(output, column->kind);
+		outputLittleEndian(output, column->width, 1);
+		outputLittleEndian(output, 0, 6);
+		offset = alignColumn(offset + rowCount * column->width);
+	}
+}
+
+//Creates the file for one table in the current format: the CSV, or for columnar output
+//the scratch file its rows are collected in. Exits on failure.
+static void openTableOutput(struct outputBuffer* output, int table) {
+	if (image->discardTables) {
+		openOutputFile(output, "/dev/null");
+		return;
+	}
+	char path[4200];
+	snprintf(path, sizeof(path), outputFormat == FORMAT_CSV ? "%s/%s.csv" : "%s/%s.col.rows", 
+		image->outputDirectory, tableFormats[table].name);
+	openOutputFile(output, path);
+	if (outputFormat == FORMAT_CSV)
+		return;
+
+	unlink(path);
+	if (table == TABLE_DIRECTORY) {
+		output->names = malloc(sizeof(struct outputBuffer));
+		if (output->names == 0) {
+			fprintf(stderr, "Memory allocation error in openTableOutput\n");
+			exit(1);
+		}
+		snprintf(path, sizeof(path), "%s/directory.names", image->outputDirectory);
+		openOutputFile(output->names, path);
+	}
+}
+
+//Sets output up as an in-memory buffer for rows of table, to be added to the table's file
+//with appendTableRows
+static void openTableMemoryOutput(struct outputBuffer* output, int table, size_t capacity) {
+	openMemoryOutput(output, capacity);
+	if (outputFormat == FORMAT_COLUMNAR && table == TABLE_DIRECTORY) {
+		output->names = malloc(sizeof(struct outputBuffer));
+		if (output->names == 0) {
+			fprintf(stderr, "Memory allocation error in openTableMemoryOutput\n");
+			exit(1);
+		}
+		openMemoryOutput(output->names, capacity);
+	}
+}
+
+//Appends the rows in the memory buffer source to output, moving any names along with them
+static void appendTableRows(struct outputBuffer* output, struct outputBuffer* source, int table) {
+	if (source->names == 0) {
+		outputBytes(output, source->data, source->length);
+		return;
+	}
+
+	//Names are numbered from the start of the source's names; shift them to where they 
+	//will end up
+	const struct tableFormat* format = &tableFormats[table];
+	unsigned int rowSize = getRowSize(table);
+	unsigned long long base = output->names->flushed + output->names->length;
+	unsigned int offset = 0;
+	for (int i = 0; i < format->columnCount; i++) {
+		if (format->columns[i].kind == 's') {
+			for (size_t row = 0; row < source->length; row += rowSize) {
+				unsigned char* field = (unsigned char*) source->data + row + offset;
+				uint64_t value = 0;
+				for (int j = 0; j < 8; j++)
+					value |= (uint64_t) field[j] << (8 * j);
+				value += base;
+				for (int j = 0; j < 8; j++)
+					field[j] = (unsigned char) (value >> (8 * j));
+			}
+		}
+		offset += format->columns[i].width;
+	}
+	outputBytes(output, source->data, source->length);
+	outputBytes(output->names, source->names->data, source->names->length);
+}
+
+//Copies one field of width bytes out of each of count rows of rowSize bytes
+static inline void copyColumn(unsigned char* field, const unsigned char* source, 
+		uint64_t count, unsigned int rowSize, int width) {
+	for (uint64_t i = 0; i < count; i++, field += width, source += rowSize)
+		memcpy(field, source, width);
+}
+
+//Writes the columnar file of a table from the rows collected in its scratch file
+static void writeTableColumns(struct outputBuffer* rows, int table) {
+	const struct tableFormat* format = &tableFormats[table];
+	unsigned int rowSize = getRowSize(table);
+	uint64_t rowCount = rows->flushed / rowSize;
+	const unsigned char* rowData = 0;
+	if (rowCount > 0) {
+		rowData = mmap(0, rows->flushed, PROT_READ, MAP_SHARED, rows->fd, 0);
+		if (rowData == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		madvise((void*) rowData, rows->flushed, MADV_SEQUENTIAL);
+	}
+
+	char path[4200];
+	snprintf(path, sizeof(path), "%s/%s.col", image->outputDirectory, format->name);
+	struct outputBuffer output;
+	openOutputFile(&output, path);
+	writeTableHeader(&output, table, rowCount);
+
+	unsigned int offset = 0;
+	for (int i = 0; i < format->columnCount; i++) {
+		int width = format->columns[i].width;
+		size_t padding = alignColumn(output.flushed + output.length) 
+			- (output.flushed + output.length);
+		reserveOutput(&output, padding);
+		memset(output.data + output.length, 0, padding);
+		output.length += padding;
+
+		//A buffer's worth of the column at a time
+		uint64_t row = 0;
+		while (row < rowCount) {
+			uint64_t chunkEnd = row + OUTPUT_BUFFER_SIZE / width;
+			if (chunkEnd > rowCount)
+				chunkEnd = rowCount;
+			reserveOutput(&output, (chunkEnd - row) * width);
+			unsigned char* field = (unsigned char*) output.data + output.length;
+			const unsigned char* source = rowData + row * rowSize + offset;
+
+			//Constant widths let each copy be a single load and store
+			uint64_t count = chunkEnd - row;
+			switch (width) {
+				case 1: copyColumn(field, source, count, rowSize, 1); break;
+				case 2: copyColumn(field, source, count, rowSize, 2); break;
+				case 4: copyColumn(field, source, count, rowSize, 4); break;
+				case 8: copyColumn(field, source, count, rowSize, 8); break;
+				default: copyColumn(field, source, count, rowSize, width);
+			}
+			output.length += count * width;
+			row = chunkEnd;
+		}
+		offset += width;
+	}
+	closeOutput(&output);
+	if (rowCount > 0)
+		munmap((void*) rowData, rows->flushed);
+}
+
+//Closes the file of a table. A columnar table is written out from its rows here.
+static void closeTableOutput(struct outputBuffer* output, int table) {
+	if (outputFormat == FORMAT_COLUMNAR && !image->discardTables) {
+		flushOutput(output);
+		writeTableColumns(output, table);
+	}
+	closeOutput(output);
+}
+
+//Rows of every table, in both formats. Columnar rows are counted here for --stats-json
+//since they can't be told apart by newlines.
+
+//Writes the super block row from the globals read out of it
+static void writeSuperRow(struct outputBuffer* output, unsigned int magic) {
+	if (outputFormat == FORMAT_COLUMNAR) {
+		outputLittleEndian(output, magic, 2);
+		outputLittleEndian(output, image->inodeCount, 4);
+		outputLittleEndian(output, image->blockCount, 4);
+		outputLittleEndian(output, image->blockSize, 4);
+		outputLittleEndian(output, image->fragmentSize, 4);
+		outputLittleEndian(output, image->blocksPerGroup, 4);
+		outputLittleEndian(output, image->inodesPerGroup, 4);
+		outputLittleEndian(output, image->fragmentsPerGroup, 4);
+		outputLittleEndian(output, image->firstDataBlock, 4);
+		countEvents(&threadCounters.rows, 1);
+		return;
+	}
+	outputUnsigned(output, magic, 16, 4);
+	outputChar(output, ',');
+	outputSignedDecimal(output, image->inodeCount);
+	outputChar(output, ',');
+	outputSignedDecimal(output, image->blockCount);
+	outputChar(output, ',');
+	outputSignedDecimal(output, image->blockSize);
+	outputChar(output, ',');
+	outputSignedDecimal(output, image->fragmentSize);
+	outputChar(output, ',');
+	outputSignedDecimal(output, image->blocksPerGroup);
+	outputChar(output, ',');
+	outputSignedDecimal(output, image->inodesPerGroup);
+	outputChar(output, ',');
+	outputSignedDecimal(output, image->fragmentsPerGroup);
+	outputChar(output, ',');
+	outputSignedDecimal(output, image->firstDataBlock);
+	outputChar(output, '\n');
+}
+
+static void writeGroupRow(struct outputBuffer* output, const struct groupDescriptorFields* fields) {
+	if (outputFormat == FORMAT_COLUMNAR) {
+		outputLittleEndian(output, fields->containedBlockCount, 4);
+		outputLittleEndian(output, fields->freeBlockCount, 4);
+		outputLittleEndian(output, fields->freeInodeCount, 4);
+		outputLittleEndian(output, fields->directoryCount, 4);
+		outputLittleEndian(output, fields->inodeBitmapBlock, 4);
+		outputLittleEndian(output, fields->blockBitmapBlock, 4);
+		outputLittleEndian(output, fields->inodeTableBlock, 4);
+		countEvents(&threadCounters.rows, 1);
+		return;
+	}
+	outputSignedDecimal(output, fields->containedBlockCount);
+	outputChar(output, ',');
+	outputSignedDecimal(output, fields->freeBlockCount);
+	outputChar(output, ',');
+	outputSignedDecimal(output, fields->freeInodeCount);
+	outputChar(output, ',');
+	outputSignedDecimal(output, fields->directoryCount);
+	outputChar(output, ',');
+	outputHex(output, fields->inodeBitmapBlock);
+	outputChar(output, ',');
+	outputHex(output, fields->blockBitmapBlock);
+	outputChar(output, ',');
+	outputHex(output, fields->inodeTableBlock);
+	outputChar(output, '\n');
+}
+
+//Writes the bitmap rows for count consecutive free blocks or inodes, starting with first.
+//In range mode that is a single row: bitmap block, first and last.
+static void writeFreeRun(struct outputBuffer* output, unsigned long bitmapBlock, 
+		unsigned long first, unsigned long count) {
+	if (outputFormat == FORMAT_COLUMNAR) {
+		outputLittleEndian(output, bitmapBlock, 4);
+		outputLittleEndian(output, first, 4);
+		outputLittleEndian(output, count, 4);
+		countEvents(&threadCounters.rows, 1);
+		return;
+	}
+	if (bitmapRanges) {
+		outputHex(output, bitmapBlock);
+		outputChar(output, ',');
+		outputDecimal(output, first);
+		outputChar(output, ',');
+		outputDecimal(output, first + count - 1);
+		outputChar(output, '\n');
+		return;
+	}
+	for (unsigned long i = first; i < first + count; i++) {
+		outputHex(output, bitmapBlock);
+		outputChar(output, ',');
+		outputDecimal(output, i);
+		outputChar(output, '\n');
+	}
+}
+
+//Reads a bitmap.csv written with --bitmap-ranges from path and writes the per entry 
+//listing it stands for to standard output, exactly as it would have been written without
+//the option
+static void expandBitmapRanges(const char* path) {
+	FILE* input = fopen(path, "r");
+	if (input == 0) {
+		perror(path);
+		exit(1);
+	}
+	struct outputBuffer output;
+	initOutputBuffer(&output, 1, OUTPUT_BUFFER_SIZE);
+
+	unsigned long bitmapBlock, first, last;
+	int fields;
+	while ((fields = fscanf(input, "%lx,%lu,%lu\n", &bitmapBlock, &first, &last)) == 3) {
+		if (last < first) {
+			fprintf(stderr, "%s: bad range %lu-%lu\n", path, first, last);
+			exit(1);
+		}
+		for (unsigned long i = first; i <= last; i++) {
+			outputHex(&output, bitmapBlock);
+			outputChar(&output, ',');
+			outputDecimal(&output, i);
+			outputChar(&output, '\n');
+		}
+	}
+	if (fields != EOF || ferror(input)) {
+		fprintf(stderr, "%s: not a bitmap range listing\n", path);
+		exit(1);
+	}
+	fclose(input);
+	flushOutput(&output);
+	free(output.data);
+}
+
+//The fields of an inode.csv row
+struct inodeRow {
+	unsigned long inodeNumber;
+	char type; //'f', 'd', 's' or '?'
+	unsigned int mode;
+	unsigned int owner;
+	unsigned int group;
+	unsigned int linkCount;
+	uint32_t creationTime;
+	uint32_t modificationTime;
+	uint32_t accessTime;
+	unsigned long long size;
+	unsigned int blockCount;
+	uint32_t blockPointers[15];
+};
+
+static void writeInodeRow(struct outputBuffer* output, const struct inodeRow* row) {
+	if (outputFormat == FORMAT_COLUMNAR) {
+		outputLittleEndian(output, row->inodeNumber, 4);
+		outputChar(output, row->type);
+		outputLittleEndian(output, row->mode, 2);
+		outputLittleEndian(output, row->owner, 2);
+		outputLittleEndian(output, row->group, 2);
+		outputLittleEndian(output, row->linkCount, 2);
+		outputLittleEndian(output, row->creationTime, 4);
+		outputLittleEndian(output, row->modificationTime, 4);
+		outputLittleEndian(output, row->accessTime, 4);
+		outputLittleEndian(output, row->size, 8);
+		outputLittleEndian(output, row->blockCount, 4);
+		for (int j = 0; j < 15; j++)
+			outputLittleEndian(output, row->blockPointers[j], 4);
+		countEvents(&threadCounters.rows, 1);
+		return;
+	}
+	outputDecimal(output, row->inodeNumber);
+	outputChar(output, ',');
+	outputChar(output, row->type);
+	outputChar(output, ',');
+	outputOctal(output, row->mode);
+	outputChar(output, ',');
+	outputDecimal(output, row->owner);
+	outputChar(output, ',');
+	outputDecimal(output, row->group);
+	outputChar(output, ',');
+	outputDecimal(output, row->linkCount);
+	outputChar(output, ',');
+	//Times are written in hex
+	outputHex(output, row->creationTime);
+	outputChar(output, ',');
+	outputHex(output, row->modificationTime);
+	outputChar(output, ',');
+	outputHex(output, row->accessTime);
+	outputChar(output, ',');
+	outputDecimal(output, row->size);
+	outputChar(output, ',');
+	outputDecimal(output, row->blockCount);
+	for (int j = 0; j < 15; j++) {
+		outputChar(output, ',');
+		outputHex(output, row->blockPointers[j]);
+	}
+	outputChar(output, '\n');
+}
+
+//Writes a directory.csv row. name holds nameBytes bytes, which may be fewer than nameLength.
+static void writeDirectoryRow(struct outputBuffer* output, unsigned long parentInode, int entryNo,
+		int entryLength, int nameLength, int entryInode, const char* name, size_t nameBytes) {
+	if (outputFormat == FORMAT_COLUMNAR) {
+		struct outputBuffer* names = output->names;
+		outputLittleEndian(output, parentInode, 4);
+		outputLittleEndian(output, entryNo, 4);
+		outputLittleEndian(output, entryLength, 2);
+		outputLittleEndian(output, nameLength, 1);
+		outputLittleEndian(output, entryInode, 4);
+		outputLittleEndian(output, names->flushed + names->length, 8);
+		outputLittleEndian(names, nameBytes, 1);
+		outputBytes(names, name, nameBytes);
+		countEvents(&threadCounters.rows, 1);
+		return;
+	}
+	outputDecimal(output, parentInode);
+	outputChar(output, ',');
+	outputSignedDecimal(output, entryNo);
+	outputChar(output, ',');
+	outputSignedDecimal(output, entryLength);
+	outputChar(output, ',');
+	outputSignedDecimal(output, nameLength);
+	outputChar(output, ',');
+	outputSignedDecimal(output, entryInode);
+	outputBytes(output, ",\"", 2);
+	outputBytes(output, name, nameBytes);
+	outputBytes(output, "\"\n", 2);
+}
+
+static void writeIndirectRow(struct outputBuffer* output, unsigned long block, unsigned int entry,
+		uint32_t pointer) {
+	if (outputFormat == FORMAT_COLUMNAR) {
+		outputLittleEndian(output, block, 4);
+		outputLittleEndian(output, entry, 4);
+		outputLittleEndian(output, pointer, 4);
+		countEvents(&threadCounters.rows, 1);
+		return;
+	}
+	outputHex(output, block);
+	outputChar(output, ',');
+	outputDecimal(output, entry);
+	outputChar(output, ',');
+	outputHex(output, pointer);
+	outputChar(output, '\n');
+}
+
+//A minimal io_uring wrapper used to keep many image reads outstanding at once. Only plain
+//reads are supported. setupRing fails (returning -1) on kernels without io_uring.
+struct ioRing {
+	int fd;
+	unsigned entries;
+	unsigned* submissionHead;
+	unsigned* submissionTail;
+	unsigned* submissionMask;
+	unsigned* submissionArray;
+	struct io_uring_sqe* submissionEntries;
+	unsigned* completionHead;
+	unsigned* completionTail;
+	unsigned* completionMask;
+	struct io_uring_cqe* completions;
+	void* submissionRing;
+	size_t submissionRingSize;
+	void* completionRing;
+	size_t completionRingSize;
+	size_t submissionEntriesSize;
+	unsigned queued; //Submissions added to the ring but not yet passed to the kernel
+};
+
+static int setupRing(struct ioRing* ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+	ring->entries = params.sq_entries;
+
+	ring->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->completionRingSize = params.cq_off.cqes 
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->completionRingSize > ring->submissionRingSize)
+			ring->submissionRingSize = ring->completionRingSize;
+		ring->completionRingSize = ring->submissionRingSize;
+	}
+	ring->submissionRing = mmap(0, ring->submissionRingSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->completionRing = ring->submissionRing;
+	else ring->completionRing = mmap(0, ring->completionRingSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->submissionEntriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->submissionEntries = mmap(0, ring->submissionEntriesSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->submissionRing == MAP_FAILED || ring->completionRing == MAP_FAILED 
+			|| ring->submissionEntries == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+
+	unsigned char* submissionBase = ring->submissionRing;
+	ring->submissionHead = (unsigned*) (submissionBase + params.sq_off.head);
+	ring->submissionTail = (unsigned*) (submissionBase + params.sq_off.tail);
+	ring->submissionMask = (unsigned*) (submissionBase + params.sq_off.ring_mask);
+	ring->submissionArray = (unsigned*) (submissionBase + params.sq_off.array);
+	unsigned char* completionBase = ring->completionRing;
+	ring->completionHead = (unsigned*) (completionBase + params.cq_off.head);
+	ring->completionTail = (unsigned*) (completionBase + params.cq_off.tail);
+	ring->completionMask = (unsigned*) (completionBase + params.cq_off.ring_mask);
+	ring->completions = (struct io_uring_cqe*) (completionBase + params.cq_off.cqes);
+	return 0;
+}
+
+static void closeRing(struct ioRing* ring) {
+	munmap(ring->submissionEntries, ring->submissionEntriesSize);
+	if (ring->completionRing != ring->submissionRing)
+		munmap(ring->completionRing, ring->completionRingSize);
+	munmap(ring->submissionRing, ring->submissionRingSize);
+	close(ring->fd);
+}
+
+//Passes every queued submission to the kernel
+static void flushRingSubmissions(struct ioRing* ring) {
+	while (ring->queued > 0) {
+		int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, 0, 0);
+		countEvents(&threadCounters.syscalls, 1);
+		if (submitted < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("io_uring_enter");
+			exit(1);
+		}
+		ring->queued -= submitted;
+	}
+}
+
+//Queues a read of count bytes at offset into buffer, tagged with userData. Returns -1 if 
+//the submission ring is full. The read isn't started until flushRingSubmissions.
+static int submitRingRead(struct ioRing* ring, int fd, void* buffer, unsigned count, off_t offset,
+		uint64_t userData) {
+	unsigned tail = *ring->submissionTail;
+	if (tail - __atomic_load_n(ring->submissionHead, __ATOMIC_ACQUIRE) >= ring->entries)
+		return -1;
+
+	unsigned index = tail & *ring->submissionMask;
+	struct io_uring_sqe* entry = &ring->submissionEntries[index];
+	memset(entry, 0, sizeof(*entry));
+	entry->opcode = IORING_OP_READ;
+	entry->fd = fd;
+	entry->addr = (unsigned long) buffer;
+	entry->len = count;
+	entry->off = offset;
+	entry->user_data = userData;
+	ring->submissionArray[index] = index;
+	__atomic_store_n(ring->submissionTail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+	return 0;
+}
+
+//Blocks until a read finishes, then reports its tag and result (bytes read or -errno)
+static void waitRingCompletion(struct ioRing* ring, uint64_t* userData, int* result) {
+	flushRingSubmissions(ring);
+	unsigned head = *ring->completionHead;
+	if (head == __atomic_load_n(ring->completionTail, __ATOMIC_ACQUIRE)) {
+		unsigned long long start = collectStats ? currentNanoseconds() : 0;
+		while (head == __atomic_load_n(ring->completionTail, __ATOMIC_ACQUIRE)) {
+			countEvents(&threadCounters.syscalls, 1);
+			if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0
+					&& errno != EINTR) {
+				perror("io_uring_enter");
+				exit(1);
+			}
+		}
+		if (collectStats)
+			countEvents(&threadCounters.ioNanoseconds, currentNanoseconds() - start);
+	}
+	struct io_uring_cqe* completion = &ring->completions[head & *ring->completionMask];
+	*userData = completion->user_data;
+	*result = completion->res;
+	__atomic_store_n(ring->completionHead, head + 1, __ATOMIC_RELEASE);
+}
+
+//Returns the byte offset for a specific inode. Assumes inode group descriptor 
+//is initialized.
+static unsigned long getInodeByteOffset(unsigned long inodeNumber) {
+	unsigned long blockGroup = (inodeNumber - 1) / image->inodesPerGroup;
+	unsigned long localInodeIndex = (inodeNumber - 1) % image->inodesPerGroup;
+
+	unsigned long inodeByteOffset = 
+		(unsigned long) image->groupDescriptors[blockGroup].inodeTableBlock
+			* image->blockSize //The byte offset of the inode table for this particular inode
+						//(created by block number of that table * bytes per block)
+		+ localInodeIndex * image->bytesPerInode; //The number of bytes into the table this
+										   //inode resides
+	return inodeByteOffset;
+}		
+
+//Returns whether inode maps its blocks with an extent tree
+static inline int isExtentMapped(const struct ext2Inode* inode) {
+	return (image->featureIncompat & FEATURE_INCOMPAT_EXTENTS) 
+		&& (le32(inode->flags) & EXTENTS_FLAG);
+}
+
+//Returns the header of the extent tree node held in the size bytes at node, or 0 if they
+//don't hold a valid one
+static inline const struct ext4ExtentHeader* getExtentHeader(const void* node, size_t size) {
+	const struct ext4ExtentHeader* header = node;
+	if (le16(header->magic) != EXTENT_MAGIC || le16(header->depth) > MAX_EXTENT_DEPTH
+			|| le16(header->entryCount) 
+				> (size - sizeof(struct ext4ExtentHeader)) / sizeof(struct ext4Extent))
+		return 0;
+	return header;
+}
+
+static inline const struct ext4ExtentIndex* getExtentIndex(
+		const struct ext4ExtentHeader* header, unsigned long i) {
+	return (const struct ext4ExtentIndex*) (header + 1) + i;
+}
+
+static inline const struct ext4Extent* getExtent(
+		const struct ext4ExtentHeader* header, unsigned long i) {
+	return (const struct ext4Extent*) (header + 1) + i;
+}
+
+//Block numbers in extent trees are 48 bits wide. One that doesn't fit in 32 bits is past
+//the end of the file system, and is returned as UINT32_MAX, which is too.
+static inline uint32_t getExtentTreeBlock(uint16_t high, uint32_t low) {
+	return le16(high) != 0 ? UINT32_MAX : le32(low);
+}
+
+static inline uint32_t getExtentChild(const struct ext4ExtentIndex* index) {
+	return getExtentTreeBlock(index->childHigh, index->childLow);
+}
+
+static inline uint32_t getExtentStart(const struct ext4Extent* extent) {
+	return getExtentTreeBlock(extent->startHigh, extent->startLow);
+}
+
+//Number of blocks in an extent, whether or not it is initialized
+static inline unsigned int getExtentLength(const struct ext4Extent* extent) {
+	unsigned int length = le16(extent->length);
+	return length > UNINITIALIZED_EXTENT_LENGTH ? length - UNINITIALIZED_EXTENT_LENGTH : length;
+}
+
+//Returns where entry i of an extent tree node points: the node below for an index entry,
+//the first block of the extent for a leaf
+static inline uint32_t getExtentEntryBlock(const struct ext4ExtentHeader* header, 
+		unsigned long i) {
+	if (le16(header->depth) > 0)
+		return getExtentChild(getExtentIndex(header, i));
+	return getExtentStart(getExtent(header, i));
+}
+
+static void readSuperBlock() {
+	struct outputBuffer output;
+	openTableOutput(&output, TABLE_SUPER);
+
+	int superBlockOffset = 1024;
+	const struct ext2SuperBlock* superBlock = (const struct ext2SuperBlock*) 
+		getImageBytes(superBlockOffset, sizeof(struct ext2SuperBlock));
+
+	//Read magic number
+	unsigned int magic = le16(superBlock->magic);
+		//no error checking
+
+	//Read and store total number of inodes
+	image->inodeCount = le32(superBlock->inodeCount);
+
+	//Read and store total number of blocks
+	image->blockCount = le32(superBlock->blockCount);
+
+	//Read and store block size
+	image->blockSize = 1024 << le32(superBlock->logBlockSize);
+
+	//Read and store fragment size
+	image->fragmentSize = (int32_t) le32(superBlock->logFragmentSize);
+	if (image->fragmentSize > 0) {
+		image->fragmentSize = 1024 << image->fragmentSize;
+	}
+	else image->fragmentSize = 1024 >> -1 * image->fragmentSize;
+
+	//Read and store blocks per group
+	image->blocksPerGroup = le32(superBlock->blocksPerGroup);
+
+	//Read and store inodes per group
+	image->inodesPerGroup = le32(superBlock->inodesPerGroup);
+
+	//Read and store fragments per group
+	image->fragmentsPerGroup = le32(superBlock->fragmentsPerGroup);
+
+	//Read and store first data block
+	image->firstDataBlock = le32(superBlock->firstDataBlock);
+
+	//Get the inode size: needed later
+	image->bytesPerInode = le16(superBlock->inodeSize);
+
+	//Revision 0 file systems always reserve the first 10 inodes
+	image->firstInode = le32(superBlock->revision) == 0 ? 11 : le32(superBlock->firstInode);
+
+	//Feature flags, and the descriptor size that the 64 bit feature brings
+	image->featureIncompat = le32(superBlock->featureIncompat);
+	image->featureReadOnlyCompat = le32(superBlock->featureReadOnlyCompat);
+	image->descriptorSize = sizeof(struct ext2GroupDescriptor);
+	image->reservedDescriptorBlocks = le16(superBlock->reservedDescriptorBlocks);
+	if ((image->featureIncompat & FEATURE_INCOMPAT_64BIT) 
+			&& le16(superBlock->descriptorSize) > sizeof(struct ext2GroupDescriptor))
+		image->descriptorSize = le16(superBlock->descriptorSize);
+	if (image->featureIncompat & ~SUPPORTED_INCOMPAT_FEATURES)
+		fprintf(stderr, "Warning: unsupported file system features 0x%x, output may be wrong\n",
+			image->featureIncompat & ~SUPPORTED_INCOMPAT_FEATURES);
+
+	writeSuperRow(&output, magic);
+	closeTableOutput(&output, TABLE_SUPER);
+}
+
+static void readGroupDescriptor() {
+	struct outputBuffer output;
+	openTableOutput(&output, TABLE_GROUP);
+
+	//offset for group descriptor
+	int startGroupDescriptor = (image->firstDataBlock + 1) * image->blockSize;
+
+	//Calculate number of block groups
+	image->numGroups = (image->blockCount / image->blocksPerGroup);
+	int lastBlockSize = (image->blockCount % image->blocksPerGroup);
+
+	if (lastBlockSize > 0)
+		image->numGroups++;
+
+	//printf("num groups %d, leftover blocks %d, blocks per group %d\n", numGroups, blockCount % blocksPerGroup, blocksPerGroup);
+
+	image->groupDescriptors = arenaAlloc(&image->scanArena, 
+		image->numGroups * sizeof(struct groupDescriptorFields));
+
+	const unsigned char* descriptorTable = 
+		getImageBytes(startGroupDescriptor, (size_t) image->descriptorSize * image->numGroups);
+
+	int i;
+	//read and store group descriptor values for each group
+	for (i = 0; i < image->numGroups; i++){
+		const struct ext2GroupDescriptor* descriptor = (const struct ext2GroupDescriptor*) 
+			(descriptorTable + (size_t) i * image->descriptorSize);
+
+		//Read and store number of free blocks
+		image->groupDescriptors[i].freeBlockCount = le16(descriptor->freeBlockCount);
+
+		//Calculate number of contained blocks
+		if (i == image->numGroups - 1 && lastBlockSize > 0)
+			image->groupDescriptors[i].containedBlockCount = lastBlockSize;
+		else
+			image->groupDescriptors[i].containedBlockCount = image->blocksPerGroup;
+
+		//Read and store number of free inodes
+		image->groupDescriptors[i].freeInodeCount = le16(descriptor->freeInodeCount);
+
+		//Read and store number of directories
+		image->groupDescriptors[i].directoryCount = le16(descriptor->directoryCount);
+
+		//Read and store the locations of the bitmaps and inode table
+		image->groupDescriptors[i].inodeBitmapBlock = le32(descriptor->inodeBitmapBlock);
+		image->groupDescriptors[i].blockBitmapBlock = le32(descriptor->blockBitmapBlock);
+		image->groupDescriptors[i].inodeTableBlock = le32(descriptor->inodeTableBlock);
+		if (image->featureReadOnlyCompat 
+				& (FEATURE_RO_COMPAT_GDT_CSUM | FEATURE_RO_COMPAT_METADATA_CSUM))
+			image->groupDescriptors[i].uninitialized = 
+				le16(descriptor->flags) & (GROUP_INODE_UNINIT | GROUP_BLOCK_UNINIT);
+
+		//64 byte descriptors add the upper halves. Block numbers can't have any, as the
+		//file system has fewer than 2^32 blocks.
+		if (image->descriptorSize >= sizeof(struct ext4GroupDescriptor)) {
+			const struct ext4GroupDescriptor* wideDescriptor = 
+				(const struct ext4GroupDescriptor*) descriptor;
+			image->groupDescriptors[i].freeBlockCount += 
+				le16(wideDescriptor->freeBlockCountHigh) << 16;
+			image->groupDescriptors[i].freeInodeCount += 
+				le16(wideDescriptor->freeInodeCountHigh) << 16;
+			image->groupDescriptors[i].directoryCount += 
+				le16(wideDescriptor->directoryCountHigh) << 16;
+		}
+
+		//print stuff
+		writeGroupRow(&output, &image->groupDescriptors[i]);
+	}
+	closeTableOutput(&output, TABLE_GROUP);
+}
+
+//Bitmaps are scanned 64 bits at a time. Bit i of a bitmap lives in bit i % 8 of byte i / 8,
+//so loading 8 bytes little endian puts bit i of the bitmap at bit i % 64 of word i / 64.
+//Callers must make the bitmap readable up to the next multiple of 8 bytes.
+static inline uint64_t getBitmapWord(const unsigned char* bitmap, unsigned long wordIndex) {
+	uint64_t word;
+	memcpy(&word, bitmap + wordIndex * 8, 8);
+	return le64(word);
+}
+
+//Returns the index of the first word at or after wordIndex that isn't equal to pattern 
+//(all zeros or all ones), or wordCount if there is none
+static unsigned long skipMatchingWords(const unsigned char* bitmap, unsigned long wordIndex, 
+		unsigned long wordCount, uint64_t pattern) {
+	while (wordIndex < wordCount && getBitmapWord(bitmap, wordIndex) == pattern)
+		wordIndex++;
+	return wordIndex;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//Same as skipMatchingWords, but compares 256 bits per iteration
+__attribute__((target("avx2")))
+static unsigned long skipMatchingWordsAVX2(const unsigned char* bitmap, unsigned long wordIndex, 
+		unsigned long wordCount, uint64_t pattern) {
+	__m256i patternVector = _mm256_set1_epi64x(pattern);
+	while (wordIndex + 4 <= wordCount) {
+		__m256i words = _mm256_loadu_si256((const __m256i*) (bitmap + wordIndex * 8));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(words, patternVector)) != -1)
+			break;
+		wordIndex += 4;
+	}
+	return skipMatchingWords(bitmap, wordIndex, wordCount, pattern);
+}
+#endif
+
+//Chosen once by selectBitmapScanner depending on what the CPU supports
+static unsigned long (*skipMatchingWordsImpl)(const unsigned char*, unsigned long, unsigned long, 
+	uint64_t) = skipMatchingWords;
+
+static void selectBitmapScanner() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		skipMatchingWordsImpl = skipMatchingWordsAVX2;
+#endif
+}
+
+//Returns the index of the first bit at or after start whose value is bitValue, or bitCount
+//if there is none. Whole words that can't contain such a bit (all ones when looking for a 
+//zero and vice versa) are skipped without being examined bit by bit.
+static unsigned long findNextBit(const unsigned char* bitmap, unsigned long start, 
+		unsigned long bitCount, int bitValue) {
+	if (start >= bitCount)
+		return bitCount;
+
+	uint64_t invert = bitValue ? 0 : ~(uint64_t) 0;
+	unsigned long wordIndex = start / 64;
+	unsigned long wordCount = (bitCount + 63) / 64;
+
+	//Ignore the bits of the first word below start
+	uint64_t word = (getBitmapWord(bitmap, wordIndex) ^ invert) & (~(uint64_t) 0 << (start % 64));
+	if (word == 0) {
+		wordIndex = skipMatchingWordsImpl(bitmap, wordIndex + 1, wordCount, invert);
+		if (wordIndex == wordCount)
+			return bitCount;
+		word = getBitmapWord(bitmap, wordIndex) ^ invert;
+	}
+
+	unsigned long bit = wordIndex * 64 + __builtin_ctzll(word);
+	return bit < bitCount ? bit : bitCount;
+}
+
+//--check collects what it needs while the scan decodes: the block and inode bitmaps, 
+//each allocated inode's mode and link count, the block pointers found in inodes, indirect
+//blocks and extent trees, and every directory entry. Pointers are kept as runs of
+//consecutive blocks, one per extent or per stretch of pointers to consecutive blocks, so
+//what they take grows with how fragmented files are rather than with the blocks in use.
+//Runs and entries are appended to flat arrays under a lock, a batch at a time, in 
+//whatever order the threads get to them; runCheck puts what it reports in order.
+struct blockReference {
+	uint32_t block;
+	uint32_t length;
+	uint32_t inode;
+	uint32_t indirectBlock; //0 if the pointers are in the inode itself
+	uint32_t entry; //Index of the first block's pointer in the inode or indirect block
+	uint32_t entryStep; //1 if each block has a pointer of its own, 0 for an extent
+};
+
+//Flags of a directoryReference
+#define ENTRY_DOT 0x1
+#define ENTRY_DOT_DOT 0x2
+#define ENTRY_BAD 0x4 //Its record length is too short for its name, or overruns the block
+
+struct directoryReference {
+	uint32_t directory;
+	uint32_t entry;
+	uint32_t inode;
+	uint16_t recordLength;
+	uint8_t nameLength;
+	uint8_t flags;
+	uint32_t name; //Offset of the entry's name in the collected names, if they are kept
+};
+
+struct inodeFacts {
+	uint16_t mode;
+	uint16_t linkCount;
+	uint8_t decoded;
+	uint8_t hasBlockPointers; //i_block holds block numbers, not a short symlink or a device
+};
+
+struct consistencyCheck {
+	pthread_mutex_t lock;
+	struct blockReference* blockReferences;
+	unsigned long blockReferenceCount;
+	unsigned long blockReferenceCapacity;
+	struct directoryReference* directoryReferences;
+	unsigned long directoryReferenceCount;
+	unsigned long directoryReferenceCapacity;
+	struct inodeFacts* inodes; //Indexed by inode number
+	uint64_t* usedBlocks; //The block bitmaps, indexed by block number - firstDataBlock
+	uint64_t* usedInodes; //The inode bitmaps, indexed by inode number - 1
+	//The names of the directory entries, only kept for the lookup index
+	int keepNames;
+	char* names;
+	size_t namesLength;
+	size_t namesCapacity;
+};
+
+//Number of references batched on the stack before they are appended
+#define CHECK_BATCH_SIZE 64
+
+//Sets up the current image's check, once the superblock has given its size
+static void startCheck() {
+	struct consistencyCheck* check = 
+		arenaAlloc(&image->scanArena, sizeof(struct consistencyCheck));
+	pthread_mutex_init(&check->lock, 0);
+	check->inodes = 
+		arenaAlloc(&image->scanArena, (image->inodeCount + 1) * sizeof(struct inodeFacts));
+	check->usedBlocks = arenaAlloc(&image->scanArena, 
+		((unsigned long) image->blockCount + 63) / 64 * sizeof(uint64_t));
+	check->usedInodes = arenaAlloc(&image->scanArena, 
+		((unsigned long) image->inodeCount + 63) / 64 * sizeof(uint64_t));
+	check->keepNames = image->buildLookupIndex;
+	image->check = check;
+}
+
+static void freeCheck() {
+	if (image->check == 0)
+		return;
+	free(image->check->blockReferences);
+	free(image->check->directoryReferences);
+	free(image->check->names);
+	pthread_mutex_destroy(&image->check->lock);
+	image->check = 0;
+}
+
+//Sets the bits from first on of a check bitset from count bits of a bitmap block
+static void recordBitmapForCheck(uint64_t* bits, unsigned long first, 
+		const unsigned char* bitmap, unsigned long count) {
+	if (first % 64 == 0) {
+		//Whole words at a time. Groups usually start on a word boundary.
+		for (unsigned long word = 0; word * 64 < count; word++) {
+			uint64_t value = getBitmapWord(bitmap, word);
+			if (count - word * 64 < 64)
+				value &= ((uint64_t) 1 << (count - word * 64)) - 1;
+			__atomic_fetch_or(&bits[first / 64 + word], value, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	for (unsigned long i = 0; i < count; i++)
+		if ((bitmap[i / 8] >> (i % 8)) & 1)
+			__atomic_fetch_or(&bits[(first + i) / 64], (uint64_t) 1 << ((first + i) % 64), 
+				__ATOMIC_RELAXED);
+}
+
+static void recordBlockReferences(const struct blockReference* references, unsigned long count) {
+	struct consistencyCheck* check = image->check;
+	pthread_mutex_lock(&check->lock);
+	if (check->blockReferenceCount + count > check->blockReferenceCapacity) {
+		check->blockReferenceCapacity = 
+			check->blockReferenceCapacity > 0 ? check->blockReferenceCapacity * 2 : 4096;
+		check->blockReferences = realloc(check->blockReferences, 
+			check->blockReferenceCapacity * sizeof(struct blockReference));
+		if (check->blockReferences == 0) {
+			fprintf(stderr, "Memory allocation error in recordBlockReferences\n");
+			exit(1);
+		}
+	}
+	memcpy(check->blockReferences + check->blockReferenceCount, references, 
+		count * sizeof(struct blockReference));
+	check->blockReferenceCount += count;
+	pthread_mutex_unlock(&check->lock);
+}
+
+//Appends count directory references, and their names (taken from names) if they are kept
+static void recordDirectoryReferences(const struct directoryReference* references, 
+		const char* const* names, unsigned long count) {
+	struct consistencyCheck* check = image->check;
+	pthread_mutex_lock(&check->lock);
+	if (check->directoryReferenceCount + count > check->directoryReferenceCapacity) {
+		check->directoryReferenceCapacity = check->directoryReferenceCapacity > 0 
+			? check->directoryReferenceCapacity * 2 : 4096;
+		check->directoryReferences = realloc(check->directoryReferences, 
+			check->directoryReferenceCapacity * sizeof(struct directoryReference));
+		if (check->directoryReferences == 0) {
+			fprintf(stderr, "Memory allocation error in recordDirectoryReferences\n");
+			exit(1);
+		}
+	}
+	memcpy(check->directoryReferences + check->directoryReferenceCount, references, 
+		count * sizeof(struct directoryReference));
+	if (check->keepNames) {
+		if (check->namesLength + count * 255 > check->namesCapacity) {
+			check->namesCapacity = check->namesCapacity > 0 ? check->namesCapacity * 2 : 1 << 20;
+			check->names = realloc(check->names, check->namesCapacity);
+			if (check->names == 0) {
+				fprintf(stderr, "Memory allocation error in recordDirectoryReferences\n");
+				exit(1);
+			}
+		}
+		if (check->namesLength + count * 255 > UINT32_MAX) {
+			fprintf(stderr, "Too many directory entry names to index\n");
+			exit(1);
+		}
+		for (unsigned long i = 0; i < count; i++) {
+			struct directoryReference* reference = 
+				&check->directoryReferences[check->directoryReferenceCount + i];
+			reference->name = check->namesLength;
+			memcpy(check->names + check->namesLength, names[i], reference->nameLength);
+			check->namesLength += reference->nameLength;
+		}
+	}
+	check->directoryReferenceCount += count;
+	pthread_mutex_unlock(&check->lock);
+}
+
+//Records the pointers in a node of inodeNumber's extent tree, held in block (0 for the
+//root, in the inode). Every block of an extent counts as referenced by its entry; an
+//extent running past the end of the file system is one invalid reference.
+static void recordExtentNodeForCheck(uint32_t inodeNumber, uint32_t block, 
+		const struct ext4ExtentHeader* header) {
+	struct blockReference references[CHECK_BATCH_SIZE];
+	unsigned long count = 0;
+	unsigned long blockCount = image->blockCount;
+	for (unsigned long i = 0; i < le16(header->entryCount); i++) {
+		unsigned long first = getExtentEntryBlock(header, i);
+		unsigned long length = 
+			le16(header->depth) > 0 ? 1 : getExtentLength(getExtent(header, i));
+		if (length == 0)
+			continue;
+		if (first >= blockCount)
+			length = 1;
+		else if (length > blockCount - first)
+			length = blockCount - first + 1;
+		references[count++] = 
+			(struct blockReference) { first, length, inodeNumber, block, i, 0 };
+		if (count == CHECK_BATCH_SIZE) {
+			recordBlockReferences(references, count);
+			count = 0;
+		}
+	}
+	if (count > 0)
+		recordBlockReferences(references, count);
+}
+
+//Adds a pointer to the batch in references, extending the last run when the pointer
+//follows it in both block and entry. Returns the new number of runs.
+static inline unsigned long addBlockPointer(struct blockReference* references, 
+		unsigned long count, uint32_t pointerValue, uint32_t inodeNumber, 
+		uint32_t block, uint32_t entry) {
+	if (count > 0) {
+		struct blockReference* last = &references[count - 1];
+		if (last->entry + last->length == entry 
+				&& (uint64_t) last->block + last->length == pointerValue) {
+			last->length++;
+			return count;
+		}
+	}
+	references[count] = 
+		(struct blockReference) { pointerValue, 1, inodeNumber, block, entry, 1 };
+	return count + 1;
+}
+
+//Records a decoded inode's mode, link count and the blocks its i_block points to
+static void recordInodeForCheck(const struct inodeRow* row, const struct ext2Inode* inode) {
+	struct inodeFacts* facts = &image->check->inodes[row->inodeNumber];
+	facts->mode = row->mode;
+	facts->linkCount = row->linkCount;
+	facts->decoded = 1;
+	//A symlink keeps its target in i_block unless it needs blocks of its own
+	facts->hasBlockPointers = 
+		row->type == 'f' || row->type == 'd' || (row->type == 's' && row->blockCount > 0);
+	if (!facts->hasBlockPointers)
+		return;
+	if (isExtentMapped(inode)) {
+		const struct ext4ExtentHeader* root = getExtentHeader(inode->block, sizeof(inode->block));
+		if (root != 0)
+			recordExtentNodeForCheck(row->inodeNumber, 0, root);
+		return;
+	}
+
+	struct blockReference references[15];
+	unsigned long count = 0;
+	for (int j = 0; j < 15; j++)
+		if (row->blockPointers[j] != 0)
+			count = addBlockPointer(references, count, row->blockPointers[j], 
+				row->inodeNumber, 0, j);
+	if (count > 0)
+		recordBlockReferences(references, count);
+}
+
+//Records the pointers in an indirect block of inodeNumber
+static void recordIndirectBlockForCheck(uint32_t inodeNumber, uint32_t block, 
+		const uint32_t* indirectBlock) {
+	struct blockReference references[CHECK_BATCH_SIZE];
+	unsigned long count = 0;
+	for (unsigned long i = 0; i < (unsigned long) image->blockSize / 4; i++) {
+		uint32_t pointerValue = le32(indirectBlock[i]);
+		if (pointerValue == 0)
+			continue;
+		if (count == CHECK_BATCH_SIZE) {
+			recordBlockReferences(references, count);
+			count = 0;
+		}
+		count = addBlockPointer(references, count, pointerValue, inodeNumber, block, i);
+	}
+	if (count > 0)
+		recordBlockReferences(references, count);
+}
+
+//Returns whether a group starts with a backup of the superblock and descriptors
+static int hasSuperBlockBackup(int group) {
+	if (group <= 1 || !(image->featureReadOnlyCompat & FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return 1;
+	for (long base = 3; base <= 7; base += 2) {
+		long power = base;
+		while (power < group)
+			power *= base;
+		if (power == group)
+			return 1;
+	}
+	return 0;
+}
+
+//Returns how many blocks at the start of a group the superblock, the descriptors and the
+//blocks reserved for them take up, or their backups
+static unsigned long getGroupOverhead(int group) {
+	if (!hasSuperBlockBackup(group))
+		return 0;
+	unsigned long descriptorBlocks = 
+		((unsigned long) image->numGroups * image->descriptorSize + image->blockSize - 1) 
+		/ image->blockSize;
+	return 1 + descriptorBlocks + image->reservedDescriptorBlocks;
+}
+
+static inline void setBitmapBit(unsigned char* bitmap, unsigned long bit) {
+	bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+//Returns a group's block bitmap, or its inode bitmap if inodes is set, readable up to the
+//next multiple of 8 bytes. A bitmap the group's flags say is uninitialized is built in 
+//a buffer instead, stored in *built for the caller to free (otherwise *built is 0): it has
+//the group's own superblock, descriptors, bitmaps and inode table in use, as the kernel 
+//would when it first writes it.
+static const unsigned char* getGroupBitmap(int group, int inodes, unsigned char** built) {
+	struct groupDescriptorFields* fields = &image->groupDescriptors[group];
+	unsigned long bits = inodes ? image->inodesPerGroup : fields->containedBlockCount;
+	*built = 0;
+	if (!(fields->uninitialized & (inodes ? GROUP_INODE_UNINIT : GROUP_BLOCK_UNINIT)))
+		return getImageBytes((off_t) (inodes ? fields->inodeBitmapBlock 
+			: fields->blockBitmapBlock) * image->blockSize, (bits + 63) / 64 * 8);
+
+	*built = calloc((bits + 63) / 64, 8);
+	if (*built == 0) {
+		fprintf(stderr, "Memory allocation error in getGroupBitmap\n");
+		exit(1);
+	}
+	if (inodes)
+		return *built;
+	unsigned long first = image->firstDataBlock + (unsigned long) group * image->blocksPerGroup;
+	unsigned long overhead = getGroupOverhead(group);
+	for (unsigned long i = 0; i < overhead && i < bits; i++)
+		setBitmapBit(*built, i);
+	unsigned long tableBlocks = ((unsigned long) image->inodesPerGroup 
+		* image->bytesPerInode + image->blockSize - 1) / image->blockSize;
+	unsigned long metadata[3] = 
+		{ fields->blockBitmapBlock, fields->inodeBitmapBlock, fields->inodeTableBlock };
+	for (int i = 0; i < 3; i++)
+		for (unsigned long j = 0; j < (i < 2 ? 1 : tableBlocks); j++)
+			if (metadata[i] + j >= first && metadata[i] + j - first < bits)
+				setBitmapBit(*built, metadata[i] + j - first);
+	return *built;
+}
+
+//Prints a bitmap.csv row for every free block in the group's block bitmap
+static void printFreeBlocks(struct outputBuffer* output, int group) {
+	struct groupDescriptorFields fields = image->groupDescriptors[group];
+	//For the data bitmap...
+	//Extract data bitmap location
+	unsigned long blockBitmapBlock = fields.blockBitmapBlock;
+	
+
+	//CRITICAL ASSUMPTION: BLOCK BITMAP CONTAINS METADATA BLOCKS
+	//CRITICAL ASSUMPTION: EMPTY BLOCK IS NOT INCLUDED IN BLOCK BITMAP
+
+
+	//Obtain which index the first data block of this group corresponds to
+	//unsigned long dataBlockStartOffset = inodeTableBlock 
+	//	+ (bytesPerInode * inodesPerGroup + blockSize - 1) / blockSize;
+		//The block number of the start of the inode table + the size of the inode table
+		//in blocks
+	unsigned long dataBlockStartOffset = 
+		1 + group * image->groupDescriptors[0].containedBlockCount;
+	unsigned long blockBits = fields.containedBlockCount;
+	unsigned char* builtBitmap;
+	const unsigned char* blockBitmap = getGroupBitmap(group, 0, &builtBitmap);
+	if (image->check != 0)
+		recordBitmapForCheck(image->check->usedBlocks, 
+			(unsigned long) group * image->blocksPerGroup, blockBitmap, blockBits);
+
+	//Visit each run of clear bits, skipping the allocated ones in between
+	unsigned long freeRunStart = findNextBit(blockBitmap, 0, blockBits, 0);
+	while (freeRunStart < blockBits) {
+		unsigned long freeRunEnd = findNextBit(blockBitmap, freeRunStart, blockBits, 1);
+		//Found empty data blocks, mark accordingly
+		writeFreeRun(output, blockBitmapBlock, dataBlockStartOffset + freeRunStart, 
+			freeRunEnd - freeRunStart);
+		freeRunStart = findNextBit(blockBitmap, freeRunEnd, blockBits, 0);
+	}
+	free(builtBitmap);
+}
+
+//Prints a bitmap.csv row for every free inode in the group's inode bitmap and appends the
+//numbers of the allocated ones to allocatedList, if it isn't 0, returning how many there 
+//were
+static unsigned long printFreeInodes(struct outputBuffer* output, int group, 
+		struct inodeList* allocatedList) {
+	//For the inode bitmap...
+	//Extract inode bitmap location
+	unsigned long inodeBitmapBlock = image->groupDescriptors[group].inodeBitmapBlock;
+
+	//Obtain some inode block offset start location //TODO
+	unsigned long inodeStartOffset = 1 + group * image->inodesPerGroup;
+	unsigned long inodeBits = image->inodesPerGroup;
+	unsigned char* builtBitmap;
+	const unsigned char* inodeBitmap = getGroupBitmap(group, 1, &builtBitmap);
+	if (image->check != 0)
+		recordBitmapForCheck(image->check->usedInodes, 
+			(unsigned long) group * image->inodesPerGroup, inodeBitmap, inodeBits);
+	unsigned long allocatedCount = 0;
+
+	//Alternate between runs of allocated and free inodes
+	unsigned long runStart = 0;
+	while (runStart < inodeBits) {
+		int allocated = (inodeBitmap[runStart / 8] >> (runStart % 8)) & 0x1;
+		unsigned long runEnd = findNextBit(inodeBitmap, runStart, inodeBits, !allocated);
+		if (!allocated) {
+			//Found empty inodes, mark accordingly
+			writeFreeRun(output, inodeBitmapBlock, inodeStartOffset + runStart, 
+				runEnd - runStart);
+		}
+		else {
+			allocatedCount += runEnd - runStart;
+			if (allocatedList != 0) {
+				reserveInodes(allocatedList, runEnd - runStart);
+				for (unsigned long i = runStart; i < runEnd; i++)
+					allocatedList->inodes[allocatedList->count++] = inodeStartOffset + i;
+			}
+		}
+		runStart = runEnd;
+	}
+	free(builtBitmap);
+	return allocatedCount;
+}
+
+//Shared state of a runInParallel call. Workers claim the next unstarted task until none
+//are left.
+struct parallelJob {
+	int taskCount;
+	int nextTask;
+	void (*task)(int taskIndex, void* arg);
+	void* arg;
+	struct imageContext* image; //The caller's image
+};
+
+//Set while the thread is running a runInParallel task
+static __thread int insideParallelTask;
+
+static void* parallelWorker(void* jobPointer) {
+	struct parallelJob* job = jobPointer;
+	int taskIndex;
+	int wasInside = insideParallelTask;
+	insideParallelTask = 1;
+	while ((taskIndex = __sync_fetch_and_add(&job->nextTask, 1)) < job->taskCount)
+		job->task(taskIndex, job->arg);
+	insideParallelTask = wasInside;
+	return 0;
+}
+
+//Entry point of the extra threads runInParallel starts
+static void* parallelThread(void* jobPointer) {
+	registerThreadCounters();
+	image = ((struct parallelJob*) jobPointer)->image;
+	parallelWorker(jobPointer);
+	retireThreadCounters();
+	free(imageWindow);
+	return 0;
+}
+
+//Calls task(i, arg) for every i in [0, taskCount) using up to threadCount threads, and
+//returns once all of them are done. Tasks may run in any order. A call made from inside a
+//task runs on the calling thread alone, so the threads of a batch (which are already 
+//busy with one image each) don't multiply.
+static void runInParallel(int taskCount, void (*task)(int taskIndex, void* arg), void* arg) {
+	struct parallelJob job = { taskCount, 0, task, arg, image };
+
+	int workers = threadCount < taskCount ? threadCount : taskCount;
+	if (workers <= 1 || insideParallelTask) {
+		parallelWorker(&job);
+		return;
+	}
+
+	//The calling thread works too, so start one fewer thread than requested
+	pthread_t* threads = malloc((workers - 1) * sizeof(pthread_t));
+	int started = 0;
+	if (threads != 0) {
+		while (started < workers - 1 
+				&& pthread_create(&threads[started], 0, parallelThread, &job) == 0)
+			started++;
+	}
+	parallelWorker(&job);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+	free(threads);
+}
+
+//Read one group at a time, the bitmaps and inode tables are small reads that seek back and
+//forth between kinds of metadata, though with flex_bg the bitmaps of a whole flex group,
+//and then its inode tables, sit side by side. So the phased scan plans the reads of a 
+//stretch of groups first: the ranges their decoding needs are collected, sorted by offset
+//and merged where they are less than METADATA_GAP_LIMIT apart, reading the gap rather 
+//than seeking over it. Each merged range is fetched with one request, the requests spread
+//over the threads, and getImageBytes serves the decoding from those buffers. A mapped 
+//image needs no buffers, so its merged ranges are only read ahead, those that are longer
+//than what a page fault reads ahead by itself.
+#define METADATA_GAP_LIMIT (256 << 10)
+
+//Returns how many bytes of ranges to plan before reading them: a window's worth for each
+//thread, small enough that the decoding finds them still in the CPU's caches, but no more
+//than half the block cache
+static size_t getMetadataPlanSize() {
+	size_t planSize = (size_t) IMAGE_WINDOW_SIZE * threadCount;
+	size_t cacheBytes = (size_t) cacheMegabytes << 20;
+	if (image->imageMap == 0 && cacheBytes / 2 < planSize)
+		return cacheBytes / 2;
+	return planSize;
+}
+
+//Adds length bytes at offset, widened to whole blocks, to the plan
+static void planMetadataRange(off_t offset, size_t length) {
+	if (image->plannedRangeCount == image->plannedRangeCapacity) {
+		unsigned long capacity = 
+			image->plannedRangeCapacity > 0 ? image->plannedRangeCapacity * 2 : 256;
+		struct metadataRange* ranges = 
+			realloc(image->plannedRanges, capacity * sizeof(struct metadataRange));
+		if (ranges == 0) {
+			fprintf(stderr, "Memory allocation error in planMetadataRange\n");
+			exit(1);
+		}
+		image->plannedRanges = ranges;
+		image->plannedRangeCapacity = capacity;
+	}
+	struct metadataRange* range = &image->plannedRanges[image->plannedRangeCount++];
+	range->start = offset - offset % image->blockSize;
+	range->end = (offset + length + image->blockSize - 1) / image->blockSize * image->blockSize;
+	range->data = 0;
+	image->plannedBytes += range->end - range->start;
+}
+
+static int compareMetadataRanges(const void* first, const void* second) {
+	off_t firstStart = ((const struct metadataRange*) first)->start;
+	off_t secondStart = ((const struct metadataRange*) second)->start;
+	return (firstStart > secondStart) - (firstStart < secondStart);
+}
+
+//Fetches one merged range of the plan into its part of the plan buffer
+static void readPlannedRange(int index, void* unused) {
+	struct metadataRange* range = &image->plannedRanges[index];
+	readCachedBlocks(range->start / image->blockSize, 
+		(range->end - range->start) / image->blockSize, range->data);
+}
+
+//Sorts and merges the planned ranges, then reads them, or reads them ahead if the image 
+//is mapped
+static void readMetadataPlan() {
+	struct metadataRange* ranges = image->plannedRanges;
+	qsort(ranges, image->plannedRangeCount, sizeof(struct metadataRange), 
+		compareMetadataRanges);
+	unsigned long merged = 0;
+	for (unsigned long i = 0; i < image->plannedRangeCount; i++) {
+		if (merged > 0 && ranges[i].start <= ranges[merged - 1].end + METADATA_GAP_LIMIT) {
+			if (ranges[i].end > ranges[merged - 1].end)
+				ranges[merged - 1].end = ranges[i].end;
+		}
+		else ranges[merged++] = ranges[i];
+	}
+	image->plannedRangeCount = merged;
+
+	if (image->imageMap != 0) {
+		for (unsigned long i = 0; i < merged; i++)
+			prefetchImageRange(ranges[i].start, ranges[i].end - ranges[i].start);
+		return;
+	}
+
+	size_t length = 0;
+	for (unsigned long i = 0; i < merged; i++)
+		length += ranges[i].end - ranges[i].start;
+	if (length > image->planBufferCapacity) {
+		free(image->planBuffer);
+		image->planBuffer = malloc(length);
+		if (image->planBuffer == 0) {
+			fprintf(stderr, "Memory allocation error in readMetadataPlan\n");
+			exit(1);
+		}
+		image->planBufferCapacity = length;
+	}
+	length = 0;
+	for (unsigned long i = 0; i < merged; i++) {
+		ranges[i].data = image->planBuffer + length;
+		length += ranges[i].end - ranges[i].start;
+	}
+	runInParallel(merged, readPlannedRange, 0);
+}
+
+//Empties the plan
+static void clearMetadataPlan() {
+	image->plannedRangeCount = 0;
+	image->plannedBytes = 0;
+}
+
+//Adds the group's bitmaps to the plan, leaving out uninitialized ones, which aren't read
+static void planGroupBitmaps(int group) {
+	struct groupDescriptorFields* fields = &image->groupDescriptors[group];
+	if (!(fields->uninitialized & GROUP_BLOCK_UNINIT))
+		planMetadataRange((off_t) fields->blockBitmapBlock * image->blockSize, 
+			((unsigned long) fields->containedBlockCount + 63) / 64 * 8);
+	if (!(fields->uninitialized & GROUP_INODE_UNINIT))
+		planMetadataRange((off_t) fields->inodeBitmapBlock * image->blockSize, 
+			((unsigned long) image->inodesPerGroup + 63) / 64 * 8);
+}
+
+//Prints the block number of a free block and the map that free information came from
+//into the corresponding csv. 
+static void readFreeBitmapEntry() {
+	struct outputBuffer output;
+	openTableOutput(&output, TABLE_BITMAP);
+
+	//Size the list from the descriptors' free inode counts; it grows if they are wrong
+	unsigned long expectedInodes = 0;
+	for (int group = 0; group < image->numGroups; group++)
+		if (image->groupDescriptors[group].freeInodeCount < image->inodesPerGroup)
+			expectedInodes += image->inodesPerGroup - image->groupDescriptors[group].freeInodeCount;
+	reserveInodes(&image->allocatedInodes, expectedInodes);
+
+	//For each stretch of groups whose bitmaps fit in a plan...
+	size_t planSize = getMetadataPlanSize();
+	int group = 0;
+	while (group < image->numGroups) {
+		int planEnd = group;
+		while (planEnd < image->numGroups && image->plannedBytes < planSize)
+			planGroupBitmaps(planEnd++);
+		readMetadataPlan();
+
+		//For each group...
+		for (; group < planEnd; group++) {
+			printFreeBlocks(&output, group);
+
+			image->groupDescriptors[group].allocatedListStart = image->allocatedInodes.count;
+			image->groupDescriptors[group].allocatedListCount = 
+				printFreeInodes(&output, group, &image->allocatedInodes);
+		}
+		clearMetadataPlan();
+	}
+	closeTableOutput(&output, TABLE_BITMAP);
+}
+
+//A group counts as dense, and has its inode table read in one go, when at least
+//1 / DENSE_INODE_TABLE_RATIO of its inodes are allocated
+#define DENSE_INODE_TABLE_RATIO 4
+
+//Returns a pointer to count consecutive inodes of one group's inode table, starting with
+//firstInode, fetched with a single read. The pointer has the lifetime of getImageBytes.
+static const unsigned char* loadInodeTableRange(unsigned long firstInode, unsigned long count) {
+	unsigned long offset = getInodeByteOffset(firstInode);
+	size_t length = count * image->bytesPerInode;
+
+	//When mapped, ask the kernel to read the whole range ahead rather than faulting it in 
+	//page by page, unless the metadata plan has done so already
+	if (image->imageMap != 0 && image->plannedRangeCount == 0)
+		prefetchImageRange(offset, length);
+	return getImageBytes(offset, length);
+}
+
+//Flags returned by decodeInode
+#define INODE_IS_DIRECTORY 0x1
+#define INODE_HAS_INDIRECT 0x2 //Indirect blocks, or extent tree nodes outside the inode
+
+//The per-inode and per-block decoders are compiled once for each common block size, with
+//the block size as a constant so their loop bounds and divisions are known in advance, 
+//and once more for any other block size. selectBlockSizeDecoders picks the image's set
+//after the superblock is read, and the functions below call into it.
+struct blockSizeDecoders {
+	unsigned long blockSize; //0 for the generic set
+	int (*decodeInode)(struct outputBuffer* output, unsigned long currentInodeNumber, 
+		const struct ext2Inode* inode);
+	void (*printDirectoryBlock)(struct outputBuffer* output, unsigned long parentDirInode, 
+		const unsigned char* block, int* entryNo);
+	int (*countDirectoryEntries)(const unsigned char* block);
+	void (*printBlockInfo)(struct outputBuffer* output, const uint32_t* indirectBlock, 
+		unsigned long blockPointer);
+};
+
+//Writes the inode.csv row of one inode, and returns which of the later phases need to look 
+//at it
+static inline int decodeInode(struct outputBuffer* output, 
+		unsigned long currentInodeNumber, const struct ext2Inode* inode) {
+	return image->decoders->decodeInode(output, currentInodeNumber, inode);
+}
+
+//Prints the directory.csv rows of one data block of directory parentDirInode. block must
+//hold DIRECTORY_BLOCK_FETCH_SIZE bytes. entryNo is the number of the last entry seen
+//before this block, and is updated to carry over into the next one.
+static inline void printDirectoryBlock(struct outputBuffer* output, 
+		unsigned long parentDirInode, const unsigned char* block, int* entryNo) {
+	image->decoders->printDirectoryBlock(output, parentDirInode, block, entryNo);
+}
+
+//Returns how many entries printDirectoryBlock numbers in a block, counting unused ones
+static inline int countDirectoryEntries(const unsigned char* block) {
+	return image->decoders->countDirectoryEntries(block);
+}
+
+//Prints the indirect.csv rows of one indirect block
+static inline void printBlockInfo(struct outputBuffer* output, 
+		const uint32_t* indirectBlock, unsigned long blockPointer) {
+	image->decoders->printBlockInfo(output, indirectBlock, blockPointer);
+}
+
+//decodeInode for a given block size
+static inline __attribute__((always_inline)) int decodeInodeSized(
+		struct outputBuffer* output, unsigned long currentInodeNumber, 
+		const struct ext2Inode* inode, unsigned long blockSize) {
+	int kind = 0;
+	struct inodeRow row;
+	countEvents(&threadCounters.inodes, 1);
+
+	row.inodeNumber = currentInodeNumber;
+
+	//Get the file type of the inode. We only care about regular files 'f', 
+	//directories 'd', and symbolic links 's'. Everything else is marked with '?'.
+	unsigned int modeInfo = le16(inode->mode);
+	if ((modeInfo & 0xA000) == 0xA000) //Symbolic link 
+		row.type = 's';
+	else if ((modeInfo & 0x8000) == 0x8000) //Regular file
+		row.type = 'f';
+	else if ((modeInfo & 0x4000) == 0x4000) { 
+		//Directory. Also needs to add this into directory 
+		//structure
+		row.type = 'd';
+		kind |= INODE_IS_DIRECTORY;
+	}
+	else row.type = '?';
+
+	//The full mode info, owner, group id and link count
+	row.mode = modeInfo;
+	row.owner = le16(inode->uid);
+	row.group = le16(inode->gid);
+	row.linkCount = le16(inode->linkCount);
+
+	//Creation, modification and access times
+	row.creationTime = le32(inode->creationTime);
+	row.modificationTime = le32(inode->modificationTime);
+	row.accessTime = le32(inode->accessTime);
+
+	//File size
+	unsigned int lower32 = le32(inode->size);
+	unsigned int upper32 = 0;
+	if (modeInfo & 0x8000) { //Regular file, might have higher 32
+		upper32 = le32(inode->sizeHigh);
+	}
+	row.size = ((unsigned long long) upper32 << 32) + (unsigned long long) lower32;
+
+	//File system block count
+	unsigned int smallBlockChunks = le32(inode->sectorCount);
+	//Number of file system blocks is dependent on the block size, rounded up
+	row.blockCount = (smallBlockChunks * 512 + blockSize - 1) / blockSize;
+
+	//Block pointers. The words of an extent tree's root are written as they are.
+	int extentMapped = isExtentMapped(inode);
+	for (int j = 0; j < 15; j++) {
+		//Read the ith pointer. Each pointer is 4 bytes wide. 
+		row.blockPointers[j] = le32(inode->block[j]);
+		if (row.blockPointers[j] != 0 && j >= 12 && !extentMapped) 
+			//Pointer 12 on points to indirect pointers
+			kind |= INODE_HAS_INDIRECT;
+	}
+	if (extentMapped) {
+		const struct ext4ExtentHeader* root = getExtentHeader(inode->block, sizeof(inode->block));
+		if (root != 0 && le16(root->depth) > 0 && le16(root->entryCount) > 0)
+			kind |= INODE_HAS_INDIRECT;
+	}
+	writeInodeRow(output, &row);
+	if (image->check != 0)
+		recordInodeForCheck(&row, inode);
+	return kind;
+}
+
+//Everything decoded from one block group's inodes. Groups are decoded independently (and
+//possibly in parallel), then stitched together in group order so the output is the same
+//as decoding every inode in sequence.
+struct inodeGroupResult {
+	struct outputBuffer text; //The group's rows of inode.csv
+	struct inodeList directoryInodes;
+	struct inodeList indirectInodes;
+};
+
+//Inodes are read in batches: a dense group's allocated inodes are fetched with a single
+//read spanning the table, while a sparse group gets one read per run of allocated inodes,
+//where inodes sharing a block count as the same run. Returns the end of the group's batch
+//that starts at index i of the allocated inode list.
+static unsigned long getInodeBatchEnd(const struct groupDescriptorFields* fields, unsigned long i) {
+	const uint32_t* groupInodes = image->allocatedInodes.inodes;
+	unsigned long inodesPerBlock = 
+		image->bytesPerInode > 0 ? image->blockSize / image->bytesPerInode : 1;
+	unsigned long gapLimit = inodesPerBlock > 0 ? inodesPerBlock : 1;
+	if (fields->allocatedListCount * DENSE_INODE_TABLE_RATIO >= image->inodesPerGroup)
+		gapLimit = image->inodesPerGroup;
+
+	unsigned long listEnd = fields->allocatedListStart + fields->allocatedListCount;
+	unsigned long batchEnd = i + 1;
+	while (batchEnd < listEnd && groupInodes[batchEnd] - groupInodes[batchEnd - 1] <= gapLimit)
+		batchEnd++;
+	return batchEnd;
+}
+
+//Adds the inode table ranges holding the group's allocated inodes to the plan, one per
+//batch
+static void planInodeGroup(int group) {
+	struct groupDescriptorFields* fields = &image->groupDescriptors[group];
+	const uint32_t* groupInodes = image->allocatedInodes.inodes;
+	unsigned long listEnd = fields->allocatedListStart + fields->allocatedListCount;
+	unsigned long i = fields->allocatedListStart;
+	while (i < listEnd) {
+		unsigned long batchEnd = getInodeBatchEnd(fields, i);
+		planMetadataRange(getInodeByteOffset(groupInodes[i]), 
+			(groupInodes[batchEnd - 1] - groupInodes[i] + 1) * image->bytesPerInode);
+		i = batchEnd;
+	}
+}
+
+//The groups one runInParallel call of readInodes decodes
+struct inodeJob {
+	struct inodeGroupResult* results;
+	int firstGroup;
+};
+
+//Decodes the allocated inodes of the job's taskIndex'th block group into its results
+static void decodeInodeGroup(int taskIndex, void* jobPointer) {
+	struct inodeJob* job = jobPointer;
+	int group = job->firstGroup + taskIndex;
+	struct inodeGroupResult* result = &job->results[group];
+	struct groupDescriptorFields* fields = &image->groupDescriptors[group];
+
+	struct outputBuffer* output = &result->text;
+	openMemoryOutput(output, OUTPUT_BUFFER_SIZE);
+	const uint32_t* groupInodes = image->allocatedInodes.inodes;
+
+	unsigned long listEnd = fields->allocatedListStart + fields->allocatedListCount;
+	unsigned long i = fields->allocatedListStart;
+	while (i < listEnd) {
+		unsigned long batchEnd = getInodeBatchEnd(fields, i);
+		unsigned long firstInode = groupInodes[i];
+		const unsigned char* batch = 
+			loadInodeTableRange(firstInode, groupInodes[batchEnd - 1] - firstInode + 1);
+
+		for (; i < batchEnd; i++) {
+			unsigned long currentInodeNumber = groupInodes[i];
+			//Locate the inode within the batch
+			const struct ext2Inode* inode = (const struct ext2Inode*) 
+				(batch + (currentInodeNumber - firstInode) * image->bytesPerInode);
+
+			int kind = decodeInode(output, currentInodeNumber, inode);
+			if (kind & INODE_IS_DIRECTORY)
+				appendInode(&result->directoryInodes, currentInodeNumber);
+			if (kind & INODE_HAS_INDIRECT)
+				appendInode(&result->indirectInodes, currentInodeNumber);
+		}
+	}
+}
+
+//Reads in inodes, populates pointers to denote found indoes with certain properties, 
+//and creates the csv
+static void readInodes() {
+	struct outputBuffer output;
+	openTableOutput(&output, TABLE_INODE);
+
+	//Decode each group's share of the list of populated inodes created in 
+	//readFreeBitmapEntry
+	struct inodeGroupResult* results = 
+		calloc(image->numGroups, sizeof(struct inodeGroupResult));
+	if (results == 0) {
+		fprintf(stderr, "Memory allocation error in readInodes\n");
+		exit(1);
+	}
+	//A stretch of groups at a time, as many as fit in a plan
+	struct inodeJob job = { results, 0 };
+	size_t planSize = getMetadataPlanSize();
+	while (job.firstGroup < image->numGroups) {
+		int planEnd = job.firstGroup;
+		while (planEnd < image->numGroups && image->plannedBytes < planSize)
+			planInodeGroup(planEnd++);
+		readMetadataPlan();
+		runInParallel(planEnd - job.firstGroup, decodeInodeGroup, &job);
+		clearMetadataPlan();
+		job.firstGroup = planEnd;
+	}
+
+	//Stitch the groups back together in inode order
+	for (int group = 0; group < image->numGroups; group++) {
+		struct inodeGroupResult* result = &results[group];
+		outputBytes(&output, result->text.data, result->text.length);
+		appendInodes(&image->directoryInodes, &result->directoryInodes);
+		appendInodes(&image->indirectInodes, &result->indirectInodes);
+
+		closeOutput(&result->text);
+		freeInodeList(&result->directoryInodes);
+		freeInodeList(&result->indirectInodes);
+	}
+	free(results);
+	closeTableOutput(&output, TABLE_INODE);
+}
+
+//Walks the data blocks of a file in logical order, resolving each one through the inode's
+//direct pointers or its single, double and triple indirect trees. The indirect blocks on
+//the path to the current block are kept, so each is read once, and reading one starts
+//readahead of everything it points to: the indirect blocks below it, or the data blocks
+//if it is on the lowest level. Null pointers are holes and are skipped, along with
+//everything below them.
+//
+//Extent mapped files are walked one extent at a time instead, in the order of their 
+//tree, which is logical order. The nodes on the path to the current extent are kept and
+//entering a node reads ahead what its entries point to, as for indirect blocks. Holes 
+//between extents and uninitialized extents, which read as zeros, are skipped.
+struct blockMap {
+	uint32_t pointers[15];
+	unsigned long blockCount; //Logical blocks in the file
+	unsigned long next; //Next logical block to resolve
+	uint32_t* path[3]; //Copies of the indirect blocks on the current path, top down
+	uint32_t pathBlocks[3]; //Their block numbers, 0 if not loaded
+
+	int extentMapped;
+	unsigned char extentRoot[60]; //The inode's i_block
+	const struct ext4ExtentHeader* extentPath[MAX_EXTENT_DEPTH + 1]; //Root first
+	unsigned char* extentBuffers[MAX_EXTENT_DEPTH + 1]; //Copies of the nodes below it
+	unsigned int extentNext[MAX_EXTENT_DEPTH + 1]; //Next entry to visit in each node
+	int extentLevels; //Nodes on the path, 0 once the tree is done
+	unsigned long extentLogical; //The current extent
+	unsigned long extentLength;
+	uint32_t extentStart;
+	unsigned long extentOffset; //Blocks of it already returned
+};
+
+//Reads ahead everything the entries of an extent tree node point to: the nodes below it,
+//or the extents' blocks that lie within the file
+static void prefetchExtentTargets(struct blockMap* map, const struct ext4ExtentHeader* header) {
+	for (unsigned long i = 0; i < le16(header->entryCount); i++) {
+		off_t offset = (off_t) getExtentEntryBlock(header, i) * image->blockSize;
+		if (le16(header->depth) > 0) {
+			prefetchImageRange(offset, image->blockSize);
+			continue;
+		}
+		const struct ext4Extent* extent = getExtent(header, i);
+		unsigned long logical = le32(extent->logicalBlock);
+		unsigned long length = getExtentLength(extent);
+		if (le16(extent->length) > UNINITIALIZED_EXTENT_LENGTH || logical >= map->blockCount)
+			continue;
+		if (length > map->blockCount - logical)
+			length = map->blockCount - logical;
+		prefetchImageRange(offset, length * image->blockSize);
+	}
+}
+
+//Moves on to the next initialized extent of an extent mapped file. Returns 0 once there
+//are no more.
+static int nextMapExtent(struct blockMap* map) {
+	while (map->extentLevels > 0) {
+		int top = map->extentLevels - 1;
+		const struct ext4ExtentHeader* header = map->extentPath[top];
+		if (map->extentNext[top] >= le16(header->entryCount)) {
+			map->extentLevels--;
+			continue;
+		}
+		unsigned long i = map->extentNext[top]++;
+		if (le16(header->depth) == 0) {
+			const struct ext4Extent* extent = getExtent(header, i);
+			if (le16(extent->length) > UNINITIALIZED_EXTENT_LENGTH)
+				continue;
+			map->extentLogical = le32(extent->logicalBlock);
+			map->extentLength = getExtentLength(extent);
+			map->extentStart = getExtentStart(extent);
+			map->extentOffset = 0;
+			return 1;
+		}
+
+		//Descend into the child, unless it isn't the node that should be there
+		if (map->extentBuffers[top + 1] == 0) {
+			map->extentBuffers[top + 1] = malloc(image->blockSize);
+			if (map->extentBuffers[top + 1] == 0) {
+				fprintf(stderr, "Memory allocation error in nextMapExtent\n");
+				exit(1);
+			}
+		}
+		memcpy(map->extentBuffers[top + 1], getImageBytes(
+			(off_t) getExtentChild(getExtentIndex(header, i)) * image->blockSize, 
+			image->blockSize), image->blockSize);
+		const struct ext4ExtentHeader* child = 
+			getExtentHeader(map->extentBuffers[top + 1], image->blockSize);
+		if (child == 0 || le16(child->depth) + 1 != le16(header->depth))
+			continue;
+		prefetchExtentTargets(map, child);
+		map->extentPath[top + 1] = child;
+		map->extentNext[top + 1] = 0;
+		map->extentLevels++;
+	}
+	return 0;
+}
+
+//Sets map up to walk the first blockCount logical blocks of inode
+static void initBlockMap(struct blockMap* map, const struct ext2Inode* inode, unsigned long blockCount) {
+	memset(map, 0, sizeof(*map));
+	if (isExtentMapped(inode)) {
+		map->extentMapped = 1;
+		map->blockCount = blockCount;
+		memcpy(map->extentRoot, inode->block, sizeof(map->extentRoot));
+		map->extentPath[0] = getExtentHeader(map->extentRoot, sizeof(map->extentRoot));
+		if (map->extentPath[0] != 0) {
+			map->extentLevels = 1;
+			prefetchExtentTargets(map, map->extentPath[0]);
+		}
+		return;
+	}
+	for (int j = 0; j < 15; j++)
+		map->pointers[j] = le32(inode->block[j]);
+
+	//Nothing past the end of the triple indirect tree can be mapped
+	unsigned long pointersPerBlock = image->blockSize / 4;
+	unsigned long maxBlocks = 12 + pointersPerBlock
+		+ pointersPerBlock * pointersPerBlock
+		+ pointersPerBlock * pointersPerBlock * pointersPerBlock;
+	map->blockCount = blockCount < maxBlocks ? blockCount : maxBlocks;
+}
+
+static void freeBlockMap(struct blockMap* map) {
+	for (int depth = 0; depth < 3; depth++)
+		free(map->path[depth]);
+	for (int depth = 0; depth <= MAX_EXTENT_DEPTH; depth++)
+		free(map->extentBuffers[depth]);
+}
+
+//Returns the indirect block at the given depth of the current path, reading it if it
+//isn't the one already there
+static const uint32_t* loadMapBlock(struct blockMap* map, int depth, uint32_t block) {
+	if (map->pathBlocks[depth] == block)
+		return map->path[depth];
+	if (map->path[depth] == 0) {
+		map->path[depth] = malloc(image->blockSize);
+		if (map->path[depth] == 0) {
+			fprintf(stderr, "Memory allocation error in loadMapBlock\n");
+			exit(1);
+		}
+	}
+	memcpy(map->path[depth], 
+		getImageBytes((off_t) block * image->blockSize, image->blockSize), image->blockSize);
+	map->pathBlocks[depth] = block;
+
+	//Read ahead what it points to, one request per run of consecutive blocks
+	const uint32_t* entries = map->path[depth];
+	unsigned long runStart = 0;
+	unsigned long runLength = 0;
+	for (unsigned long i = 0; i <= image->blockSize / 4; i++) {
+		uint32_t child = i < image->blockSize / 4 ? le32(entries[i]) : 0;
+		if (runLength > 0 && child == runStart + runLength) {
+			runLength++;
+			continue;
+		}
+		if (runLength > 0)
+			prefetchImageRange((off_t) runStart * image->blockSize, runLength * image->blockSize);
+		runStart = child;
+		runLength = child != 0;
+	}
+	return map->path[depth];
+}
+
+//Finds the next mapped block, storing its logical and physical block numbers. Returns 0
+//once the end of the file is reached.
+static int nextMappedBlock(struct blockMap* map, unsigned long* logical, uint32_t* physical) {
+	if (map->extentMapped) {
+		while (map->extentOffset == map->extentLength) {
+			if (!nextMapExtent(map))
+				return 0;
+		}
+		unsigned long block = (unsigned long) map->extentStart + map->extentOffset;
+		*logical = map->extentLogical + map->extentOffset;
+		map->extentOffset++;
+		//Extents are in logical order, so the first one past the end finishes the walk
+		if (*logical >= map->blockCount) {
+			map->extentLevels = 0;
+			map->extentOffset = map->extentLength;
+			return 0;
+		}
+		*physical = block > UINT32_MAX ? UINT32_MAX : block;
+		return 1;
+	}
+
+	unsigned long pointersPerBlock = image->blockSize / 4;
+	while (map->next < map->blockCount) {
+		uint32_t block;
+		unsigned long skip = 1; //Logical blocks covered if block turns out to be null
+
+		if (map->next < 12)
+			block = map->pointers[map->next];
+		else {
+			//Find the tree holding the block and its position within it
+			unsigned long index = map->next - 12;
+			unsigned long span = pointersPerBlock; //Blocks under the tree's top
+			int level = 1;
+			while (level < 3 && index >= span) {
+				index -= span;
+				span *= pointersPerBlock;
+				level++;
+			}
+
+			block = map->pointers[11 + level];
+			for (int depth = 0; depth < level && block != 0; depth++) {
+				const uint32_t* entries = loadMapBlock(map, depth, block);
+				span /= pointersPerBlock;
+				block = le32(entries[index / span]);
+				index %= span;
+			}
+			skip = span - index;
+		}
+
+		if (block == 0) {
+			map->next += skip;
+			continue;
+		}
+		*logical = map->next;
+		*physical = block;
+		map->next++;
+		return 1;
+	}
+	return 0;
+}
+
+//Number of bytes to fetch for a directory block: an entry that starts near the end of the
+//block is read in full even though it spills past it
+#define DIRECTORY_BLOCK_FETCH_SIZE (image->blockSize + sizeof(struct ext2DirectoryEntry) + 255)
+
+//printDirectoryBlock for a given block size
+static inline __attribute__((always_inline)) void printDirectoryBlockSized(
+		struct outputBuffer* output, unsigned long parentDirInode, 
+		const unsigned char* block, int* entryNo, unsigned long blockSize) {
+	int entryLen;
+	int nameLen;
+	int entryInode;
+
+	//keep track of where in block the current spot is
+	unsigned long currentEntryOffset = 0;
+
+	//Entries waiting to be recorded for --check or the lookup index, with their names
+	struct directoryReference references[CHECK_BATCH_SIZE];
+	const char* referenceNames[CHECK_BATCH_SIZE];
+	unsigned long referenceCount = 0;
+
+	//for every entry, until last entry is found / reaches end of block
+	while (currentEntryOffset < blockSize){
+		//increment entry number - this is why it starts at -1, because the first entry is 0
+		(*entryNo)++;
+		countEvents(&threadCounters.directoryEntries, 1);
+
+		const struct ext2DirectoryEntry* entry = 
+			(const struct ext2DirectoryEntry*) (block + currentEntryOffset);
+
+		//Read inode number of entry
+		entryInode = le32(entry->inode);
+
+		//Read rec_len. A zero length would never get anywhere, so treat it as the end of
+		//the block
+		entryLen = le16(entry->recordLength);
+		if (entryLen == 0) {
+			if (image->check != 0) {
+				referenceNames[referenceCount] = entry->name;
+				references[referenceCount++] = (struct directoryReference) 
+					{ parentDirInode, *entryNo, entryInode, 0, entry->nameLength, ENTRY_BAD };
+			}
+			break;
+		}
+
+		//If inode number is 0, stop recording info, increment current offset, move onto next entry
+		if (entryInode == 0){
+			currentEntryOffset += entryLen;
+			continue;
+		}
+
+		//else, continue recording and print info
+		//get name length
+		nameLen = entry->nameLength;
+
+		//print entry info. The name is cut short at any embedded null byte
+		writeDirectoryRow(output, parentDirInode, *entryNo, entryLen, nameLen, entryInode,
+			entry->name, strnlen(entry->name, nameLen));
+
+		if (image->check != 0) {
+			int flags = 0;
+			if (nameLen == 1 && entry->name[0] == '.')
+				flags |= ENTRY_DOT;
+			else if (nameLen == 2 && entry->name[0] == '.' && entry->name[1] == '.')
+				flags |= ENTRY_DOT_DOT;
+			if (entryLen < 8 + nameLen || entryLen % 4 != 0 || nameLen == 0 
+					|| currentEntryOffset + entryLen > blockSize)
+				flags |= ENTRY_BAD;
+			referenceNames[referenceCount] = entry->name;
+			references[referenceCount++] = (struct directoryReference) 
+				{ parentDirInode, *entryNo, entryInode, entryLen, nameLen, flags };
+			if (referenceCount == CHECK_BATCH_SIZE) {
+				recordDirectoryReferences(references, referenceNames, referenceCount);
+				referenceCount = 0;
+			}
+		}
+
+		//increment current offset
+		currentEntryOffset += entryLen;
+	} //end entry-reading loop
+	if (referenceCount > 0)
+		recordDirectoryReferences(references, referenceNames, referenceCount);
+}
+
+//countDirectoryEntries for a given block size
+static inline __attribute__((always_inline)) int countDirectoryEntriesSized(
+		const unsigned char* block, unsigned long blockSize) {
+	int count = 0;
+	unsigned long currentEntryOffset = 0;
+	while (currentEntryOffset < blockSize) {
+		count++;
+		int entryLen =
+			le16(((const struct ext2DirectoryEntry*) (block + currentEntryOffset))->recordLength);
+		if (entryLen == 0)
+			break;
+		currentEntryOffset += entryLen;
+	}
+	return count;
+}
+
+//Directory blocks are parsed by runInParallel tasks of about DIRECTORY_TASK_BLOCKS blocks.
+//A task takes whole directories until it has enough blocks, so small directories are 
+//batched, and a directory bigger than that is split over several tasks. The first entry
+//number of a task that starts partway into a directory is found by first counting the 
+//entries of the directory's earlier blocks.
+#define DIRECTORY_TASK_BLOCKS 64
+
+struct directoryTask {
+	unsigned long firstDirectory; //Directory of firstBlock, indexed like directoryInodes
+	unsigned long firstBlock; //Range of directoryBlocks parsed by this task
+	unsigned long endBlock;
+	int firstEntryNo; //Number of the last entry before firstBlock in its directory
+	int splitDirectory; //Set if the task shares a directory with another task
+	struct outputBuffer text;
+};
+
+struct directoryJob {
+	struct directoryTask* tasks;
+	uint32_t* directoryBlocks; //Every directory's data blocks, in directory order
+	unsigned long* directoryBlockStart; //Index of each directory's first block
+	int* blockEntryCounts; //Entries per block, only filled in for split directories
+};
+
+//Counts the entries in the blocks of a task that shares its directory with another task
+static void countDirectoryTask(int taskIndex, void* jobPointer) {
+	struct directoryJob* job = jobPointer;
+	struct directoryTask* task = &job->tasks[taskIndex];
+	if (!task->splitDirectory)
+		return;
+	for (unsigned long i = task->firstBlock; i < task->endBlock; i++)
+		job->blockEntryCounts[i] = countDirectoryEntries(getImageBytes(
+			(off_t) job->directoryBlocks[i] * image->blockSize, DIRECTORY_BLOCK_FETCH_SIZE));
+}
+
+//Prints the rows of a task's blocks into its own buffer
+static void parseDirectoryTask(int taskIndex, void* jobPointer) {
+	struct directoryJob* job = jobPointer;
+	struct directoryTask* task = &job->tasks[taskIndex];
+	openTableMemoryOutput(&task->text, TABLE_DIRECTORY, 64 * 1024);
+
+	unsigned long directory = task->firstDirectory;
+	int entryNo = task->firstEntryNo;
+	for (unsigned long i = task->firstBlock; i < task->endBlock; i++) {
+		//Moving on to the next directory (skipping any without blocks) restarts the count
+		while (job->directoryBlockStart[directory + 1] <= i) {
+			directory++;
+			entryNo = -1;
+		}
+		printDirectoryBlock(&task->text, image->directoryInodes.inodes[directory], 
+			getImageBytes((off_t) job->directoryBlocks[i] * image->blockSize, 
+				DIRECTORY_BLOCK_FETCH_SIZE), &entryNo);
+	}
+}
+
+static void readDirectories(){
+	struct outputBuffer output;
+	openTableOutput(&output, TABLE_DIRECTORY);
+	//For every directory inode, loop
+	//save field values here
+	unsigned long i;
+	struct directoryJob job;
+
+	//Collect every directory's data blocks, in logical order up to its size
+	unsigned long blockCapacity = image->directoryInodes.count * 2 + 16;
+	unsigned long totalBlocks = 0;
+	job.directoryBlocks = malloc(blockCapacity * sizeof(uint32_t));
+	job.directoryBlockStart = 
+		malloc((image->directoryInodes.count + 1) * sizeof(unsigned long));
+	if (job.directoryBlocks == 0 || job.directoryBlockStart == 0) {
+		fprintf(stderr, "Memory allocation error in readDirectories\n");
+		exit(1);
+	}
+	for (i = 0; i < image->directoryInodes.count; i++){ // loop through directory inodes
+		unsigned long parentInodeOffset = getInodeByteOffset(image->directoryInodes.inodes[i]);
+		const struct ext2Inode* parentInode = (const struct ext2Inode*)
+			getImageBytes(parentInodeOffset, sizeof(struct ext2Inode));
+		struct blockMap map;
+		initBlockMap(&map, parentInode,
+			((unsigned long) le32(parentInode->size) + image->blockSize - 1) / image->blockSize);
+
+		job.directoryBlockStart[i] = totalBlocks;
+		//loop through blocks pointed to by parent inode
+		unsigned long logicalBlock;
+		uint32_t physicalBlock;
+		while (nextMappedBlock(&map, &logicalBlock, &physicalBlock)) {
+			if (totalBlocks == blockCapacity) {
+				blockCapacity *= 2;
+				job.directoryBlocks = realloc(job.directoryBlocks, 
+					blockCapacity * sizeof(uint32_t));
+				if (job.directoryBlocks == 0) {
+					fprintf(stderr, "Memory allocation error in readDirectories\n");
+					exit(1);
+				}
+			}
+			job.directoryBlocks[totalBlocks++] = physicalBlock;
+		}
+		freeBlockMap(&map);
+	}
+	job.directoryBlockStart[image->directoryInodes.count] = totalBlocks;
+
+	//Cut the blocks into tasks, at directory boundaries where possible
+	unsigned long taskCapacity = totalBlocks / DIRECTORY_TASK_BLOCKS * 2 + 2;
+	int taskCount = 0;
+	job.tasks = calloc(taskCapacity, sizeof(struct directoryTask));
+	job.blockEntryCounts = malloc((totalBlocks + 1) * sizeof(int));
+	if (job.tasks == 0 || job.blockEntryCounts == 0) {
+		fprintf(stderr, "Memory allocation error in readDirectories\n");
+		exit(1);
+	}
+	unsigned long directory = 0;
+	unsigned long block = 0;
+	while (block < totalBlocks) {
+		while (job.directoryBlockStart[directory + 1] <= block)
+			directory++;
+		struct directoryTask* task = &job.tasks[taskCount++];
+		task->firstDirectory = directory;
+		task->firstBlock = block;
+		task->firstEntryNo = -1;
+
+		unsigned long directoryEnd = job.directoryBlockStart[directory + 1];
+		if (directoryEnd - job.directoryBlockStart[directory] > DIRECTORY_TASK_BLOCKS) {
+			//Part of a big directory
+			task->splitDirectory = 1;
+			block += DIRECTORY_TASK_BLOCKS;
+			if (block > directoryEnd)
+				block = directoryEnd;
+		}
+		else {
+			//Whole directories, until there are enough blocks or a big one comes up
+			block = directoryEnd;
+			while (block < totalBlocks && block - task->firstBlock < DIRECTORY_TASK_BLOCKS) {
+				directory++;
+				unsigned long nextEnd = job.directoryBlockStart[directory + 1];
+				if (nextEnd - job.directoryBlockStart[directory] > DIRECTORY_TASK_BLOCKS)
+					break;
+				block = nextEnd;
+			}
+		}
+		task->endBlock = block;
+	}
+
+	//Number the first entry of each task that continues a directory
+	runInParallel(taskCount, countDirectoryTask, &job);
+	int entryNo = -1;
+	for (int t = 0; t < taskCount; t++) {
+		struct directoryTask* task = &job.tasks[t];
+		if (!task->splitDirectory)
+			continue;
+		if (task->firstBlock == job.directoryBlockStart[task->firstDirectory])
+			entryNo = -1;
+		task->firstEntryNo = entryNo;
+		for (i = task->firstBlock; i < task->endBlock; i++)
+			entryNo += job.blockEntryCounts[i];
+	}
+
+	runInParallel(taskCount, parseDirectoryTask, &job);
+	for (int t = 0; t < taskCount; t++) {
+		appendTableRows(&output, &job.tasks[t].text, TABLE_DIRECTORY);
+		closeOutput(&job.tasks[t].text);
+	}
+	free(job.tasks);
+	free(job.blockEntryCounts);
+	free(job.directoryBlockStart);
+	free(job.directoryBlocks);
+	closeTableOutput(&output, TABLE_DIRECTORY);
+}
+
+/*	Given an output buffer for indirect.csv, the contents of an indirect block, its block 
+	number and the block size, prints every valid pointer of this block in the format: 
+	
+	blockPointer(hex),tableEntryNumber(dec),blockPointerValue(hex, if non-zero)
+*/
+static inline __attribute__((always_inline)) void printBlockInfoSized(
+		struct outputBuffer* output, const uint32_t* indirectBlock, 
+		unsigned long blockPointer, unsigned long blockSize) {
+	countEvents(&threadCounters.indirectBlocks, 1);
+	//Loop through each entry of the block, printing any valid pointers found. Null
+	//pointers are passed over a word (two pointers) at a time by the bitmap scanner's word
+	//skipping, so a zero-filled block isn't looked at entry by entry.
+	const unsigned char* bytes = (const unsigned char*) indirectBlock;
+	unsigned long wordCount = blockSize / 8;
+	unsigned long word = skipMatchingWordsImpl(bytes, 0, wordCount, 0);
+	while (word < wordCount) { 
+		//Since each block pointer has size 4, you at most find blockSize / 4 entries.
+		for (unsigned int i = word * 2; i < word * 2 + 2; i++) {
+			//Get the block pointer number
+			unsigned int pointerValue = le32(indirectBlock[i]);
+
+			//If the pointer value isn't zero, print it. Otherwise, skip it
+			if (pointerValue != 0)
+				writeIndirectRow(output, blockPointer, i, pointerValue);
+		}
+		word = skipMatchingWordsImpl(bytes, word + 1, wordCount, 0);
+	}
+}
+
+//Returns whether an indirect block holds nothing but null pointers
+static inline int isNullIndirectBlock(const uint32_t* indirectBlock) {
+	unsigned long wordCount = image->blockSize / 8;
+	return skipMatchingWordsImpl((const unsigned char*) indirectBlock, 0, wordCount, 0) 
+		== wordCount;
+}
+
+//Prints the indirect.csv rows of an extent tree node stored in blockPointer, the way
+//printBlockInfo does for an indirect block: one per entry, pointing at the node below
+//or, in a leaf, at the first block of the extent. A file's mapping takes one row per
+//extent rather than per block.
+static void printExtentNode(struct outputBuffer* output, const struct ext4ExtentHeader* header, 
+		unsigned long blockPointer) {
+	countEvents(&threadCounters.indirectBlocks, 1);
+	for (unsigned long i = 0; i < le16(header->entryCount); i++) {
+		uint32_t pointerValue = getExtentEntryBlock(header, i);
+		if (pointerValue != 0)
+			writeIndirectRow(output, blockPointer, i, pointerValue);
+	}
+}
+
+//Instantiates the decoders for one block size. size is a constant, except for the generic
+//set, which reads the image's block size at run time.
+#define DEFINE_BLOCK_SIZE_DECODERS(suffix, size) \
+	static int decodeInode##suffix(struct outputBuffer* output, \
+			unsigned long currentInodeNumber, const struct ext2Inode* inode) { \
+		return decodeInodeSized(output, currentInodeNumber, inode, size); \
+	} \
+	static void printDirectoryBlock##suffix(struct outputBuffer* output, \
+			unsigned long parentDirInode, const unsigned char* block, int* entryNo) { \
+		printDirectoryBlockSized(output, parentDirInode, block, entryNo, size); \
+	} \
+	static int countDirectoryEntries##suffix(const unsigned char* block) { \
+		return countDirectoryEntriesSized(block, size); \
+	} \
+	static void printBlockInfo##suffix(struct outputBuffer* output, \
+			const uint32_t* indirectBlock, unsigned long blockPointer) { \
+		printBlockInfoSized(output, indirectBlock, blockPointer, size); \
+	}
+
+DEFINE_BLOCK_SIZE_DECODERS(1K, 1024)
+DEFINE_BLOCK_SIZE_DECODERS(2K, 2048)
+DEFINE_BLOCK_SIZE_DECODERS(4K, 4096)
+DEFINE_BLOCK_SIZE_DECODERS(64K, 65536)
+DEFINE_BLOCK_SIZE_DECODERS(Generic, image->blockSize)
+
+#define BLOCK_SIZE_DECODERS(suffix, size) \
+	{ size, decodeInode##suffix, printDirectoryBlock##suffix, \
+		countDirectoryEntries##suffix, printBlockInfo##suffix }
+
+static const struct blockSizeDecoders blockSizeDecoders[] = {
+	BLOCK_SIZE_DECODERS(1K, 1024),
+	BLOCK_SIZE_DECODERS(2K, 2048),
+	BLOCK_SIZE_DECODERS(4K, 4096),
+	BLOCK_SIZE_DECODERS(64K, 65536),
+	BLOCK_SIZE_DECODERS(Generic, 0)
+};
+
+//Picks the decoders compiled for the image's block size, or the generic ones
+static void selectBlockSizeDecoders() {
+	int count = sizeof(blockSizeDecoders) / sizeof(blockSizeDecoders[0]);
+	unsigned long blockSize = image->blockSize;
+	int i = 0;
+	while (i < count - 1 && blockSizeDecoders[i].blockSize != blockSize)
+		i++;
+	image->decoders = &blockSizeDecoders[i];
+}
+
+//Indirect trees are walked depth first, in the order their rows appear in indirect.csv,
+//from an explicit stack of blocks still to visit. The top of the stack is always the next
+//block to print, so the reads for the blocks just below it can be started early: up to 
+//ioDepth of them are kept outstanding, and a read that finishes early keeps its buffer
+//until its block's turn comes. Every indirect block is read exactly once.
+//
+//How a read is started depends on how the image is accessed: a mapped image has the
+//kernel read the block ahead with madvise, an unmapped one submits the read to io_uring,
+//and if io_uring isn't available, posix_fadvise starts readahead and the block is read
+//synchronously when it is needed.
+enum { VISIT_PENDING, VISIT_IN_FLIGHT, VISIT_READY };
+
+struct indirectVisit {
+	uint32_t block;
+	int level; //For an extent tree node, the depth it should have
+	int extentNode; //Set for a node of an extent tree rather than an indirect block
+	int state;
+	unsigned char* data; //The block's contents once ready
+	unsigned char* buffer; //Buffer owned by this visit, if any
+	uint32_t inodeNumber; //The inode whose tree the block is in
+};
+
+struct indirectWalk {
+	struct indirectVisit* stack;
+	unsigned long depth; //Number of entries on the stack
+	unsigned long capacity;
+	int inFlight;
+	int useRing;
+	struct ioRing ring;
+	unsigned char** freeBuffers;
+	int freeBufferCount;
+};
+
+static void pushIndirectVisit(struct indirectWalk* walk, uint32_t block, int level, 
+		int extentNode, uint32_t inodeNumber) {
+	if (walk->depth == walk->capacity) {
+		walk->capacity = walk->capacity ? walk->capacity * 2 : 64;
+		walk->stack = realloc(walk->stack, walk->capacity * sizeof(struct indirectVisit));
+		if (walk->stack == 0) {
+			fprintf(stderr, "Memory allocation error in pushIndirectVisit\n");
+			exit(1);
+		}
+	}
+	struct indirectVisit visit = 
+		{ block, level, extentNode, VISIT_PENDING, 0, 0, inodeNumber };
+	walk->stack[walk->depth++] = visit;
+}
+
+static unsigned char* takeWalkBuffer(struct indirectWalk* walk) {
+	if (walk->freeBufferCount > 0)
+		return walk->freeBuffers[--walk->freeBufferCount];
+	unsigned char* buffer = malloc(image->blockSize);
+	if (buffer == 0) {
+		fprintf(stderr, "Memory allocation error in takeWalkBuffer\n");
+		exit(1);
+	}
+	return buffer;
+}
+
+static void releaseWalkBuffer(struct indirectWalk* walk, unsigned char* buffer) {
+	walk->freeBuffers = realloc(walk->freeBuffers, 
+		(walk->freeBufferCount + 1) * sizeof(unsigned char*));
+	if (walk->freeBuffers == 0) {
+		fprintf(stderr, "Memory allocation error in releaseWalkBuffer\n");
+		exit(1);
+	}
+	walk->freeBuffers[walk->freeBufferCount++] = buffer;
+}
+
+//Starts the read of the block at the given stack index
+static void startIndirectRead(struct indirectWalk* walk, unsigned long index) {
+	struct indirectVisit* visit = &walk->stack[index];
+	off_t offset = (off_t) visit->block * image->blockSize;
+
+	if (walk->useRing 
+			&& !(image->imageMap != 0 && offset + image->blockSize <= image->imageSize)) {
+		visit->buffer = takeWalkBuffer(walk);
+		int cached = image->blockCache.slotCount > 0 
+			&& copyCachedBlock(visit->block, visit->buffer);
+		if (!cached && isImageHole(offset, image->blockSize)) {
+			memset(visit->buffer, 0, image->blockSize);
+			cached = 1;
+		}
+		if (cached) {
+			visit->data = visit->buffer;
+			visit->state = VISIT_READY;
+			return;
+		}
+		if (submitRingRead(&walk->ring, image->imageFD, visit->buffer, image->blockSize, 
+				offset, index) == -1) {
+			//Couldn't queue it; read it when its turn comes instead
+			releaseWalkBuffer(walk, visit->buffer);
+			visit->buffer = 0;
+			return;
+		}
+	}
+	else prefetchImageRange(offset, image->blockSize);
+
+	visit->state = VISIT_IN_FLIGHT;
+	walk->inFlight++;
+}
+
+//Waits for the next io_uring read to finish and marks its block ready
+static void completeRingRead(struct indirectWalk* walk) {
+	uint64_t index;
+	int result;
+	waitRingCompletion(&walk->ring, &index, &result);
+	struct indirectVisit* visit = &walk->stack[index];
+	if (result < 0) {
+		//Fall back to a synchronous read for this block
+		memcpy(visit->buffer, 
+			getImageBytes((off_t) visit->block * image->blockSize, image->blockSize), 
+			image->blockSize);
+	}
+	else if (result < image->blockSize) {
+		//Past the end of the image
+		memset(visit->buffer + result, 0, image->blockSize - result);
+	}
+	if (result > 0)
+		countEvents(&threadCounters.bytesRead, result);
+	if (image->blockCache.slotCount > 0)
+		cacheBlock(visit->block, visit->buffer);
+	visit->data = visit->buffer;
+	visit->state = VISIT_READY;
+	walk->inFlight--;
+}
+
+//Keeps ioDepth reads outstanding for the blocks nearest the top of the stack
+static void topUpIndirectReads(struct indirectWalk* walk) {
+	unsigned long index = walk->depth;
+	while (walk->inFlight < ioDepth && index > 0) {
+		index--;
+		if (walk->stack[index].state == VISIT_PENDING)
+			startIndirectRead(walk, index);
+	}
+	if (walk->useRing)
+		flushRingSubmissions(&walk->ring);
+}
+
+//Makes the contents of the block on top of the stack available
+static void finishIndirectRead(struct indirectWalk* walk) {
+	struct indirectVisit* visit = &walk->stack[walk->depth - 1];
+	if (visit->state == VISIT_READY)
+		return;
+	if (visit->state == VISIT_IN_FLIGHT && visit->buffer != 0) {
+		while (visit->state != VISIT_READY)
+			completeRingRead(walk);
+		return;
+	}
+	if (visit->state == VISIT_IN_FLIGHT)
+		walk->inFlight--;
+
+	//Mapped, or read synchronously
+	const unsigned char* bytes = 
+		getImageBytes((off_t) visit->block * image->blockSize, image->blockSize);
+	if (image->imageMap != 0 && bytes >= image->imageMap 
+			&& bytes < image->imageMap + image->imageSize)
+		visit->data = (unsigned char*) bytes;
+	else {
+		visit->buffer = takeWalkBuffer(walk);
+		memcpy(visit->buffer, bytes, image->blockSize);
+		visit->data = visit->buffer;
+	}
+	visit->state = VISIT_READY;
+}
+
+//Pushes the children of an extent tree node, last one first. They are expected to be 
+//nodes one level further down.
+static void pushExtentChildren(struct indirectWalk* walk, const struct ext4ExtentHeader* header, 
+		uint32_t inodeNumber) {
+	if (le16(header->depth) == 0)
+		return;
+	for (long i = (long) le16(header->entryCount) - 1; i >= 0; i--) {
+		uint32_t child = getExtentChild(getExtentIndex(header, i));
+		if (child != 0)
+			pushIndirectVisit(walk, child, le16(header->depth) - 1, 1, inodeNumber);
+	}
+}
+
+//Reads the list of indirect nodes generated from readInodes and outputs the relevant 
+//information into the corresponding csv file
+static void readIndirectBlockEntries() {
+	struct outputBuffer output;
+	openTableOutput(&output, TABLE_INDIRECT);
+
+	struct indirectWalk walk;
+	memset(&walk, 0, sizeof(walk));
+	walk.useRing = image->imageMap == 0 && setupRing(&walk.ring, ioDepth) == 0;
+
+	//Push the single, double and triple indirect pointers of every inode, last one first
+	//so the first inode's single indirect block ends up on top
+	for (long i = (long) image->indirectInodes.count - 1; i >= 0; i--) {
+		unsigned long currentInodeNumber = image->indirectInodes.inodes[i];
+		//Locate the inode from the inode number
+		unsigned long inodeByteOffset = getInodeByteOffset(currentInodeNumber);
+
+		//Find the indirect pointers. All three are copied out before any traversal, 
+		//which may replace the buffered bytes they were decoded from
+		const struct ext2Inode* inode = (const struct ext2Inode*) 
+			getImageBytes(inodeByteOffset, sizeof(struct ext2Inode));
+		if (isExtentMapped(inode)) {
+			//The root was checked by decodeInode
+			pushExtentChildren(&walk, 
+				getExtentHeader(inode->block, sizeof(inode->block)), currentInodeNumber);
+			continue;
+		}
+		for (int level = 3; level >= 1; level--) {
+			uint32_t pointer = le32(inode->block[11 + level]);
+			if (pointer != 0)
+				pushIndirectVisit(&walk, pointer, level, 0, currentInodeNumber);
+		}
+	}
+
+	while (walk.depth > 0) {
+		topUpIndirectReads(&walk);
+		finishIndirectRead(&walk);
+
+		//Pop the block, print its rows, then push its children so they are visited next
+		struct indirectVisit visit = walk.stack[--walk.depth];
+		if (visit.extentNode) {
+			const struct ext4ExtentHeader* header = 
+				getExtentHeader(visit.data, image->blockSize);
+			if (header != 0) {
+				printExtentNode(&output, header, visit.block);
+				if (image->check != 0)
+					recordExtentNodeForCheck(visit.inodeNumber, visit.block, header);
+				if (le16(header->depth) == visit.level)
+					pushExtentChildren(&walk, header, visit.inodeNumber);
+			}
+			if (visit.buffer != 0)
+				releaseWalkBuffer(&walk, visit.buffer);
+			continue;
+		}
+		const uint32_t* indirectBlock = (const uint32_t*) visit.data;
+		printBlockInfo(&output, indirectBlock, visit.block);
+		if (image->check != 0)
+			recordIndirectBlockForCheck(visit.inodeNumber, visit.block, indirectBlock);
+
+		//If your indirect level is 1, all pointers in the table are real data blocks. 
+		if (visit.level > 1 && !isNullIndirectBlock(indirectBlock)) {
+			for (long i = image->blockSize / 4 - 1; i >= 0; i--) {
+				uint32_t pointerValue = le32(indirectBlock[i]);
+				if (pointerValue != 0)
+					pushIndirectVisit(&walk, pointerValue, visit.level - 1, 0,
+						visit.inodeNumber);
+			}
+		}
+		if (visit.buffer != 0)
+			releaseWalkBuffer(&walk, visit.buffer);
+	}
+
+	if (walk.useRing)
+		closeRing(&walk.ring);
+	for (int i = 0; i < walk.freeBufferCount; i++)
+		free(walk.freeBuffers[i]);
+	free(walk.freeBuffers);
+	free(walk.stack);
+	closeTableOutput(&output, TABLE_INDIRECT);
+}
+
+//Fused mode produces all four CSVs from a single pass over the image's metadata, instead of
+//one pass per phase. Every block that has to be read is queued as a task keyed by its
+//block number, and tasks are run in ascending block order, so the image is read front to
+//back. Decoding a block can queue more blocks (an inode bitmap queues the inode table
+//blocks holding allocated inodes, a directory inode its data and indirect blocks, an
+//indirect block its children); one that lies behind the current position waits for the
+//next sweep, which only happens when metadata points backwards. 
+//
+//Bitmap and inode rows are kept per group and written out as soon as every group before
+//them is done. Directory and indirect blocks are copied as they are read, and their rows
+//are printed once all of a group's blocks have arrived, since both depend on the order of 
+//blocks within a file rather than on disk.
+enum { TASK_BLOCK_BITMAP, TASK_INODE_BITMAP, TASK_INODE_TABLE, TASK_DIRECTORY, 
+	TASK_DIRECTORY_MAP, TASK_DIRECTORY_EXTENTS, TASK_INDIRECT };
+
+struct fusedTask {
+	uint32_t block;
+	int kind;
+	int group;
+	//Inode table: block within the table. Directory: logical block, or for an indirect
+	//block of a directory, the first logical block under it.
+	unsigned long index; 
+	void* target; //The directory or indirect node the block belongs to
+	//Indirect block of a directory: 1 if it points at data blocks, and so on. Extent tree
+	//node of a directory: the depth it should have.
+	int level; 
+};
+
+//A min-heap of tasks ordered by block number
+struct taskHeap {
+	struct fusedTask* tasks;
+	unsigned long count;
+	unsigned long capacity;
+};
+
+struct fusedDirectory {
+	unsigned long inodeNumber;
+	unsigned long blockCount; //Logical blocks, from i_size
+	//Copies of the data blocks, DIRECTORY_BLOCK_FETCH_SIZE each, indexed by logical block.
+	//0 for holes.
+	unsigned char** blocks; 
+};
+
+//An indirect block, or a node of an extent tree
+struct fusedIndirectNode {
+	uint32_t block;
+	int level; //For an extent tree node, the depth it should have
+	int extentNode;
+	int holdsData; //Part of a regular file, so the blocks its tree ends in are file contents
+	uint32_t* data;
+	//Indexed like data, or by entry in an extent tree node. 0 for null pointers.
+	struct fusedIndirectNode** children; 
+};
+
+struct fusedFile {
+	unsigned long inodeNumber;
+	//Single, double and triple indirect trees, or the nodes below an extent tree's root
+	struct fusedIndirectNode* roots[4];
+};
+
+struct fusedGroup {
+	struct outputBuffer bitmapText[2]; //Free blocks, then free inodes
+	struct outputBuffer inodeText;
+	struct arena arena; //Everything else of the group's, until its rows are written
+	struct inodeList allocatedInodes;
+	unsigned long nextAllocated; //First allocated inode not decoded yet
+	int bitmapsPending;
+	unsigned long inodeBlocksPending; //Counts the inode bitmap itself until it is read
+	unsigned long dataBlocksPending; //Directory and indirect blocks of this group's inodes
+	struct fusedDirectory** directories;
+	unsigned long directoryCount;
+	struct fusedFile** files;
+	unsigned long fileCount;
+};
+
+struct fusedScan {
+	struct taskHeap current; //Blocks at or after the position of this sweep
+	struct taskHeap next; //Blocks behind it, left for the next sweep
+	uint32_t position;
+	struct fusedGroup* groups;
+	//The first group whose rows have not been written to each file yet
+	int nextBitmapGroup;
+	int nextInodeGroup;
+	int nextDataGroup;
+	struct outputBuffer bitmapOutput;
+	struct outputBuffer inodeOutput;
+	struct outputBuffer directoryOutput;
+	struct outputBuffer indirectOutput;
+};
+
+static void pushHeapTask(struct taskHeap* heap, struct fusedTask task) {
+	if (heap->count == heap->capacity) {
+		heap->capacity = heap->capacity ? heap->capacity * 2 : 256;
+		heap->tasks = realloc(heap->tasks, heap->capacity * sizeof(struct fusedTask));
+		if (heap->tasks == 0) {
+			fprintf(stderr, "Memory allocation error in pushHeapTask\n");
+			exit(1);
+		}
+	}
+	unsigned long i = heap->count++;
+	while (i > 0 && heap->tasks[(i - 1) / 2].block > task.block) {
+		heap->tasks[i] = heap->tasks[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap->tasks[i] = task;
+}
+
+static struct fusedTask popHeapTask(struct taskHeap* heap) {
+	struct fusedTask top = heap->tasks[0];
+	struct fusedTask last = heap->tasks[--heap->count];
+	unsigned long i = 0;
+	while (2 * i + 1 < heap->count) {
+		unsigned long child = 2 * i + 1;
+		if (child + 1 < heap->count && heap->tasks[child + 1].block < heap->tasks[child].block)
+			child++;
+		if (last.block <= heap->tasks[child].block)
+			break;
+		heap->tasks[i] = heap->tasks[child];
+		i = child;
+	}
+	if (heap->count > 0)
+		heap->tasks[i] = last;
+	return top;
+}
+
+//Queues a task in this sweep if its block is still ahead, otherwise in the next one. 
+//sortKey is the block that decides; tasks that must run in order share one.
+static void queueFusedTask(struct fusedScan* scan, struct fusedTask task, uint32_t sortKey) {
+	if (sortKey >= scan->position)
+		pushHeapTask(&scan->current, task);
+	else
+		pushHeapTask(&scan->next, task);
+}
+
+static void queueIndirectNode(struct fusedScan* scan, struct fusedIndirectNode* node, int group) {
+	struct fusedTask task = { node->block, TASK_INDIRECT, group, 0, node };
+	scan->groups[group].dataBlocksPending++;
+	queueFusedTask(scan, task, node->block);
+}
+
+static struct fusedIndirectNode* newIndirectNode(struct fusedGroup* group, uint32_t block, int level) {
+	struct fusedIndirectNode* node = arenaAlloc(&group->arena, sizeof(struct fusedIndirectNode));
+	node->block = block;
+	node->level = level;
+	return node;
+}
+
+//Marks the blocks a streamed scan won't need in each group's metadata: the superblock
+//and descriptors, or their backups, in front of the bitmaps and inode table. The blocks
+//reserved for growing the descriptor table come after them and are left alone, since 
+//they belong to the resize inode's indirect tree.
+static void discardUnusedMetadata() {
+	unsigned long descriptorBlocks = 
+		((unsigned long) image->numGroups * image->descriptorSize + image->blockSize - 1) 
+		/ image->blockSize;
+	for (int group = 0; group < image->numGroups; group++) {
+		unsigned long first = image->firstDataBlock + (unsigned long) group * image->blocksPerGroup;
+		unsigned long end = image->groupDescriptors[group].blockBitmapBlock;
+		if (image->groupDescriptors[group].inodeBitmapBlock < end)
+			end = image->groupDescriptors[group].inodeBitmapBlock;
+		if (image->groupDescriptors[group].inodeTableBlock < end)
+			end = image->groupDescriptors[group].inodeTableBlock;
+		if (end > first + 1 + descriptorBlocks)
+			end = first + 1 + descriptorBlocks;
+		if (end > first)
+			discardStreamBlocks(first, end - first);
+	}
+}
+
+//Marks the free blocks in a group's block bitmap as not needed by a streamed scan
+static void discardFreeBlocks(int group) {
+	unsigned long blockBits = image->groupDescriptors[group].containedBlockCount;
+	unsigned char* builtBitmap;
+	const unsigned char* blockBitmap = getGroupBitmap(group, 0, &builtBitmap);
+	unsigned long first = image->firstDataBlock + (unsigned long) group * image->blocksPerGroup;
+	unsigned long runStart = findNextBit(blockBitmap, 0, blockBits, 0);
+	while (runStart < blockBits) {
+		unsigned long runEnd = findNextBit(blockBitmap, runStart, blockBits, 1);
+		discardStreamBlocks(first + runStart, runEnd - runStart);
+		runStart = findNextBit(blockBitmap, runEnd, blockBits, 0);
+	}
+	free(builtBitmap);
+}
+
+//Queues the blocks a directory's block pointers point to, direct and indirect, that lie
+//within its size
+static void queueDirectoryPointers(struct fusedScan* scan, int group, 
+		struct fusedDirectory* directory, const struct blockMap* map) {
+	unsigned long pointersPerBlock = image->blockSize / 4;
+	unsigned long treeStart = 12;
+	unsigned long treeSpan = pointersPerBlock;
+	for (int j = 0; j < 15; j++) {
+		unsigned long start = j < 12 ? j : treeStart;
+		if (j >= 12) {
+			treeStart += treeSpan;
+			treeSpan *= pointersPerBlock;
+		}
+		if (map->pointers[j] == 0 || start >= map->blockCount)
+			continue;
+		struct fusedTask task = { map->pointers[j], 
+			j < 12 ? TASK_DIRECTORY : TASK_DIRECTORY_MAP, group, start, directory, 
+			j < 12 ? 0 : j - 11 };
+		scan->groups[group].dataBlocksPending++;
+		queueFusedTask(scan, task, task.block);
+	}
+}
+
+//Marks the blocks of a regular file's extents in an extent tree leaf as not needed by a 
+//streamed scan
+static void discardExtentBlocks(const struct ext4ExtentHeader* header) {
+	for (unsigned long i = 0; i < le16(header->entryCount); i++) {
+		const struct ext4Extent* extent = getExtent(header, i);
+		discardStreamBlocks(getExtentStart(extent), getExtentLength(extent));
+	}
+}
+
+//Queues what the entries of a node of a directory's extent tree point to: the nodes below
+//it, or the data blocks of its extents, down to the directory's size
+static void queueDirectoryExtents(struct fusedScan* scan, int group, 
+		struct fusedDirectory* directory, const struct ext4ExtentHeader* header) {
+	for (unsigned long i = 0; i < le16(header->entryCount); i++) {
+		if (le16(header->depth) > 0) {
+			const struct ext4ExtentIndex* index = getExtentIndex(header, i);
+			if (le32(index->logicalBlock) >= directory->blockCount)
+				break;
+			struct fusedTask task = { getExtentChild(index), TASK_DIRECTORY_EXTENTS, group, 
+				0, directory, le16(header->depth) - 1 };
+			scan->groups[group].dataBlocksPending++;
+			queueFusedTask(scan, task, task.block);
+			continue;
+		}
+		const struct ext4Extent* extent = getExtent(header, i);
+		if (le16(extent->length) > UNINITIALIZED_EXTENT_LENGTH)
+			continue;
+		for (unsigned long k = 0; k < getExtentLength(extent); k++) {
+			unsigned long logical = le32(extent->logicalBlock) + k;
+			unsigned long block = (unsigned long) getExtentStart(extent) + k;
+			if (logical >= directory->blockCount || block > UINT32_MAX)
+				break;
+			struct fusedTask task = 
+				{ block, TASK_DIRECTORY, group, logical, directory, 0 };
+			scan->groups[group].dataBlocksPending++;
+			queueFusedTask(scan, task, task.block);
+		}
+	}
+}
+
+//Reads the group's inode bitmap, then queues the inode table blocks holding its allocated 
+//inodes
+static void scanInodeBitmap(struct fusedScan* scan, int group) {
+	struct imageStream* imageStream = &image->imageStream;
+	struct fusedGroup* fusedGroup = &scan->groups[group];
+	if (image->groupDescriptors[group].freeInodeCount < image->inodesPerGroup)
+		reserveInodes(&fusedGroup->allocatedInodes, 
+			image->inodesPerGroup - image->groupDescriptors[group].freeInodeCount);
+	printFreeInodes(&fusedGroup->bitmapText[1], group, &fusedGroup->allocatedInodes);
+	fusedGroup->bitmapsPending--;
+
+	//Queue each table block holding an allocated inode. All of them go in the same sweep
+	//so they are decoded in inode order.
+	uint32_t tableBlock = image->groupDescriptors[group].inodeTableBlock;
+	unsigned long firstInode = 1 + group * image->inodesPerGroup;
+	long lastBlock = -1;
+	uint32_t sortKey = 0;
+	for (unsigned long i = 0; i < fusedGroup->allocatedInodes.count; i++) {
+		unsigned long block = 
+			(fusedGroup->allocatedInodes.inodes[i] - firstInode) * image->bytesPerInode 
+			/ image->blockSize;
+		if ((long) block == lastBlock)
+			continue;
+		if (imageStream->active)
+			discardStreamBlocks(tableBlock + lastBlock + 1, block - lastBlock - 1);
+		if (lastBlock == -1)
+			sortKey = tableBlock + block;
+		lastBlock = block;
+		struct fusedTask task = { tableBlock + block, TASK_INODE_TABLE, group, block, 0 };
+		queueFusedTask(scan, task, sortKey);
+		fusedGroup->inodeBlocksPending++;
+	}
+	if (imageStream->active) {
+		unsigned long tableBlocks = 
+			((unsigned long) image->inodesPerGroup * image->bytesPerInode + image->blockSize - 1) 
+			/ image->blockSize;
+		discardStreamBlocks(tableBlock + lastBlock + 1, tableBlocks - lastBlock - 1);
+	}
+	fusedGroup->inodeBlocksPending--;
+}
+
+//Decodes the allocated inodes in one block of a group's inode table, queueing the blocks
+//of directories and indirect trees
+static void scanInodeTableBlock(struct fusedScan* scan, int group, unsigned long tableIndex) {
+	struct fusedGroup* fusedGroup = &scan->groups[group];
+	unsigned long firstInode = 1 + group * image->inodesPerGroup;
+	unsigned long inodesPerBlock = image->blockSize / image->bytesPerInode;
+	unsigned long blockFirstInode = firstInode + tableIndex * inodesPerBlock;
+	const unsigned char* block = getImageBytes(
+		((unsigned long) image->groupDescriptors[group].inodeTableBlock + tableIndex) 
+			* image->blockSize, 
+		image->blockSize);
+
+	while (fusedGroup->nextAllocated < fusedGroup->allocatedInodes.count) {
+		unsigned long currentInodeNumber = 
+			fusedGroup->allocatedInodes.inodes[fusedGroup->nextAllocated];
+		if (currentInodeNumber >= blockFirstInode + inodesPerBlock)
+			break;
+		fusedGroup->nextAllocated++;
+		const struct ext2Inode* inode = (const struct ext2Inode*) 
+			(block + (currentInodeNumber - blockFirstInode) * image->bytesPerInode);
+
+		int kind = decodeInode(&fusedGroup->inodeText, currentInodeNumber, inode);
+		int regular = (le16(inode->mode) & 0xF000) == 0x8000;
+		const struct ext4ExtentHeader* extentRoot = 
+			isExtentMapped(inode) ? getExtentHeader(inode->block, sizeof(inode->block)) : 0;
+		if (regular && image->imageStream.active) {
+			if (extentRoot != 0 && le16(extentRoot->depth) == 0)
+				discardExtentBlocks(extentRoot);
+			else if (!isExtentMapped(inode)) {
+				for (int j = 0; j < 12; j++)
+					if (le32(inode->block[j]) != 0)
+						discardStreamBlocks(le32(inode->block[j]), 1);
+			}
+		}
+		if (kind & INODE_IS_DIRECTORY) {
+			struct fusedDirectory* directory = 
+				arenaAlloc(&fusedGroup->arena, sizeof(struct fusedDirectory));
+			directory->inodeNumber = currentInodeNumber;
+			//Same blocks as readDirectories: the ones mapped within i_size
+			unsigned long blockCount = 
+				((unsigned long) le32(inode->size) + image->blockSize - 1) / image->blockSize;
+			struct blockMap map;
+			if (!isExtentMapped(inode)) {
+				initBlockMap(&map, inode, blockCount);
+				blockCount = map.blockCount;
+			}
+			directory->blockCount = blockCount;
+			directory->blocks = 
+				arenaAlloc(&fusedGroup->arena, blockCount * sizeof(unsigned char*));
+			fusedGroup->directories[fusedGroup->directoryCount++] = directory;
+
+			if (!isExtentMapped(inode))
+				queueDirectoryPointers(scan, group, directory, &map);
+			else if (extentRoot != 0)
+				queueDirectoryExtents(scan, group, directory, extentRoot);
+		}
+		if (kind & INODE_HAS_INDIRECT) {
+			struct fusedFile* file = arenaAlloc(&fusedGroup->arena, sizeof(struct fusedFile));
+			file->inodeNumber = currentInodeNumber;
+			fusedGroup->files[fusedGroup->fileCount++] = file;
+			if (isExtentMapped(inode)) {
+				//decodeInode only flags a valid root with nodes below it
+				for (unsigned long i = 0; i < le16(extentRoot->entryCount); i++) {
+					uint32_t child = getExtentChild(getExtentIndex(extentRoot, i));
+					if (child == 0)
+						continue;
+					file->roots[i] = 
+						newIndirectNode(fusedGroup, child, le16(extentRoot->depth) - 1);
+					file->roots[i]->extentNode = 1;
+					file->roots[i]->holdsData = regular;
+					queueIndirectNode(scan, file->roots[i], group);
+				}
+				continue;
+			}
+			for (int level = 1; level <= 3; level++) {
+				uint32_t pointer = le32(inode->block[11 + level]);
+				if (pointer != 0) {
+					file->roots[level - 1] = newIndirectNode(fusedGroup, pointer, level);
+					file->roots[level - 1]->holdsData = regular;
+					queueIndirectNode(scan, file->roots[level - 1], group);
+				}
+			}
+		}
+	}
+	fusedGroup->inodeBlocksPending--;
+}
+
+//Copies an indirect block or extent tree node and queues its children
+static void scanIndirectBlock(struct fusedScan* scan, int group, struct fusedIndirectNode* node) {
+	struct fusedGroup* fusedGroup = &scan->groups[group];
+	node->data = arenaAlloc(&fusedGroup->arena, image->blockSize);
+	memcpy(node->data, 
+		getImageBytes((unsigned long) node->block * image->blockSize, image->blockSize), 
+		image->blockSize);
+	if (node->extentNode) {
+		const struct ext4ExtentHeader* header = getExtentHeader(node->data, image->blockSize);
+		if (header == 0 || le16(header->depth) != node->level)
+			return;
+		if (node->level == 0) {
+			if (node->holdsData && image->imageStream.active)
+				discardExtentBlocks(header);
+			return;
+		}
+		node->children = arenaAlloc(&fusedGroup->arena, 
+			le16(header->entryCount) * sizeof(struct fusedIndirectNode*));
+		for (unsigned long i = 0; i < le16(header->entryCount); i++) {
+			uint32_t child = getExtentChild(getExtentIndex(header, i));
+			if (child == 0)
+				continue;
+			node->children[i] = newIndirectNode(fusedGroup, child, node->level - 1);
+			node->children[i]->extentNode = 1;
+			node->children[i]->holdsData = node->holdsData;
+			queueIndirectNode(scan, node->children[i], group);
+		}
+		return;
+	}
+	if (node->level > 1 && !isNullIndirectBlock(node->data)) {
+		node->children = 
+			arenaAlloc(&fusedGroup->arena, 
+				image->blockSize / 4 * sizeof(struct fusedIndirectNode*));
+		for (unsigned long i = 0; i < image->blockSize / 4; i++) {
+			uint32_t pointerValue = le32(node->data[i]);
+			if (pointerValue != 0) {
+				node->children[i] = newIndirectNode(fusedGroup, pointerValue, node->level - 1);
+				node->children[i]->holdsData = node->holdsData;
+				queueIndirectNode(scan, node->children[i], group);
+			}
+		}
+	}
+	else if (node->holdsData && image->imageStream.active) {
+		for (unsigned long i = 0; i < image->blockSize / 4; i++)
+			if (le32(node->data[i]) != 0)
+				discardStreamBlocks(le32(node->data[i]), 1);
+	}
+}
+
+//Queues the children of an indirect block of a directory that lie within its size
+static void scanDirectoryMapBlock(struct fusedScan* scan, struct fusedTask* task) {
+	struct fusedDirectory* directory = task->target;
+	const uint32_t* entries = (const uint32_t*) 
+		getImageBytes((unsigned long) task->block * image->blockSize, image->blockSize);
+	unsigned long span = 1; //Logical blocks under each child
+	for (int level = 1; level < task->level; level++)
+		span *= image->blockSize / 4;
+
+	for (unsigned long i = 0; i < image->blockSize / 4; i++) {
+		unsigned long start = task->index + i * span;
+		if (start >= directory->blockCount)
+			break;
+		uint32_t pointerValue = le32(entries[i]);
+		if (pointerValue == 0)
+			continue;
+		struct fusedTask child = { pointerValue, 
+			task->level == 1 ? TASK_DIRECTORY : TASK_DIRECTORY_MAP, task->group, start, 
+			directory, task->level - 1 };
+		scan->groups[task->group].dataBlocksPending++;
+		queueFusedTask(scan, child, child.block);
+	}
+}
+
+//Prints the rows of inodeNumber's indirect tree in the same depth first order as 
+//readIndirectBlockEntries
+static void printIndirectTree(struct outputBuffer* output, struct fusedIndirectNode* node, 
+		uint32_t inodeNumber) {
+	if (node->extentNode) {
+		const struct ext4ExtentHeader* header = getExtentHeader(node->data, image->blockSize);
+		if (header == 0)
+			return;
+		printExtentNode(output, header, node->block);
+		if (image->check != 0)
+			recordExtentNodeForCheck(inodeNumber, node->block, header);
+		if (node->children != 0) {
+			for (unsigned long i = 0; i < le16(header->entryCount); i++)
+				if (node->children[i] != 0)
+					printIndirectTree(output, node->children[i], inodeNumber);
+		}
+		return;
+	}
+	printBlockInfo(output, node->data, node->block);
+	if (image->check != 0)
+		recordIndirectBlockForCheck(inodeNumber, node->block, node->data);
+	if (node->children != 0) {
+		for (unsigned long i = 0; i < image->blockSize / 4; i++)
+			if (node->children[i] != 0)
+				printIndirectTree(output, node->children[i], inodeNumber);
+	}
+}
+
+//Writes out every group whose rows are complete and follow the ones already written
+static void flushFusedGroups(struct fusedScan* scan) {
+	while (scan->nextBitmapGroup < image->numGroups 
+			&& scan->groups[scan->nextBitmapGroup].bitmapsPending == 0) {
+		struct fusedGroup* group = &scan->groups[scan->nextBitmapGroup++];
+		for (int part = 0; part < 2; part++) {
+			outputBytes(&scan->bitmapOutput, group->bitmapText[part].data, 
+				group->bitmapText[part].length);
+			closeOutput(&group->bitmapText[part]);
+		}
+	}
+	while (scan->nextInodeGroup < scan->nextBitmapGroup 
+			&& scan->groups[scan->nextInodeGroup].inodeBlocksPending == 0) {
+		struct fusedGroup* group = &scan->groups[scan->nextInodeGroup++];
+		outputBytes(&scan->inodeOutput, group->inodeText.data, group->inodeText.length);
+		closeOutput(&group->inodeText);
+		freeInodeList(&group->allocatedInodes);
+	}
+	while (scan->nextDataGroup < scan->nextInodeGroup 
+			&& scan->groups[scan->nextDataGroup].dataBlocksPending == 0) {
+		struct fusedGroup* group = &scan->groups[scan->nextDataGroup++];
+		for (unsigned long i = 0; i < group->directoryCount; i++) {
+			struct fusedDirectory* directory = group->directories[i];
+			int entryNo = -1;
+			for (unsigned long j = 0; j < directory->blockCount; j++) {
+				if (directory->blocks[j] != 0)
+					printDirectoryBlock(&scan->directoryOutput, directory->inodeNumber, 
+						directory->blocks[j], &entryNo);
+			}
+		}
+		for (unsigned long i = 0; i < group->fileCount; i++) {
+			struct fusedFile* file = group->files[i];
+			for (int root = 0; root < 4; root++)
+				if (file->roots[root] != 0)
+					printIndirectTree(&scan->indirectOutput, file->roots[root], 
+						file->inodeNumber);
+		}
+		freeArena(&group->arena);
+	}
+}
+
+static void runFusedScan() {
+	struct imageStream* imageStream = &image->imageStream;
+	struct fusedScan scan;
+	memset(&scan, 0, sizeof(scan));
+	openTableOutput(&scan.bitmapOutput, TABLE_BITMAP);
+	openTableOutput(&scan.inodeOutput, TABLE_INODE);
+	openTableOutput(&scan.directoryOutput, TABLE_DIRECTORY);
+	openTableOutput(&scan.indirectOutput, TABLE_INDIRECT);
+	scan.groups = 
+		arenaAlloc(&image->scanArena, image->numGroups * sizeof(struct fusedGroup));
+	if (imageStream->active)
+		discardUnusedMetadata();
+
+	for (int group = 0; group < image->numGroups; group++) {
+		struct fusedGroup* fusedGroup = &scan.groups[group];
+		openMemoryOutput(&fusedGroup->bitmapText[0], 4096);
+		openMemoryOutput(&fusedGroup->bitmapText[1], 4096);
+		openMemoryOutput(&fusedGroup->inodeText, 4096);
+		fusedGroup->directories = 
+			arenaAlloc(&fusedGroup->arena, image->inodesPerGroup * sizeof(struct fusedDirectory*));
+		fusedGroup->files = 
+			arenaAlloc(&fusedGroup->arena, image->inodesPerGroup * sizeof(struct fusedFile*));
+		fusedGroup->bitmapsPending = 2;
+		fusedGroup->inodeBlocksPending = 1;
+
+		struct fusedTask blockBitmap = 
+			{ image->groupDescriptors[group].blockBitmapBlock, TASK_BLOCK_BITMAP, group, 0, 0 };
+		struct fusedTask inodeBitmap = 
+			{ image->groupDescriptors[group].inodeBitmapBlock, TASK_INODE_BITMAP, group, 0, 0 };
+		pushHeapTask(&scan.current, blockBitmap);
+		pushHeapTask(&scan.current, inodeBitmap);
+	}
+
+	while (scan.current.count > 0) {
+		struct fusedTask task = popHeapTask(&scan.current);
+		scan.position = task.block;
+		struct fusedGroup* group = &scan.groups[task.group];
+
+		switch (task.kind) {
+			case TASK_BLOCK_BITMAP:
+				printFreeBlocks(&group->bitmapText[0], task.group);
+				if (imageStream->active)
+					discardFreeBlocks(task.group);
+				group->bitmapsPending--;
+				break;
+			case TASK_INODE_BITMAP:
+				scanInodeBitmap(&scan, task.group);
+				break;
+			case TASK_INODE_TABLE:
+				scanInodeTableBlock(&scan, task.group, task.index);
+				break;
+			case TASK_DIRECTORY: {
+				struct fusedDirectory* directory = task.target;
+				directory->blocks[task.index] = 
+					arenaAlloc(&group->arena, DIRECTORY_BLOCK_FETCH_SIZE);
+				memcpy(directory->blocks[task.index], 
+					getImageBytes((unsigned long) task.block * image->blockSize, 
+						DIRECTORY_BLOCK_FETCH_SIZE), 
+					DIRECTORY_BLOCK_FETCH_SIZE);
+				group->dataBlocksPending--;
+				break;
+			}
+			case TASK_DIRECTORY_MAP:
+				scanDirectoryMapBlock(&scan, &task);
+				group->dataBlocksPending--;
+				break;
+			case TASK_DIRECTORY_EXTENTS: {
+				const struct ext4ExtentHeader* header = getExtentHeader(
+					getImageBytes((unsigned long) task.block * image->blockSize, image->blockSize),
+					image->blockSize);
+				if (header != 0 && le16(header->depth) == task.level)
+					queueDirectoryExtents(&scan, task.group, task.target, header);
+				group->dataBlocksPending--;
+				break;
+			}
+			case TASK_INDIRECT:
+				scanIndirectBlock(&scan, task.group, task.target);
+				group->dataBlocksPending--;
+				break;
+		}
+		if (imageStream->active)
+			discardStreamBlocks(task.block, 1);
+		flushFusedGroups(&scan);
+
+		//Start another sweep from the front for blocks found behind the position
+		if (scan.current.count == 0) {
+			struct taskHeap swap = scan.current;
+			scan.current = scan.next;
+			scan.next = swap;
+			scan.position = 0;
+		}
+	}
+
+	free(scan.current.tasks);
+	free(scan.next.tasks);
+	closeTableOutput(&scan.bitmapOutput, TABLE_BITMAP);
+	closeTableOutput(&scan.inodeOutput, TABLE_INODE);
+	closeTableOutput(&scan.directoryOutput, TABLE_DIRECTORY);
+	closeTableOutput(&scan.indirectOutput, TABLE_INDIRECT);
+}
+
+//Incremental mode (--incremental index-file) keeps a sidecar index of the output: a 
+//checksum of every group's descriptor, bitmaps and inode table blocks, along with the 
+//group's share of bitmap.csv, inode.csv, directory.csv and indirect.csv. The next run
+//reads the index back, and a group whose checksum still matches has its rows copied from
+//it rather than decoded again, so the work done scales with how many groups changed.
+//Directory and indirect rows come from blocks outside the group's metadata, so the 
+//checksum also covers the data blocks of the group's directories and the indirect blocks
+//and extent tree nodes of its files. Those are read on every run, but only hashed rather
+//than decoded and formatted.
+//
+//The index starts with a header of INDEX_HEADER_SIZE bytes: the magic "LAB3AIDX", the
+//version, the output format, whether --bitmap-ranges was given and the number of groups
+//(u32 each), a hash of the file system's geometry and the offset of the group table (u64
+//each), all little endian. The groups' rows follow, and the group table comes last, with 
+//one INDEX_ENTRY_SIZE entry per group: the checksum, then the offset and length of each 
+//of its INDEX_PARTS parts (u64 each). An index that doesn't match the image or the 
+//options is ignored, and every group is decoded.
+#define INDEX_VERSION 2
+#define INDEX_HEADER_SIZE 40
+#define INDEX_PARTS 5
+#define INDEX_ENTRY_SIZE (8 + INDEX_PARTS * 16)
+
+//Parts of a group's output. The directory names part is only used by columnar output.
+enum { PART_BITMAP, PART_INODE, PART_DIRECTORY, PART_INDIRECT, PART_DIRECTORY_NAMES };
+static const int partTables[] = { TABLE_BITMAP, TABLE_INODE, TABLE_DIRECTORY, TABLE_INDIRECT };
+
+struct indexEntry {
+	uint64_t checksum;
+	uint64_t offset[INDEX_PARTS];
+	uint64_t length[INDEX_PARTS];
+};
+
+struct incrementalGroup {
+	uint64_t checksum;
+	int reused;
+	struct outputBuffer parts[4]; //Indexed like partTables, unused if reused
+};
+
+struct incrementalScan {
+	const unsigned char* oldIndex; //Mapping of the previous index, 0 if unusable
+	size_t oldIndexSize;
+	struct indexEntry* oldEntries;
+	struct indexEntry* newEntries;
+	struct outputBuffer newIndex;
+	struct outputBuffer outputs[4]; //Indexed like partTables
+	struct incrementalGroup* batch;
+	int batchStart;
+};
+
+//Mixes 8 bytes into a running hash
+static inline uint64_t hashWord(uint64_t hash, uint64_t word) {
+	hash ^= word;
+	hash *= 0x9e3779b97f4a7c15ULL;
+	return hash ^ (hash >> 29);
+}
+
+static uint64_t hashBytes(uint64_t hash, const unsigned char* bytes, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		hash = hashWord(hash, le64(word));
+	}
+	uint64_t tail = 0;
+	for (size_t j = 0; i + j < count; j++)
+		tail |= (uint64_t) bytes[i + j] << (8 * j);
+	return hashWord(hashWord(hash, tail), count);
+}
+
+static inline uint64_t readLittleEndian(const unsigned char* bytes, int width) {
+	uint64_t value = 0;
+	for (int i = 0; i < width; i++)
+		value |= (uint64_t) bytes[i] << (8 * i);
+	return value;
+}
+
+//Hash of the super block fields that every group's rows depend on
+static uint64_t getGeometryHash() {
+	uint64_t hash = 0;
+	hash = hashWord(hash, image->inodeCount);
+	hash = hashWord(hash, image->blockCount);
+	hash = hashWord(hash, image->blockSize);
+	hash = hashWord(hash, image->blocksPerGroup);
+	hash = hashWord(hash, image->inodesPerGroup);
+	hash = hashWord(hash, image->bytesPerInode);
+	return hashWord(hash, image->firstDataBlock);
+}
+
+//Maps the index left by the previous run and reads its group table, if it describes this
+//image with these options. Otherwise leaves scan->oldIndex at 0.
+static void loadOldIndex(struct incrementalScan* scan, const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	struct stat status;
+	if (fstat(fd, &status) == -1 || status.st_size < INDEX_HEADER_SIZE) {
+		close(fd);
+		return;
+	}
+	void* map = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	const unsigned char* index = map;
+	uint64_t size = status.st_size;
+	uint64_t tableOffset = readLittleEndian(index + 32, 8);
+	if (memcmp(index, "LAB3AIDX", 8) != 0
+			|| readLittleEndian(index + 8, 4) != INDEX_VERSION
+			|| readLittleEndian(index + 12, 4) != (uint64_t) outputFormat
+			|| readLittleEndian(index + 16, 4) != (uint64_t) bitmapRanges
+			|| readLittleEndian(index + 20, 4) != (uint64_t) image->numGroups
+			|| readLittleEndian(index + 24, 8) != getGeometryHash()
+			|| tableOffset > size 
+			|| (size - tableOffset) / INDEX_ENTRY_SIZE < (uint64_t) image->numGroups) {
+		munmap(map, size);
+		return;
+	}
+
+	scan->oldEntries = malloc(image->numGroups * sizeof(struct indexEntry));
+	if (scan->oldEntries == 0) {
+		fprintf(stderr, "Memory allocation error in loadOldIndex\n");
+		exit(1);
+	}
+	for (int group = 0; group < image->numGroups; group++) {
+		const unsigned char* field = index + tableOffset + group * INDEX_ENTRY_SIZE;
+		struct indexEntry* entry = &scan->oldEntries[group];
+		entry->checksum = readLittleEndian(field, 8);
+		for (int part = 0; part < INDEX_PARTS; part++) {
+			entry->offset[part] = readLittleEndian(field + 8 + part * 16, 8);
+			entry->length[part] = readLittleEndian(field + 16 + part * 16, 8);
+			//Parts have to lie within the rows section
+			if (entry->offset[part] > tableOffset 
+					|| entry->length[part] > tableOffset - entry->offset[part]) {
+				free(scan->oldEntries);
+				scan->oldEntries = 0;
+				munmap(map, size);
+				return;
+			}
+		}
+	}
+	scan->oldIndex = index;
+	scan->oldIndexSize = size;
+}
+
+//Appends the numbers of the group's allocated inodes to allocatedList
+static void listAllocatedInodes(int group, struct inodeList* allocatedList) {
+	unsigned long firstInode = 1 + group * image->inodesPerGroup;
+	unsigned char* builtBitmap;
+	const unsigned char* inodeBitmap = getGroupBitmap(group, 1, &builtBitmap);
+	unsigned long runStart = findNextBit(inodeBitmap, 0, image->inodesPerGroup, 1);
+	while (runStart < (unsigned long) image->inodesPerGroup) {
+		unsigned long runEnd = findNextBit(inodeBitmap, runStart, image->inodesPerGroup, 0);
+		reserveInodes(allocatedList, runEnd - runStart);
+		for (unsigned long i = runStart; i < runEnd; i++)
+			allocatedList->inodes[allocatedList->count++] = firstInode + i;
+		runStart = findNextBit(inodeBitmap, runEnd, image->inodesPerGroup, 1);
+	}
+	free(builtBitmap);
+}
+
+//Adds the data blocks of a directory to hash, as printDirectory reads them
+static uint64_t hashDirectoryBlocks(uint64_t hash, const struct ext2Inode* inode) {
+	struct blockMap map;
+	initBlockMap(&map, inode, 
+		((unsigned long) le32(inode->size) + image->blockSize - 1) / image->blockSize);
+	unsigned long logicalBlock;
+	uint32_t physicalBlock;
+	while (nextMappedBlock(&map, &logicalBlock, &physicalBlock))
+		hash = hashBytes(hashWord(hash, physicalBlock), getImageBytes(
+			(off_t) physicalBlock * image->blockSize, image->blockSize), image->blockSize);
+	freeBlockMap(&map);
+	return hash;
+}
+
+//Adds an indirect block and the indirect blocks below it to hash, as printIndirectBlocks
+//reads them
+static uint64_t hashIndirectBlocks(uint64_t hash, uint32_t block, int level) {
+	const unsigned char* bytes = 
+		getImageBytes((off_t) block * image->blockSize, image->blockSize);
+	hash = hashBytes(hashWord(hash, block), bytes, image->blockSize);
+	if (level == 1)
+		return hash;
+	uint32_t* data = malloc(image->blockSize);
+	if (data == 0) {
+		fprintf(stderr, "Memory allocation error in hashIndirectBlocks\n");
+		exit(1);
+	}
+	memcpy(data, bytes, image->blockSize);
+	for (unsigned long i = 0; i < image->blockSize / 4; i++)
+		if (le32(data[i]) != 0)
+			hash = hashIndirectBlocks(hash, le32(data[i]), level - 1);
+	free(data);
+	return hash;
+}
+
+//Adds an extent tree node and the nodes below it to hash, as printExtentTree reads them
+static uint64_t hashExtentTree(uint64_t hash, uint32_t block, int level) {
+	unsigned char* data = malloc(image->blockSize);
+	if (data == 0) {
+		fprintf(stderr, "Memory allocation error in hashExtentTree\n");
+		exit(1);
+	}
+	memcpy(data, getImageBytes((off_t) block * image->blockSize, image->blockSize), 
+		image->blockSize);
+	hash = hashBytes(hashWord(hash, block), data, image->blockSize);
+	const struct ext4ExtentHeader* header = getExtentHeader(data, image->blockSize);
+	if (header != 0 && level > 0 && le16(header->depth) == level) {
+		for (unsigned long i = 0; i < le16(header->entryCount); i++) {
+			uint32_t child = getExtentChild(getExtentIndex(header, i));
+			if (child != 0)
+				hash = hashExtentTree(hash, child, level - 1);
+		}
+	}
+	free(data);
+	return hash;
+}
+
+//Adds the blocks outside the inode table that an inode's directory.csv and indirect.csv 
+//rows are decoded from to hash
+static uint64_t hashInodeBlocks(uint64_t hash, uint32_t inodeNumber) {
+	//Copy the inode out first; reading its blocks may replace the bytes it is read from
+	struct ext2Inode inode;
+	memcpy(&inode, getImageBytes(getInodeByteOffset(inodeNumber), sizeof(inode)), 
+		sizeof(inode));
+	unsigned int mode = le16(inode.mode);
+	if ((mode & 0xA000) != 0xA000 && !(mode & 0x8000) && (mode & 0x4000))
+		hash = hashDirectoryBlocks(hash, &inode);
+
+	if (isExtentMapped(&inode)) {
+		const struct ext4ExtentHeader* header = 
+			getExtentHeader(inode.block, sizeof(inode.block));
+		if (header == 0 || le16(header->depth) == 0)
+			return hash;
+		for (unsigned long j = 0; j < le16(header->entryCount); j++) {
+			uint32_t child = getExtentChild(getExtentIndex(header, j));
+			if (child != 0)
+				hash = hashExtentTree(hash, child, le16(header->depth) - 1);
+		}
+		return hash;
+	}
+	for (int level = 1; level <= 3; level++)
+		if (le32(inode.block[11 + level]) != 0)
+			hash = hashIndirectBlocks(hash, le32(inode.block[11 + level]), level);
+	return hash;
+}
+
+//Checksums everything a group's rows are decoded from: its descriptor, both bitmaps, the
+//inode table blocks holding allocated inodes and the directory, indirect and extent tree
+//blocks those inodes point to
+static uint64_t getGroupChecksum(int group, const struct inodeList* allocatedList) {
+	struct groupDescriptorFields* fields = &image->groupDescriptors[group];
+	uint64_t hash = hashWord(0, group);
+	hash = hashBytes(hash, getImageBytes((off_t) (image->firstDataBlock + 1) * image->blockSize 
+		+ (off_t) group * image->descriptorSize, image->descriptorSize), image->descriptorSize);
+	hash = hashBytes(hash, getImageBytes((off_t) fields->blockBitmapBlock * image->blockSize, 
+		(fields->containedBlockCount + 7) / 8), (fields->containedBlockCount + 7) / 8);
+	hash = hashBytes(hash, getImageBytes((off_t) fields->inodeBitmapBlock * image->blockSize, 
+		(image->inodesPerGroup + 7) / 8), (image->inodesPerGroup + 7) / 8);
+
+	unsigned long firstInode = 1 + group * image->inodesPerGroup;
+	long lastBlock = -1;
+	for (unsigned long i = 0; i < allocatedList->count; i++) {
+		long block = 
+			(allocatedList->inodes[i] - firstInode) * image->bytesPerInode / image->blockSize;
+		if (block == lastBlock)
+			continue;
+		lastBlock = block;
+		hash = hashBytes(hash, getImageBytes(
+			((off_t) fields->inodeTableBlock + block) * image->blockSize, image->blockSize), 
+			image->blockSize);
+	}
+	for (unsigned long i = 0; i < allocatedList->count; i++)
+		hash = hashInodeBlocks(hash, allocatedList->inodes[i]);
+	return hash;
+}
+
+//Prints the directory.csv rows of one directory
+static void printDirectory(struct outputBuffer* output, unsigned long inodeNumber) {
+	const struct ext2Inode* inode = (const struct ext2Inode*) 
+		getImageBytes(getInodeByteOffset(inodeNumber), sizeof(struct ext2Inode));
+	struct blockMap map;
+	initBlockMap(&map, inode, 
+		((unsigned long) le32(inode->size) + image->blockSize - 1) / image->blockSize);
+
+	int entryNo = -1;
+	unsigned long logicalBlock;
+	uint32_t physicalBlock;
+	while (nextMappedBlock(&map, &logicalBlock, &physicalBlock))
+		printDirectoryBlock(output, inodeNumber, getImageBytes(
+			(off_t) physicalBlock * image->blockSize, DIRECTORY_BLOCK_FETCH_SIZE), &entryNo);
+	freeBlockMap(&map);
+}
+
+//Prints the indirect.csv rows of an indirect block and everything below it, depth first
+static void printIndirectBlocks(struct outputBuffer* output, uint32_t block, int level) {
+	uint32_t* data = malloc(image->blockSize);
+	if (data == 0) {
+		fprintf(stderr, "Memory allocation error in printIndirectBlocks\n");
+		exit(1);
+	}
+	memcpy(data, getImageBytes((off_t) block * image->blockSize, image->blockSize), 
+		image->blockSize);
+	printBlockInfo(output, data, block);
+	if (level > 1 && !isNullIndirectBlock(data)) {
+		for (unsigned long i = 0; i < image->blockSize / 4; i++)
+			if (le32(data[i]) != 0)
+				printIndirectBlocks(output, le32(data[i]), level - 1);
+	}
+	free(data);
+}
+
+//Prints the indirect.csv rows of an extent tree node and everything below it, depth first.
+//level is the depth the node should have.
+static void printExtentTree(struct outputBuffer* output, uint32_t block, int level) {
+	unsigned char* data = malloc(image->blockSize);
+	if (data == 0) {
+		fprintf(stderr, "Memory allocation error in printExtentTree\n");
+		exit(1);
+	}
+	memcpy(data, getImageBytes((off_t) block * image->blockSize, image->blockSize), 
+		image->blockSize);
+	const struct ext4ExtentHeader* header = getExtentHeader(data, image->blockSize);
+	if (header != 0) {
+		printExtentNode(output, header, block);
+		if (level > 0 && le16(header->depth) == level) {
+			for (unsigned long i = 0; i < le16(header->entryCount); i++) {
+				uint32_t child = getExtentChild(getExtentIndex(header, i));
+				if (child != 0)
+					printExtentTree(output, child, level - 1);
+			}
+		}
+	}
+	free(data);
+}
+
+//Checksums one group of the current batch and, unless the old index has its rows, 
+//decodes them
+static void scanIncrementalGroup(int taskIndex, void* scanPointer) {
+	struct incrementalScan* scan = scanPointer;
+	int group = scan->batchStart + taskIndex;
+	struct incrementalGroup* result = &scan->batch[taskIndex];
+
+	struct inodeList allocatedList = { 0, 0, 0 };
+	struct inodeList directoryList = { 0, 0, 0 };
+	struct inodeList indirectList = { 0, 0, 0 };
+	listAllocatedInodes(group, &allocatedList);
+	result->checksum = getGroupChecksum(group, &allocatedList);
+	result->reused = scan->oldIndex != 0 
+		&& scan->oldEntries[group].checksum == result->checksum;
+
+	if (!result->reused) {
+		for (int part = 0; part < 4; part++)
+			openTableMemoryOutput(&result->parts[part], partTables[part], 4096);
+
+		printFreeBlocks(&result->parts[PART_BITMAP], group);
+		printFreeInodes(&result->parts[PART_BITMAP], group, 0);
+
+		for (unsigned long i = 0; i < allocatedList.count; i++) {
+			uint32_t inodeNumber = allocatedList.inodes[i];
+			const struct ext2Inode* inode = (const struct ext2Inode*) 
+				getImageBytes(getInodeByteOffset(inodeNumber), image->bytesPerInode);
+			int kind = decodeInode(&result->parts[PART_INODE], inodeNumber, inode);
+			if (kind & INODE_IS_DIRECTORY)
+				appendInode(&directoryList, inodeNumber);
+			if (kind & INODE_HAS_INDIRECT)
+				appendInode(&indirectList, inodeNumber);
+		}
+
+		for (unsigned long i = 0; i < directoryList.count; i++)
+			printDirectory(&result->parts[PART_DIRECTORY], directoryList.inodes[i]);
+
+		for (unsigned long i = 0; i < indirectList.count; i++) {
+			//Copy the pointers out first; the walk may replace the bytes of the inode
+			const struct ext2Inode* inode = (const struct ext2Inode*) 
+				getImageBytes(getInodeByteOffset(indirectList.inodes[i]), 
+					sizeof(struct ext2Inode));
+			if (isExtentMapped(inode)) {
+				unsigned char root[sizeof(inode->block)];
+				memcpy(root, inode->block, sizeof(root));
+				const struct ext4ExtentHeader* header = getExtentHeader(root, sizeof(root));
+				for (unsigned long j = 0; j < le16(header->entryCount); j++) {
+					uint32_t child = getExtentChild(getExtentIndex(header, j));
+					if (child != 0)
+						printExtentTree(&result->parts[PART_INDIRECT], child, 
+							le16(header->depth) - 1);
+				}
+				continue;
+			}
+			uint32_t pointers[3];
+			for (int level = 1; level <= 3; level++)
+				pointers[level - 1] = le32(inode->block[11 + level]);
+			for (int level = 1; level <= 3; level++)
+				if (pointers[level - 1] != 0)
+					printIndirectBlocks(&result->parts[PART_INDIRECT], pointers[level - 1], 
+						level);
+		}
+	}
+	freeInodeList(&allocatedList);
+	freeInodeList(&directoryList);
+	freeInodeList(&indirectList);
+}
+
+//Appends one part of a group's rows to its table and records it in the new index. The
+//index copy is taken first, since appending columnar directory rows renumbers their names.
+static void emitGroupPart(struct incrementalScan* scan, struct indexEntry* entry, int part, 
+		struct outputBuffer* rows) {
+	entry->offset[part] = scan->newIndex.flushed + scan->newIndex.length;
+	entry->length[part] = rows->length;
+	outputBytes(&scan->newIndex, rows->data, rows->length);
+	if (part == PART_DIRECTORY) {
+		struct outputBuffer* names = rows->names;
+		entry->offset[PART_DIRECTORY_NAMES] = scan->newIndex.flushed + scan->newIndex.length;
+		entry->length[PART_DIRECTORY_NAMES] = names != 0 ? names->length : 0;
+		if (names != 0)
+			outputBytes(&scan->newIndex, names->data, names->length);
+	}
+	appendTableRows(&scan->outputs[part], rows, partTables[part]);
+}
+
+//Writes out the rows of the current batch in group order, from the old index for groups
+//that haven't changed
+static void emitIncrementalBatch(struct incrementalScan* scan, int batchCount) {
+	for (int i = 0; i < batchCount; i++) {
+		int group = scan->batchStart + i;
+		struct incrementalGroup* result = &scan->batch[i];
+		struct indexEntry* entry = &scan->newEntries[group];
+		entry->checksum = result->checksum;
+		for (int part = 0; part < 4; part++) {
+			if (result->reused) {
+				//Copy the stored rows into a buffer of their own, as appending them may
+				//modify them
+				struct indexEntry* oldEntry = &scan->oldEntries[group];
+				openTableMemoryOutput(&result->parts[part], partTables[part], 
+					oldEntry->length[part] + 1);
+				outputBytes(&result->parts[part], 
+					(const char*) scan->oldIndex + oldEntry->offset[part], 
+					oldEntry->length[part]);
+				if (result->parts[part].names != 0)
+					outputBytes(result->parts[part].names, (const char*) scan->oldIndex 
+						+ oldEntry->offset[PART_DIRECTORY_NAMES], 
+						oldEntry->length[PART_DIRECTORY_NAMES]);
+			}
+			emitGroupPart(scan, entry, part, &result->parts[part]);
+			closeOutput(&result->parts[part]);
+		}
+	}
+}
+
+static void runIncrementalScan() {
+	struct incrementalScan scan;
+	memset(&scan, 0, sizeof(scan));
+	loadOldIndex(&scan, indexPath);
+
+	for (int part = 0; part < 4; part++)
+		openTableOutput(&scan.outputs[part], partTables[part]);
+
+	//The new index is written next to the old one and replaces it once complete
+	char* newIndexPath = malloc(strlen(indexPath) + 5);
+	scan.newEntries = calloc(image->numGroups, sizeof(struct indexEntry));
+	if (newIndexPath == 0 || scan.newEntries == 0) {
+		fprintf(stderr, "Memory allocation error in runIncrementalScan\n");
+		exit(1);
+	}
+	sprintf(newIndexPath, "%s.new", indexPath);
+	openOutputFile(&scan.newIndex, newIndexPath);
+	outputBytes(&scan.newIndex, "LAB3AIDX", 8);
+	outputLittleEndian(&scan.newIndex, INDEX_VERSION, 4);
+	outputLittleEndian(&scan.newIndex, outputFormat, 4);
+	outputLittleEndian(&scan.newIndex, bitmapRanges, 4);
+	outputLittleEndian(&scan.newIndex, image->numGroups, 4);
+	outputLittleEndian(&scan.newIndex, getGeometryHash(), 8);
+	outputLittleEndian(&scan.newIndex, 0, 8); //Group table offset, filled in at the end
+
+	//Groups are checksummed and decoded a batch at a time, so only a batch's rows are 
+	//held in memory
+	int batchSize = threadCount * 4;
+	scan.batch = calloc(batchSize, sizeof(struct incrementalGroup));
+	if (scan.batch == 0) {
+		fprintf(stderr, "Memory allocation error in runIncrementalScan\n");
+		exit(1);
+	}
+	int reusedCount = 0;
+	for (scan.batchStart = 0; scan.batchStart < image->numGroups; scan.batchStart += batchSize) {
+		int batchCount = image->numGroups - scan.batchStart < batchSize 
+			? image->numGroups - scan.batchStart : batchSize;
+		runInParallel(batchCount, scanIncrementalGroup, &scan);
+		for (int i = 0; i < batchCount; i++)
+			reusedCount += scan.batch[i].reused;
+		emitIncrementalBatch(&scan, batchCount);
+	}
+
+	//Finish the new index with the group table
+	uint64_t tableOffset = scan.newIndex.flushed + scan.newIndex.length;
+	for (int group = 0; group < image->numGroups; group++) {
+		struct indexEntry* entry = &scan.newEntries[group];
+		outputLittleEndian(&scan.newIndex, entry->checksum, 8);
+		for (int part = 0; part < INDEX_PARTS; part++) {
+			outputLittleEndian(&scan.newIndex, entry->offset[part], 8);
+			outputLittleEndian(&scan.newIndex, entry->length[part], 8);
+		}
+	}
+	flushOutput(&scan.newIndex);
+	unsigned char field[8];
+	for (int i = 0; i < 8; i++)
+		field[i] = (unsigned char) (tableOffset >> (8 * i));
+	if (pwrite(scan.newIndex.fd, field, sizeof(field), 32) != sizeof(field)) {
+		perror("pwrite");
+		exit(1);
+	}
+	closeOutput(&scan.newIndex);
+	if (rename(newIndexPath, indexPath) == -1) {
+		perror(indexPath);
+		exit(1);
+	}
+
+	for (int part = 0; part < 4; part++)
+		closeTableOutput(&scan.outputs[part], partTables[part]);
+	if (scan.oldIndex != 0)
+		munmap((void*) scan.oldIndex, scan.oldIndexSize);
+	free(scan.oldEntries);
+	free(scan.newEntries);
+	free(scan.batch);
+	free(newIndexPath);
+	if (collectStats)
+		fprintf(stderr, "incremental: reused %d of %d groups\n", reusedCount, 
+			image->numGroups);
+}
+
+//Measurements of each phase, for --stats-json. Times blocked on I/O and output are summed
+//over threads, and so is CPU time. User CPU time covers decoding and formatting rows: the
+//two are interleaved field by field, so they aren't told apart. System CPU time includes
+//page faults, which is where reads of a mapped image go.
+struct phaseStats {
+	const char* name;
+	double seconds;
+	double cpuSeconds;
+	double systemSeconds;
+	unsigned long long majorFaults;
+	struct scanCounters counters;
+};
+
+#define MAX_PHASES 8
+static struct phaseStats phaseStats[MAX_PHASES];
+static int phaseCount = 0;
+
+//The phase runPhase is in, for the progress reports
+static const char* currentPhase = "starting";
+static unsigned long long scanStart;
+
+//Set by --progress: seconds between progress reports on stderr, or 0 for none
+static double progressInterval = 0;
+static pthread_mutex_t progressLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progressDone = PTHREAD_COND_INITIALIZER;
+static int progressStopping = 0;
+
+//Returns the user CPU time of the process, and its system CPU time and major faults
+static double getCPUSeconds(double* systemSeconds, unsigned long long* majorFaults) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	*systemSeconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	*majorFaults = usage.ru_majflt;
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+}
+
+//Runs one phase, recording its stats when --stats-json or --progress was given
+static void runPhase(const char* name, void (*phase)()) {
+	//The images of a batch are scanned at the same time, so their phases are only 
+	//measured together, as the batch
+	if (insideParallelTask) {
+		phase();
+		return;
+	}
+	__atomic_store_n(&currentPhase, name, __ATOMIC_RELAXED);
+	if (!collectStats) {
+		phase();
+		return;
+	}
+	struct scanCounters before, after;
+	unsigned long long faultsBefore, faultsAfter;
+	double systemBefore, systemAfter;
+	sumCounters(&before);
+	double cpuBefore = getCPUSeconds(&systemBefore, &faultsBefore);
+	unsigned long long start = currentNanoseconds();
+	phase();
+	unsigned long long end = currentNanoseconds();
+	double cpuAfter = getCPUSeconds(&systemAfter, &faultsAfter);
+	sumCounters(&after);
+
+	if (phaseCount == MAX_PHASES)
+		return;
+	struct phaseStats* stats = &phaseStats[phaseCount++];
+	stats->name = name;
+	stats->seconds = (end - start) / 1e9;
+	stats->cpuSeconds = cpuAfter - cpuBefore;
+	stats->systemSeconds = systemAfter - systemBefore;
+	stats->majorFaults = faultsAfter - faultsBefore;
+	stats->counters.bytesRead = after.bytesRead - before.bytesRead;
+	stats->counters.syscalls = after.syscalls - before.syscalls;
+	stats->counters.inodes = after.inodes - before.inodes;
+	stats->counters.directoryEntries = after.directoryEntries - before.directoryEntries;
+	stats->counters.indirectBlocks = after.indirectBlocks - before.indirectBlocks;
+	stats->counters.rows = after.rows - before.rows;
+	stats->counters.ioNanoseconds = after.ioNanoseconds - before.ioNanoseconds;
+	stats->counters.outputNanoseconds = after.outputNanoseconds - before.outputNanoseconds;
+}
+
+//Prints a line of progress: totals so far, and rates since the last report
+static void printProgress(struct scanCounters* last, unsigned long long* lastTime) {
+	struct scanCounters now;
+	sumCounters(&now);
+	unsigned long long time = currentNanoseconds();
+	double interval = (time - *lastTime) / 1e9;
+	if (interval <= 0)
+		interval = 1e-9;
+	fprintf(stderr, "[%8.1fs] %-16s inodes %llu (%.0f/s), entries %llu (%.0f/s), "
+		"indirect blocks %llu (%.0f/s), read %.1f MiB (%.1f MiB/s), rows %llu\n",
+		(time - scanStart) / 1e9, __atomic_load_n(&currentPhase, __ATOMIC_RELAXED),
+		now.inodes, (now.inodes - last->inodes) / interval,
+		now.directoryEntries, (now.directoryEntries - last->directoryEntries) / interval,
+		now.indirectBlocks, (now.indirectBlocks - last->indirectBlocks) / interval,
+		now.bytesRead / 1048576.0, (now.bytesRead - last->bytesRead) / 1048576.0 / interval,
+		now.rows);
+	*last = now;
+	*lastTime = time;
+}
+
+//Body of the progress thread: reports every progressInterval seconds until stopped
+static void* reportProgress(void* unused) {
+	struct scanCounters last;
+	memset(&last, 0, sizeof(last));
+	unsigned long long lastTime = scanStart;
+	unsigned long long intervalNanoseconds = progressInterval * 1e9;
+	unsigned long long nextReport = scanStart + intervalNanoseconds;
+
+	pthread_mutex_lock(&progressLock);
+	while (!progressStopping) {
+		//The condition variable waits on the realtime clock, so convert the deadline
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		unsigned long long now = currentNanoseconds();
+		unsigned long long wait = nextReport > now ? nextReport - now : 0;
+		deadline.tv_sec += (deadline.tv_nsec + wait) / 1000000000ULL;
+		deadline.tv_nsec = (deadline.tv_nsec + wait) % 1000000000ULL;
+		pthread_cond_timedwait(&progressDone, &progressLock, &deadline);
+		if (progressStopping || currentNanoseconds() < nextReport)
+			continue;
+		pthread_mutex_unlock(&progressLock);
+		printProgress(&last, &lastTime);
+		nextReport += intervalNanoseconds;
+		pthread_mutex_lock(&progressLock);
+	}
+	pthread_mutex_unlock(&progressLock);
+	return unused;
+}
+
+static void outputFixed(struct outputBuffer* output, double value) {
+	char text[32];
+	outputBytes(output, text, snprintf(text, sizeof(text), "%.6f", value));
+}
+
+//Writes text as a quoted JSON string
+static void outputJSONString(struct outputBuffer* output, const char* text) {
+	outputChar(output, '"');
+	for (const char* c = text; *c != 0; c++) {
+		if ((unsigned char) *c < 0x20) {
+			outputString(output, "\\u00");
+			outputUnsigned(output, (unsigned char) *c, 16, 2);
+			continue;
+		}
+		if (*c == '"' || *c == '\\')
+			outputChar(output, '\\');
+		outputChar(output, *c);
+	}
+	outputChar(output, '"');
+}
+
+//Writes the recorded phase stats to path as a JSON object
+static void writeStatsJSON(const char* path, const char* imagePath) {
+	struct outputBuffer output;
+	openOutputFile(&output, path);
+
+	outputString(&output, "{\n  \"image\": ");
+	outputJSONString(&output, imagePath);
+	outputString(&output, ",\n  \"threads\": ");
+	outputDecimal(&output, threadCount);
+	outputString(&output, ",\n  \"mapped\": ");
+	outputString(&output, image != 0 && image->imageMap != 0 ? "true" : "false");
+	outputString(&output, ",\n  \"phases\": [");
+
+	struct phaseStats total;
+	memset(&total, 0, sizeof(total));
+	total.name = "total";
+	for (int i = 0; i <= phaseCount; i++) {
+		struct phaseStats* stats = i < phaseCount ? &phaseStats[i] : &total;
+		if (i < phaseCount) {
+			total.seconds += stats->seconds;
+			total.cpuSeconds += stats->cpuSeconds;
+			total.systemSeconds += stats->systemSeconds;
+			total.majorFaults += stats->majorFaults;
+			addCounters(&total.counters, &stats->counters);
+			outputString(&output, i > 0 ? ",\n    {" : "\n    {");
+		}
+		else outputString(&output, "\n  ],\n  \"total\": {");
+
+		outputString(&output, "\"name\": ");
+		outputJSONString(&output, stats->name);
+		outputString(&output, ", \"seconds\": ");
+		outputFixed(&output, stats->seconds);
+		outputString(&output, ", \"decodeSeconds\": ");
+		outputFixed(&output, stats->cpuSeconds);
+		outputString(&output, ", \"systemSeconds\": ");
+		outputFixed(&output, stats->systemSeconds);
+		outputString(&output, ", \"ioSeconds\": ");
+		outputFixed(&output, stats->counters.ioNanoseconds / 1e9);
+		outputString(&output, ", \"outputSeconds\": ");
+		outputFixed(&output, stats->counters.outputNanoseconds / 1e9);
+		outputString(&output, ", \"syscalls\": ");
+		outputDecimal(&output, stats->counters.syscalls);
+		outputString(&output, ", \"bytesRead\": ");
+		outputDecimal(&output, stats->counters.bytesRead);
+		outputString(&output, ", \"majorFaults\": ");
+		outputDecimal(&output, stats->majorFaults);
+		outputString(&output, ", \"inodes\": ");
+		outputDecimal(&output, stats->counters.inodes);
+		outputString(&output, ", \"directoryEntries\": ");
+		outputDecimal(&output, stats->counters.directoryEntries);
+		outputString(&output, ", \"indirectBlocks\": ");
+		outputDecimal(&output, stats->counters.indirectBlocks);
+		outputString(&output, ", \"rows\": ");
+		outputDecimal(&output, stats->counters.rows);
+		outputString(&output, ", \"rowsPerSecond\": ");
+		outputFixed(&output,
+			stats->seconds > 0 ? stats->counters.rows / stats->seconds : 0);
+		outputChar(&output, '}');
+	}
+	outputString(&output, "\n}\n");
+	closeOutput(&output);
+}
+
+static inline int testCheckBit(const uint64_t* bits, unsigned long index) {
+	return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+static inline void setCheckBit(uint64_t* bits, unsigned long index) {
+	bits[index / 64] |= (uint64_t) 1 << (index % 64);
+}
+
+static int compareBlockReferences(const void* first, const void* second) {
+	const struct blockReference* a = first;
+	const struct blockReference* b = second;
+	if (a->block != b->block)
+		return a->block < b->block ? -1 : 1;
+	if (a->inode != b->inode)
+		return a->inode < b->inode ? -1 : 1;
+	if (a->indirectBlock != b->indirectBlock)
+		return a->indirectBlock < b->indirectBlock ? -1 : 1;
+	return (a->entry > b->entry) - (a->entry < b->entry);
+}
+
+static int compareDirectoryReferences(const void* first, const void* second) {
+	const struct directoryReference* a = first;
+	const struct directoryReference* b = second;
+	if (a->directory != b->directory)
+		return a->directory < b->directory ? -1 : 1;
+	return (a->entry > b->entry) - (a->entry < b->entry);
+}
+
+//Marks count blocks from index on as referenced, and those already marked as shared
+static void markReferencedBlocks(uint64_t* referenced, uint64_t* shared, 
+		unsigned long index, unsigned long count) {
+	unsigned long end = index + count;
+	while (index < end) {
+		unsigned long bits = 64 - index % 64 < end - index ? 64 - index % 64 : end - index;
+		uint64_t mask = (bits == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << bits) - 1) 
+			<< (index % 64);
+		shared[index / 64] |= referenced[index / 64] & mask;
+		referenced[index / 64] |= mask;
+		index += bits;
+	}
+}
+
+//Stores in problems, unless it is 0, a reference of its own for each block of reference
+//that is outside the file system, free or shared, and returns how many there are
+static unsigned long getBlockProblems(const struct blockReference* reference, 
+		const uint64_t* shared, struct blockReference* problems) {
+	const uint64_t* usedBlocks = image->check->usedBlocks;
+	unsigned long firstBlock = image->firstDataBlock;
+	unsigned long blockCount = (uint32_t) image->blockCount;
+	unsigned long start = reference->block;
+	unsigned long end = start + reference->length;
+	unsigned long count = 0;
+	unsigned long block = start;
+	while (block < end) {
+		uint64_t found;
+		unsigned long base;
+		if (block < firstBlock || block >= blockCount) {
+			found = 1;
+			base = block;
+			block++;
+		}
+		else {
+			unsigned long index = block - firstBlock;
+			unsigned long stop = (end < blockCount ? end : blockCount) - firstBlock;
+			unsigned long wordEnd = (index / 64 + 1) * 64;
+			base = firstBlock + index / 64 * 64;
+			found = (~usedBlocks[index / 64] | shared[index / 64]) 
+				& (~(uint64_t) 0 << (index % 64));
+			if (stop < wordEnd)
+				found &= ((uint64_t) 1 << (stop % 64)) - 1;
+			block = firstBlock + (stop < wordEnd ? stop : wordEnd);
+		}
+		for (; found != 0; found &= found - 1, count++) {
+			if (problems == 0)
+				continue;
+			unsigned long problemBlock = base + __builtin_ctzll(found);
+			problems[count] = (struct blockReference) { problemBlock, 1, reference->inode,
+				reference->indirectBlock, 
+				reference->entry + (problemBlock - start) * reference->entryStep, 0 };
+		}
+	}
+	return count;
+}
+
+//Writes " < value >", the way check.txt sets off numbers
+static void outputCheckNumber(struct outputBuffer* output, unsigned long value) {
+	outputString(output, " < ");
+	outputDecimal(output, value);
+	outputString(output, " >");
+}
+
+//Writes where a block pointer was found
+static void outputBlockReferrer(struct outputBuffer* output, const struct blockReference* reference) {
+	outputString(output, " INODE");
+	outputCheckNumber(output, reference->inode);
+	if (reference->indirectBlock != 0) {
+		outputString(output, " INDIRECT BLOCK");
+		outputCheckNumber(output, reference->indirectBlock);
+	}
+	outputString(output, " ENTRY");
+	outputCheckNumber(output, reference->entry);
+}
+
+//Cross-checks what the scan collected and writes every inconsistency found to check.txt, 
+//one per line: blocks referenced while free, more than once or outside the file system,
+//allocated blocks nothing uses, inodes whose link count doesn't match the directory 
+//entries naming them or that nothing names, and directory entries naming free or 
+//nonexistent inodes, with a wrong "." or "..", or with a bad record length. Everything 
+//is indexed by block or inode number in flat arrays and bitsets, so the only sorting is
+//of the problems found.
+static void runCheck() {
+	struct consistencyCheck* check = image->check;
+	struct outputBuffer output;
+	char path[4200];
+	snprintf(path, sizeof(path), "%s/check.txt", image->outputDirectory);
+	openOutputFile(&output, path);
+	unsigned long problems = 0;
+
+	unsigned long firstBlock = image->firstDataBlock;
+	unsigned long blockBits = image->blockCount > image->firstDataBlock 
+		? image->blockCount - image->firstDataBlock : 0;
+	size_t blockBitsetSize = (blockBits + 63) / 64 * sizeof(uint64_t);
+	uint64_t* referenced = arenaAlloc(&image->scanArena, blockBitsetSize);
+	uint64_t* shared = arenaAlloc(&image->scanArena, blockBitsetSize);
+
+	//Mark every referenced block, and the ones referenced more than once. Pointers taken 
+	//from inodes whose i_block doesn't hold block numbers are dropped.
+	struct blockReference* references = check->blockReferences;
+	unsigned long referenceCount = 0;
+	for (unsigned long i = 0; i < check->blockReferenceCount; i++) {
+		struct blockReference reference = references[i];
+		if (!check->inodes[reference.inode].hasBlockPointers)
+			continue;
+		references[referenceCount++] = reference;
+		unsigned long first = reference.block > firstBlock ? reference.block : firstBlock;
+		unsigned long last = (unsigned long) reference.block + reference.length;
+		if (last > (uint32_t) image->blockCount)
+			last = (uint32_t) image->blockCount;
+		if (first < last)
+			markReferencedBlocks(referenced, shared, first - firstBlock, last - first);
+	}
+
+	//Take a reference of its own for each invalid, free or shared block, and report them
+	//by block
+	unsigned long problemCount = 0;
+	for (unsigned long i = 0; i < referenceCount; i++)
+		problemCount += getBlockProblems(&references[i], shared, 0);
+	struct blockReference* blockProblems = 
+		malloc((problemCount + 1) * sizeof(struct blockReference));
+	if (blockProblems == 0) {
+		fprintf(stderr, "Memory allocation error in runCheck\n");
+		exit(1);
+	}
+	problemCount = 0;
+	for (unsigned long i = 0; i < referenceCount; i++)
+		problemCount += 
+			getBlockProblems(&references[i], shared, blockProblems + problemCount);
+	references = blockProblems;
+	qsort(references, problemCount, sizeof(struct blockReference), compareBlockReferences);
+	unsigned long end;
+	for (unsigned long i = 0; i < problemCount; i = end) {
+		uint32_t block = references[i].block;
+		end = i + 1;
+		while (end < problemCount && references[end].block == block)
+			end++;
+		if (block < firstBlock || block >= (uint32_t) image->blockCount) {
+			for (unsigned long j = i; j < end; j++) {
+				outputString(&output, "INVALID BLOCK");
+				outputCheckNumber(&output, block);
+				outputString(&output, " IN");
+				outputBlockReferrer(&output, &references[j]);
+				outputChar(&output, '\n');
+				problems++;
+			}
+			continue;
+		}
+		if (!testCheckBit(check->usedBlocks, block - firstBlock)) {
+			outputString(&output, "UNALLOCATED BLOCK");
+			outputCheckNumber(&output, block);
+			outputString(&output, " REFERENCED BY");
+		}
+		else {
+			outputString(&output, "MULTIPLY REFERENCED BLOCK");
+			outputCheckNumber(&output, block);
+			outputString(&output, " BY");
+		}
+		for (unsigned long j = i; j < end; j++)
+			outputBlockReferrer(&output, &references[j]);
+		outputChar(&output, '\n');
+		problems++;
+	}
+	free(blockProblems);
+
+	//Allocated blocks that no inode points to and that aren't group metadata: superblock
+	//and descriptor copies, with the blocks reserved after them, bitmaps and inode tables.
+	//With flexible block groups, a group's bitmaps and table may be in another group.
+	uint64_t* metadata = arenaAlloc(&image->scanArena, blockBitsetSize);
+	unsigned long tableBlocks = ((unsigned long) image->inodesPerGroup 
+		* image->bytesPerInode + image->blockSize - 1) / image->blockSize;
+	for (int group = 0; group < image->numGroups; group++) {
+		struct groupDescriptorFields* fields = &image->groupDescriptors[group];
+		unsigned long groupStart = (unsigned long) group * image->blocksPerGroup;
+		unsigned long overhead = getGroupOverhead(group);
+		for (unsigned long index = groupStart; 
+				index < groupStart + overhead && index < blockBits; index++)
+			setCheckBit(metadata, index);
+		unsigned long metadataBlocks[2] = 
+			{ fields->blockBitmapBlock, fields->inodeBitmapBlock };
+		for (int i = 0; i < 2; i++)
+			if (metadataBlocks[i] >= firstBlock && metadataBlocks[i] - firstBlock < blockBits)
+				setCheckBit(metadata, metadataBlocks[i] - firstBlock);
+		for (unsigned long i = 0; i < tableBlocks; i++) {
+			unsigned long block = fields->inodeTableBlock + i;
+			if (block >= firstBlock && block - firstBlock < blockBits)
+				setCheckBit(metadata, block - firstBlock);
+		}
+	}
+	for (unsigned long word = 0; word * 64 < blockBits; word++) {
+		uint64_t unreferenced = check->usedBlocks[word] & ~referenced[word] & ~metadata[word];
+		if (blockBits - word * 64 < 64)
+			unreferenced &= ((uint64_t) 1 << (blockBits - word * 64)) - 1;
+		while (unreferenced != 0) {
+			outputString(&output, "UNREFERENCED BLOCK");
+			outputCheckNumber(&output, firstBlock + word * 64 + __builtin_ctzll(unreferenced));
+			outputChar(&output, '\n');
+			problems++;
+			unreferenced &= unreferenced - 1;
+		}
+	}
+
+	//Count the entries naming each inode, and find each directory's parent: the 
+	//directory that names it other than as "." or "..". The root is its own parent.
+	unsigned long inodeCount = image->inodeCount;
+	uint32_t* links = arenaAlloc(&image->scanArena, (inodeCount + 1) * sizeof(uint32_t));
+	uint32_t* parents = arenaAlloc(&image->scanArena, (inodeCount + 1) * sizeof(uint32_t));
+	struct directoryReference* entries = check->directoryReferences;
+	for (unsigned long i = 0; i < check->directoryReferenceCount; i++) {
+		struct directoryReference entry = entries[i];
+		if (entry.inode == 0 || entry.inode > inodeCount || (entry.flags & ENTRY_BAD))
+			continue;
+		links[entry.inode]++;
+		if (!(entry.flags & (ENTRY_DOT | ENTRY_DOT_DOT)) 
+				&& (parents[entry.inode] == 0 || entry.directory < parents[entry.inode]))
+			parents[entry.inode] = entry.directory;
+	}
+	if (inodeCount >= 2)
+		parents[2] = 2;
+
+	//Allocated inodes. The reserved ones other than the root aren't named by anything.
+	for (unsigned long inode = 1; inode <= inodeCount; inode++) {
+		struct inodeFacts facts = check->inodes[inode];
+		if (!facts.decoded || (inode != 2 && inode < (unsigned long) image->firstInode))
+			continue;
+		if (links[inode] == 0 && (facts.mode == 0 || facts.linkCount == 0)) {
+			outputString(&output, "MISSING INODE");
+			outputCheckNumber(&output, inode);
+			outputString(&output, " SHOULD BE IN FREE LIST");
+			int group = (inode - 1) / image->inodesPerGroup;
+			outputCheckNumber(&output, image->groupDescriptors[group].inodeBitmapBlock);
+		}
+		else if (links[inode] == 0) {
+			outputString(&output, "UNREFERENCED INODE");
+			outputCheckNumber(&output, inode);
+		}
+		else if (facts.linkCount != links[inode]) {
+			outputString(&output, "LINKCOUNT");
+			outputCheckNumber(&output, inode);
+			outputString(&output, " IS");
+			outputCheckNumber(&output, facts.linkCount);
+			outputString(&output, " SHOULD BE");
+			outputCheckNumber(&output, links[inode]);
+		}
+		else continue;
+		outputChar(&output, '\n');
+		problems++;
+	}
+
+	//Directory entries, by directory and entry number
+	problemCount = 0;
+	for (unsigned long i = 0; i < check->directoryReferenceCount; i++) {
+		struct directoryReference entry = entries[i];
+		int wrongLink = ((entry.flags & ENTRY_DOT) && entry.inode != entry.directory)
+			|| ((entry.flags & ENTRY_DOT_DOT) && parents[entry.directory] != 0 
+				&& entry.inode != parents[entry.directory]);
+		if ((entry.flags & ENTRY_BAD) || entry.inode > inodeCount || wrongLink
+				|| !testCheckBit(check->usedInodes, entry.inode - 1))
+			entries[problemCount++] = entry;
+	}
+	qsort(entries, problemCount, sizeof(struct directoryReference), 
+		compareDirectoryReferences);
+	for (unsigned long i = 0; i < problemCount; i++) {
+		struct directoryReference entry = entries[i];
+		if (entry.flags & ENTRY_BAD) {
+			outputString(&output, "BAD ENTRY IN");
+			outputCheckNumber(&output, entry.directory);
+			outputString(&output, " ENTRY");
+			outputCheckNumber(&output, entry.entry);
+			outputString(&output, " REC_LEN");
+			outputCheckNumber(&output, entry.recordLength);
+			outputString(&output, " NAME_LEN");
+			outputCheckNumber(&output, entry.nameLength);
+		}
+		else if (entry.inode > inodeCount || !testCheckBit(check->usedInodes, entry.inode - 1)) {
+			outputString(&output, entry.inode > inodeCount ? "INVALID INODE" 
+				: "UNALLOCATED INODE");
+			outputCheckNumber(&output, entry.inode);
+			outputString(&output, " REFERENCED BY DIRECTORY");
+			outputCheckNumber(&output, entry.directory);
+			outputString(&output, " ENTRY");
+			outputCheckNumber(&output, entry.entry);
+		}
+		else {
+			outputString(&output, "INCORRECT ENTRY IN");
+			outputCheckNumber(&output, entry.directory);
+			outputString(&output, (entry.flags & ENTRY_DOT) ? " NAME < . > LINK" 
+				: " NAME < .. > LINK");
+			outputCheckNumber(&output, entry.inode);
+			outputString(&output, " SHOULD BE");
+			outputCheckNumber(&output, 
+				(entry.flags & ENTRY_DOT) ? entry.directory : parents[entry.directory]);
+		}
+		outputChar(&output, '\n');
+		problems++;
+	}
+
+	closeOutput(&output);
+	if (!insideParallelTask)
+		fprintf(stderr, "check: %lu problems\n", problems);
+}
+
+//The lookup index answers the queries of lab3a.h and --serve from what the scan collects
+//for --check. Blocks are kept as runs of consecutive blocks owned by the same inode, 
+//sorted by block, and directory entries other than "." and ".." as links, sorted once by
+//inode for parents and paths and once by name; each lookup is a binary search.
+struct blockOwnerRun {
+	uint32_t first;
+	uint32_t length;
+	uint32_t inode;
+};
+
+struct indexLink {
+	uint32_t inode;
+	uint32_t directory;
+	const char* name; //In the index's names, not null terminated
+	uint32_t nameLength;
+};
+
+struct lab3aIndex {
+	struct blockOwnerRun* blockRuns;
+	unsigned long blockRunCount;
+	struct indexLink* links; //By inode, then directory, then name
+	const struct indexLink** linksByName; //By name, then inode
+	unsigned long linkCount;
+	char* names;
+	uint32_t rootInode;
+};
+
+#define ROOT_INODE 2
+#define MAX_PATH_DEPTH 4096 //Deeper paths are taken to be directory loops
+
+//A key to sort by and what it belongs to
+struct sortItem {
+	uint64_t key;
+	uint64_t value;
+};
+
+#define RADIX_BITS 11
+#define RADIX_DIGITS ((64 + RADIX_BITS - 1) / RADIX_BITS)
+#define RADIX_MASK ((1 << RADIX_BITS) - 1)
+
+//Sorts count items by key with a least significant digit radix sort, RADIX_BITS at a 
+//time, moving them between items and scratch (which is as large), and returns the one
+//holding the result. Items with equal keys keep their order. Digits that are the same in
+//every key take no pass, so small keys sort in few passes.
+static struct sortItem* radixSortItems(struct sortItem* items, struct sortItem* scratch, 
+		unsigned long count) {
+	unsigned long (*positions)[1 << RADIX_BITS] = calloc(RADIX_DIGITS, sizeof(*positions));
+	if (positions == 0) {
+		fprintf(stderr, "Memory allocation error in radixSortItems\n");
+		exit(1);
+	}
+	for (unsigned long i = 0; i < count; i++)
+		for (int digit = 0; digit < RADIX_DIGITS; digit++)
+			positions[digit][(items[i].key >> (digit * RADIX_BITS)) & RADIX_MASK]++;
+
+	for (int digit = 0; digit < RADIX_DIGITS && count > 0; digit++) {
+		int shift = digit * RADIX_BITS;
+		if (positions[digit][(items[0].key >> shift) & RADIX_MASK] == count)
+			continue;
+		unsigned long position = 0;
+		for (int value = 0; value <= RADIX_MASK; value++) {
+			unsigned long valueCount = positions[digit][value];
+			positions[digit][value] = position;
+			position += valueCount;
+		}
+		for (unsigned long i = 0; i < count; i++)
+			scratch[positions[digit][(items[i].key >> shift) & RADIX_MASK]++] = items[i];
+		struct sortItem* sorted = scratch;
+		scratch = items;
+		items = sorted;
+	}
+	free(positions);
+	return items;
+}
+
+//Returns two arrays of count sort items, the second in *scratch
+static struct sortItem* allocateSortItems(unsigned long count, struct sortItem** scratch) {
+	struct sortItem* items = malloc((count + 1) * sizeof(struct sortItem));
+	*scratch = malloc((count + 1) * sizeof(struct sortItem));
+	if (items == 0 || *scratch == 0) {
+		fprintf(stderr, "Memory allocation error in allocateSortItems\n");
+		exit(1);
+	}
+	return items;
+}
+
+static inline int compareNames(const char* first, uint32_t firstLength, 
+		const char* second, uint32_t secondLength) {
+	int order = memcmp(first, second, 
+		firstLength < secondLength ? firstLength : secondLength);
+	if (order != 0)
+		return order;
+	return (firstLength > secondLength) - (firstLength < secondLength);
+}
+
+//Returns the first 8 bytes of a name as a number that orders like the name, shorter names
+//being padded with zeros
+static inline uint64_t getNamePrefix(const char* name, uint32_t nameLength) {
+	uint64_t prefix = 0;
+	for (int i = 0; i < 8; i++)
+		prefix = prefix << 8 | (i < (int) nameLength ? (unsigned char) name[i] : 0);
+	return prefix;
+}
+
+static int compareLinksByInode(const void* first, const void* second) {
+	const struct indexLink* a = first;
+	const struct indexLink* b = second;
+	if (a->inode != b->inode)
+		return a->inode < b->inode ? -1 : 1;
+	if (a->directory != b->directory)
+		return a->directory < b->directory ? -1 : 1;
+	return compareNames(a->name, a->nameLength, b->name, b->nameLength);
+}
+
+static int compareLinksByName(const void* first, const void* second) {
+	const struct indexLink* a = *(const struct indexLink* const*) first;
+	const struct indexLink* b = *(const struct indexLink* const*) second;
+	int order = compareNames(a->name, a->nameLength, b->name, b->nameLength);
+	if (order != 0)
+		return order;
+	//Links are in inode order, so their addresses are too
+	return (a > b) - (a < b);
+}
+
+//Builds the current image's lookup index from the block and directory references the 
+//scan collected, sorting with radix sorts and falling back on comparisons only for ties.
+//Pointers that --check would ignore are left out: those outside the file system, and
+//those of inodes whose i_block doesn't hold block numbers.
+static void buildLookupIndex() {
+	struct consistencyCheck* check = image->check;
+	struct lab3aIndex* index = calloc(1, sizeof(struct lab3aIndex));
+	if (index == 0) {
+		fprintf(stderr, "Memory allocation error in buildLookupIndex\n");
+		exit(1);
+	}
+	index->rootInode = ROOT_INODE;
+	//Keys hold an inode number in their low inodeBits bits, leaving the digits above them
+	//unused for small file systems
+	int inodeBits = 64 - __builtin_clzll((uint64_t) image->inodeCount | 1);
+	uint64_t inodeMask = ((uint64_t) 1 << inodeBits) - 1;
+
+	//References arrive mostly in file order, so cut them to the file system and join the
+	//ones that continue each other's blocks in one inode first, then sort the runs by 
+	//block, then inode
+	struct sortItem* scratch;
+	struct sortItem* runs = allocateSortItems(check->blockReferenceCount, &scratch);
+	unsigned long runCount = 0;
+	uint64_t runEnd = 0;
+	for (unsigned long i = 0; i < check->blockReferenceCount; i++) {
+		struct blockReference* reference = &check->blockReferences[i];
+		if (!check->inodes[reference->inode].hasBlockPointers)
+			continue;
+		uint64_t first = reference->block > (uint32_t) image->firstDataBlock 
+			? reference->block : (uint32_t) image->firstDataBlock;
+		uint64_t end = (uint64_t) reference->block + reference->length;
+		if (end > (uint32_t) image->blockCount)
+			end = (uint32_t) image->blockCount;
+		if (first >= end)
+			continue;
+		if (runCount > 0 && first == runEnd 
+				&& reference->inode == (runs[runCount - 1].key & inodeMask)) {
+			runs[runCount - 1].value += end - first;
+			runEnd = end;
+			continue;
+		}
+		runs[runCount++] = (struct sortItem) 
+			{ first << inodeBits | reference->inode, end - first };
+		runEnd = end;
+	}
+	struct sortItem* sorted = radixSortItems(runs, scratch, runCount);
+
+	//A block claimed by more than one run stays with the run that starts first, and 
+	//runs of the same inode that meet are joined
+	index->blockRuns = malloc((runCount + 1) * sizeof(struct blockOwnerRun));
+	if (index->blockRuns == 0) {
+		fprintf(stderr, "Memory allocation error in buildLookupIndex\n");
+		exit(1);
+	}
+	uint64_t coveredEnd = 0;
+	unsigned long keptCount = 0;
+	for (unsigned long i = 0; i < runCount; i++) {
+		uint64_t first = sorted[i].key >> inodeBits;
+		uint64_t end = first + sorted[i].value;
+		uint32_t inode = sorted[i].key & inodeMask;
+		if (end <= coveredEnd)
+			continue;
+		if (first < coveredEnd)
+			first = coveredEnd;
+		struct blockOwnerRun* last = keptCount > 0 ? &index->blockRuns[keptCount - 1] : 0;
+		if (last != 0 && last->inode == inode && last->first + last->length == first)
+			last->length += end - first;
+		else index->blockRuns[keptCount++] = 
+			(struct blockOwnerRun) { first, end - first, inode };
+		coveredEnd = end;
+	}
+	index->blockRunCount = keptCount;
+	free(runs);
+	free(scratch);
+
+	//Take over the names, then link each named inode to its directory
+	index->names = check->names;
+	check->names = 0;
+	struct indexLink* links = 
+		malloc((check->directoryReferenceCount + 1) * sizeof(struct indexLink));
+	struct sortItem* items = allocateSortItems(check->directoryReferenceCount, &scratch);
+	if (links == 0) {
+		fprintf(stderr, "Memory allocation error in buildLookupIndex\n");
+		exit(1);
+	}
+	unsigned long linkCount = 0;
+	for (unsigned long i = 0; i < check->directoryReferenceCount; i++) {
+		struct directoryReference* reference = &check->directoryReferences[i];
+		if (reference->flags != 0 || reference->inode == 0 
+				|| reference->inode > (uint32_t) image->inodeCount)
+			continue;
+		const char* name = index->names + reference->name;
+		items[linkCount] = (struct sortItem) 
+			{ (uint64_t) reference->inode << inodeBits | reference->directory, linkCount };
+		links[linkCount++] = (struct indexLink) { reference->inode, 
+			reference->directory, name, strnlen(name, reference->nameLength) };
+	}
+
+	//Order the links by inode and directory, then by name among links to the same inode
+	//from the same directory
+	sorted = radixSortItems(items, scratch, linkCount);
+	index->links = malloc((linkCount + 1) * sizeof(struct indexLink));
+	index->linksByName = malloc((linkCount + 1) * sizeof(struct indexLink*));
+	if (index->links == 0 || index->linksByName == 0) {
+		fprintf(stderr, "Memory allocation error in buildLookupIndex\n");
+		exit(1);
+	}
+	index->linkCount = linkCount;
+	for (unsigned long i = 0; i < linkCount; i++)
+		index->links[i] = links[sorted[i].value];
+	free(links);
+	unsigned long end;
+	for (unsigned long i = 0; i < linkCount; i = end) {
+		for (end = i + 1; end < linkCount && sorted[end].key == sorted[i].key; end++);
+		if (end - i > 1)
+			qsort(&index->links[i], end - i, sizeof(struct indexLink), compareLinksByInode);
+	}
+
+	//Sort by the names' first 8 bytes, then sort names that share them in full
+	for (unsigned long i = 0; i < linkCount; i++)
+		items[i] = (struct sortItem) 
+			{ getNamePrefix(index->links[i].name, index->links[i].nameLength), i };
+	sorted = radixSortItems(items, scratch, linkCount);
+	for (unsigned long i = 0; i < linkCount; i++)
+		index->linksByName[i] = &index->links[sorted[i].value];
+	for (unsigned long i = 0; i < linkCount; i = end) {
+		for (end = i + 1; end < linkCount && sorted[end].key == sorted[i].key; end++);
+		if (end - i > 1)
+			qsort(&index->linksByName[i], end - i, sizeof(struct indexLink*), 
+				compareLinksByName);
+	}
+	free(items);
+	free(scratch);
+	image->lookupIndex = index;
+}
+
+void lab3aFreeIndex(struct lab3aIndex* index) {
+	if (index == 0)
+		return;
+	free(index->blockRuns);
+	free(index->links);
+	free(index->linksByName);
+	free(index->names);
+	free(index);
+}
+
+uint32_t lab3aFindBlockOwner(const struct lab3aIndex* index, uint32_t block) {
+	//Find the last run starting at or before block
+	unsigned long low = 0;
+	unsigned long high = index->blockRunCount;
+	while (low < high) {
+		unsigned long middle = (low + high) / 2;
+		if (index->blockRuns[middle].first <= block)
+			low = middle + 1;
+		else high = middle;
+	}
+	if (low == 0)
+		return 0;
+	const struct blockOwnerRun* run = &index->blockRuns[low - 1];
+	return block - run->first < run->length ? run->inode : 0;
+}
+
+//Returns the first of inode's links, or 0 if it has none
+static const struct indexLink* findFirstLink(const struct lab3aIndex* index, uint32_t inode) {
+	unsigned long low = 0;
+	unsigned long high = index->linkCount;
+	while (low < high) {
+		unsigned long middle = (low + high) / 2;
+		if (index->links[middle].inode < inode)
+			low = middle + 1;
+		else high = middle;
+	}
+	if (low == index->linkCount || index->links[low].inode != inode)
+		return 0;
+	return &index->links[low];
+}
+
+uint32_t lab3aFindParent(const struct lab3aIndex* index, uint32_t inode) {
+	if (inode == index->rootInode)
+		return inode;
+	const struct indexLink* link = findFirstLink(index, inode);
+	return link != 0 ? link->directory : 0;
+}
+
+long lab3aGetPath(const struct lab3aIndex* index, uint32_t inode, char* path, size_t size) {
+	//Climb to the root, then write the names on the way back down
+	const struct indexLink* chain[MAX_PATH_DEPTH];
+	int depth = 0;
+	while (inode != index->rootInode) {
+		const struct indexLink* link = findFirstLink(index, inode);
+		if (link == 0 || depth == MAX_PATH_DEPTH)
+			return -1;
+		chain[depth++] = link;
+		inode = link->directory;
+	}
+
+	size_t length = 0;
+	for (int i = depth - 1; i >= 0; i--) {
+		if (length + 1 < size)
+			path[length] = '/';
+		length++;
+		for (uint32_t j = 0; j < chain[i]->nameLength; j++, length++)
+			if (length + 1 < size)
+				path[length] = chain[i]->name[j];
+	}
+	if (depth == 0) {
+		if (size > 1)
+			path[0] = '/';
+		length = 1;
+	}
+	if (size > 0)
+		path[length < size ? length : size - 1] = 0;
+	return length;
+}
+
+//Returns how many links are named name, storing the position of the first in 
+//linksByName in *first
+static unsigned long findNameLinks(const struct lab3aIndex* index, const char* name, 
+		size_t nameLength, unsigned long* first) {
+	unsigned long low = 0;
+	unsigned long high = index->linkCount;
+	while (low < high) {
+		unsigned long middle = (low + high) / 2;
+		const struct indexLink* link = index->linksByName[middle];
+		if (compareNames(link->name, link->nameLength, name, nameLength) < 0)
+			low = middle + 1;
+		else high = middle;
+	}
+	unsigned long end = low;
+	while (end < index->linkCount && compareNames(index->linksByName[end]->name, 
+			index->linksByName[end]->nameLength, name, nameLength) == 0)
+		end++;
+	*first = low;
+	return end - low;
+}
+
+unsigned long lab3aFindName(const struct lab3aIndex* index, const char* name, 
+		size_t nameLength, uint32_t* inodes, unsigned long maxInodes) {
+	unsigned long first;
+	unsigned long count = findNameLinks(index, name, nameLength, &first);
+	for (unsigned long i = 0; i < count && i < maxInodes; i++)
+		inodes[i] = index->linksByName[first + i]->inode;
+	return count;
+}
+
+//Scans the current image, which is already open, writing its CSVs to its output directory
+static void scanImage(int fused) {
+	runPhase("superBlock", readSuperBlock);
+	selectBlockSizeDecoders();
+	if (checkConsistency || image->buildLookupIndex)
+		startCheck();
+	if (image->imageMap == 0)
+		initBlockCache();
+	runPhase("groupDescriptors", readGroupDescriptor);
+	if (indexPath != 0)
+		runPhase("incrementalScan", runIncrementalScan);
+	else if (fused)
+		runPhase("fusedScan", runFusedScan);
+	else {
+		runPhase("bitmaps", readFreeBitmapEntry);
+		runPhase("inodes", readInodes);
+		runPhase("directories", readDirectories);
+		runPhase("indirect", readIndirectBlockEntries);
+	}
+	if (image->check != 0) {
+		//Before the check, which reorders what was collected
+		if (image->buildLookupIndex)
+			runPhase("lookupIndex", buildLookupIndex);
+		if (checkConsistency)
+			runPhase("check", runCheck);
+		freeCheck();
+	}
+}
+
+//Creates directory and any missing parents. Returns -1 on failure, with errno set.
+static int makeDirectories(const char* directory) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s", directory);
+	for (char* c = path + 1; ; c++) {
+		if (*c != '/' && *c != 0)
+			continue;
+		char end = *c;
+		*c = 0;
+		if (mkdir(path, 0777) == -1 && errno != EEXIST)
+			return -1;
+		if (end == 0)
+			return 0;
+		*c = end;
+	}
+}
+
+struct lab3aIndex* lab3aIndexImage(const char* imagePath, const char* outputDirectory) {
+	struct imageContext* callerImage = image;
+	struct imageContext context;
+	initImageContext(&context, outputDirectory != 0 ? outputDirectory : "");
+	context.discardTables = outputDirectory == 0;
+	context.buildLookupIndex = 1;
+	image = &context;
+	imageWindowLength = 0;
+
+	//As with lab3a, the output directory is only made for an image that will be scanned
+	if (openImage(imagePath, "lab3a", 1, 0) == 0 && isScannableImage(imagePath)) {
+		if (outputDirectory != 0 && (makeDirectories(outputDirectory) == -1 
+				|| access(outputDirectory, W_OK | X_OK) == -1))
+			fprintf(stderr, "lab3a: %s: %s\n", outputDirectory, strerror(errno));
+		else {
+			selectBitmapScanner();
+			scanImage(image->imageStream.active);
+		}
+	}
+	closeImage(0);
+	imageWindowLength = 0;
+	image = callerImage;
+	return context.lookupIndex;
+}
+
+//Writes count bytes to fd, returning 0 if it can't all be written
+static int writeAll(int fd, const char* data, size_t count) {
+	while (count > 0) {
+		ssize_t writeCount = write(fd, data, count);
+		if (writeCount == -1 && errno == EINTR)
+			continue;
+		if (writeCount <= 0)
+			return 0;
+		data += writeCount;
+		count -= writeCount;
+	}
+	return 1;
+}
+
+//Appends the answer to one --serve query (the line, without its newline) to output
+static void answerQuery(const struct lab3aIndex* index, const char* query, size_t length, 
+		struct outputBuffer* output) {
+	const char* space = memchr(query, ' ', length);
+	size_t commandLength = space != 0 ? (size_t) (space - query) : length;
+	const char* argument = space != 0 ? space + 1 : query + length;
+	size_t argumentLength = query + length - argument;
+
+	if (commandLength == 4 && memcmp(query, "name", 4) == 0) {
+		unsigned long first;
+		unsigned long count = findNameLinks(index, argument, argumentLength, &first);
+		for (unsigned long i = 0; i < count; i++) {
+			if (i > 0)
+				outputChar(output, ',');
+			outputDecimal(output, index->linksByName[first + i]->inode);
+		}
+		outputChar(output, '\n');
+		return;
+	}
+
+	//The other queries take a number
+	enum { QUERY_OWNER, QUERY_PARENT, QUERY_PATH } command;
+	if (commandLength == 5 && memcmp(query, "owner", 5) == 0)
+		command = QUERY_OWNER;
+	else if (commandLength == 6 && memcmp(query, "parent", 6) == 0)
+		command = QUERY_PARENT;
+	else if (commandLength == 4 && memcmp(query, "path", 4) == 0)
+		command = QUERY_PATH;
+	else {
+		outputString(output, "error: unknown query\n");
+		return;
+	}
+	char number[16];
+	char* end;
+	unsigned long value = 0;
+	int valid = argumentLength > 0 && argumentLength < sizeof(number) 
+		&& argument[0] >= '0' && argument[0] <= '9';
+	if (valid) {
+		memcpy(number, argument, argumentLength);
+		number[argumentLength] = 0;
+		errno = 0;
+		value = strtoul(number, &end, 10);
+		valid = *end == 0 && errno == 0 && value <= UINT32_MAX;
+	}
+	if (!valid)
+		outputString(output, "error: bad number");
+	else if (command == QUERY_OWNER)
+		outputDecimal(output, lab3aFindBlockOwner(index, value));
+	else if (command == QUERY_PARENT)
+		outputDecimal(output, lab3aFindParent(index, value));
+	else {
+		char path[4096];
+		long pathLength = lab3aGetPath(index, value, path, sizeof(path));
+		if (pathLength >= (long) sizeof(path)) {
+			char* longPath = malloc(pathLength + 1);
+			if (longPath == 0) {
+				fprintf(stderr, "Memory allocation error in answerQuery\n");
+				exit(1);
+			}
+			lab3aGetPath(index, value, longPath, pathLength + 1);
+			outputBytes(output, longPath, pathLength);
+			free(longPath);
+		}
+		else if (pathLength > 0)
+			outputBytes(output, path, pathLength);
+	}
+	outputChar(output, '\n');
+}
+
+//Answers the queries read from inputFD, one per line, on outputFD until the input ends or
+//the answers can't be written. The answers to all the queries that arrived together are
+//written at once.
+static void answerQueries(const struct lab3aIndex* index, int inputFD, int outputFD) {
+	char input[65536];
+	size_t inputLength = 0;
+	int discarding = 0; //Set while skipping the rest of a line too long to be a query
+	struct outputBuffer output;
+	openMemoryOutput(&output, OUTPUT_BUFFER_SIZE);
+	for (;;) {
+		ssize_t readCount = read(inputFD, input + inputLength, sizeof(input) - inputLength);
+		if (readCount == -1 && errno == EINTR)
+			continue;
+		if (readCount <= 0)
+			break;
+		inputLength += readCount;
+
+		size_t lineStart = 0;
+		const char* newline;
+		while ((newline = memchr(input + lineStart, '\n', inputLength - lineStart)) != 0) {
+			size_t lineLength = newline - (input + lineStart);
+			if (lineLength > 0 && input[lineStart + lineLength - 1] == '\r')
+				lineLength--;
+			if (discarding)
+				discarding = 0;
+			else answerQuery(index, input + lineStart, lineLength, &output);
+			lineStart = newline - input + 1;
+		}
+		memmove(input, input + lineStart, inputLength - lineStart);
+		inputLength -= lineStart;
+		if (inputLength == sizeof(input)) {
+			if (!discarding)
+				outputString(&output, "error: query too long\n");
+			discarding = 1;
+			inputLength = 0;
+		}
+
+		if (!writeAll(outputFD, output.data, output.length))
+			break;
+		output.length = 0;
+	}
+	closeOutput(&output);
+}
+
+//Serves queries on a Unix socket at socketPath, one connection at a time, until the 
+//process is killed
+static void serveSocket(const struct lab3aIndex* index, const char* socketPath, 
+		const char* programName) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "%s: socket path %s is too long\n", programName, socketPath);
+		exit(1);
+	}
+	strcpy(address.sun_path, socketPath);
+
+	//A socket left behind by an earlier server is replaced; anything else is an error
+	struct stat status;
+	if (lstat(socketPath, &status) == 0 && S_ISSOCK(status.st_mode))
+		unlink(socketPath);
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == -1 || bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1 
+			|| listen(listener, 16) == -1) {
+		perror(socketPath);
+		exit(1);
+	}
+	//A client that goes away before reading its answers only ends its own connection
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		int client = accept(listener, 0, 0);
+		if (client == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror(socketPath);
+			exit(1);
+		}
+		answerQueries(index, client, client);
+		close(client);
+	}
+}
+
+//Fills in an --output-dir template for the image at imagePath, the index'th one (from 1):
+//%n becomes the image's file name without its directory, a compression suffix or its 
+//extension, %i the index and %% a single %
+static void expandOutputDirectory(char* path, size_t size, const char* template, 
+		const char* imagePath, int index) {
+	const char* name = strrchr(imagePath, '/');
+	name = name != 0 ? name + 1 : imagePath;
+	size_t nameLength = strlen(name);
+	static const char* compressionSuffixes[] = { ".gz", ".zst", ".xz" };
+	for (int i = 0; i < 3; i++) {
+		size_t suffixLength = strlen(compressionSuffixes[i]);
+		if (nameLength > suffixLength 
+				&& strcmp(name + nameLength - suffixLength, compressionSuffixes[i]) == 0) {
+			nameLength -= suffixLength;
+			break;
+		}
+	}
+	for (size_t i = nameLength; i > 1; i--)
+		if (name[i - 1] == '.') {
+			nameLength = i - 1;
+			break;
+		}
+
+	size_t length = 0;
+	for (const char* c = template; *c != 0 && length + 1 < size; c++) {
+		if (*c == '%' && c[1] == 'n') {
+			length += snprintf(path + length, size - length, "%.*s", (int) nameLength, name);
+			c++;
+		}
+		else if (*c == '%' && c[1] == 'i') {
+			length += snprintf(path + length, size - length, "%d", index);
+			c++;
+		}
+		else {
+			if (*c == '%' && c[1] == '%')
+				c++;
+			path[length++] = *c;
+		}
+		if (length >= size)
+			length = size - 1;
+	}
+	path[length] = 0;
+}
+
+//The images of a --batch run and how to scan them
+struct batchJob {
+	char** paths;
+	int pathCount;
+	const char* outputTemplate;
+	const char* programName;
+	int mapImage;
+	int stream;
+	int fused;
+	int failed;
+};
+
+//Scans one image of a batch. Images that can't be opened are reported and counted as 
+//failed, and the rest of the batch goes on.
+static void scanBatchImage(int taskIndex, void* jobPointer) {
+	struct batchJob* job = jobPointer;
+	const char* path = job->paths[taskIndex];
+	char outputDirectory[4096];
+	expandOutputDirectory(outputDirectory, sizeof(outputDirectory), job->outputTemplate, 
+		path, taskIndex + 1);
+
+	struct imageContext context;
+	initImageContext(&context, outputDirectory);
+	image = &context;
+	imageWindowLength = 0;
+
+	//The output directory is only made for an image that will be scanned, so a failed
+	//one leaves nothing behind
+	if (openImage(path, job->programName, job->mapImage, job->stream) == -1 
+			|| !isScannableImage(path))
+		__sync_fetch_and_add(&job->failed, 1);
+	else if (makeDirectories(outputDirectory) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", job->programName, outputDirectory, strerror(errno));
+		__sync_fetch_and_add(&job->failed, 1);
+	}
+	else scanImage(job->fused || image->imageStream.active);
+	closeImage(0);
+	imageWindowLength = 0;
+	image = 0;
+}
+
+static struct batchJob batch;
+
+static void runBatch() {
+	runInParallel(batch.pathCount, scanBatchImage, &batch);
+}
+
+//Reads the image paths of a --batch list, one per line, from listPath ("-" for stdin)
+static char** readBatchList(const char* listPath, const char* programName, int* pathCount) {
+	FILE* list = strcmp(listPath, "-") == 0 ? stdin : fopen(listPath, "r");
+	if (list == 0) {
+		perror(programName);
+		exit(1);
+	}
+	char** paths = 0;
+	int capacity = 0;
+	*pathCount = 0;
+	char* line = 0;
+	size_t lineCapacity = 0;
+	ssize_t lineLength;
+	while ((lineLength = getline(&line, &lineCapacity, list)) != -1) {
+		if (lineLength > 0 && line[lineLength - 1] == '\n')
+			line[--lineLength] = 0;
+		if (lineLength == 0)
+			continue;
+		if (*pathCount == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 16;
+			paths = realloc(paths, capacity * sizeof(char*));
+			if (paths == 0) {
+				fprintf(stderr, "Memory allocation error in readBatchList\n");
+				exit(1);
+			}
+		}
+		paths[(*pathCount)++] = strdup(line);
+	}
+	free(line);
+	if (list != stdin)
+		fclose(list);
+	return paths;
+}
+
+static void printUsage(const char* programName) {
+	fprintf(stderr, "%s: Usage: %s [-j threads] [--io-depth reads] [--cache-mb megabytes] "
+		"[--fused] [--stats-json file] [--progress[=seconds]] [--format=csv|columnar] "
+		"[--bitmap-ranges] [--incremental index-file] [--stream] [--check] "
+		"[--output-dir template] [--serve[=socket-path]] "
+		"[disk-image-file-name | -]\n"
+		"       %s [options] --batch image-list-file --output-dir template\n"
+		"       %s --expand-bitmap bitmap-ranges-file\n", programName, programName, 
+		programName, programName);
+	exit(1);
+}
+
+#ifndef LAB3A_LIBRARY
+int main (int argc, char* argv[]) {
+	static struct option longOptions[] = {
+		{"jobs", required_argument, 0, 'j'},
+		{"io-depth", required_argument, 0, 'q'},
+		{"cache-mb", required_argument, 0, 'c'},
+		{"fused", no_argument, 0, 'f'},
+		{"stats-json", required_argument, 0, 's'},
+		{"progress", optional_argument, 0, 'p'},
+		{"format", required_argument, 0, 'o'},
+		{"bitmap-ranges", no_argument, 0, 'r'},
+		{"expand-bitmap", required_argument, 0, 'e'},
+		{"incremental", required_argument, 0, 'i'},
+		{"stream", no_argument, 0, 'm'},
+		{"batch", required_argument, 0, 'b'},
+		{"output-dir", required_argument, 0, 'd'},
+		{"check", no_argument, 0, 'k'},
+		{"serve", optional_argument, 0, 'v'},
+		{0, 0, 0, 0}
+	};
+
+	int mapImage = 1;
+	int fused = 0;
+	int stream = 0;
+	const char* statsPath = 0;
+	const char* batchPath = 0;
+	const char* outputTemplate = 0;
+	int serve = 0;
+	const char* socketPath = 0; //Queries come from stdin if --serve isn't given one
+	int option;
+	while ((option = getopt_long(argc, argv, "j:", longOptions, 0)) != -1) {
+		switch (option) {
+			case 'j':
+				threadCount = atoi(optarg);
+				if (threadCount < 1)
+					printUsage(argv[0]);
+				break;
+			case 'q':
+				ioDepth = atoi(optarg);
+				if (ioDepth < 1)
+					printUsage(argv[0]);
+				break;
+			case 'c':
+				cacheMegabytes = atoi(optarg);
+				mapImage = 0;
+				if (cacheMegabytes < 1)
+					printUsage(argv[0]);
+				break;
+			case 'f':
+				fused = 1;
+				break;
+			case 's':
+				statsPath = optarg;
+				collectStats = 1;
+				break;
+			case 'p':
+				progressInterval = optarg ? atof(optarg) : 1;
+				collectStats = 1;
+				if (progressInterval <= 0)
+					printUsage(argv[0]);
+				break;
+			case 'o':
+				if (strcmp(optarg, "csv") == 0)
+					outputFormat = FORMAT_CSV;
+				else if (strcmp(optarg, "columnar") == 0)
+					outputFormat = FORMAT_COLUMNAR;
+				else printUsage(argv[0]);
+				break;
+			case 'r':
+				bitmapRanges = 1;
+				break;
+			case 'e':
+				expandBitmapRanges(optarg);
+				exit(0);
+			case 'i':
+				indexPath = optarg;
+				break;
+			case 'm':
+				stream = 1;
+				break;
+			case 'b':
+				batchPath = optarg;
+				break;
+			case 'd':
+				outputTemplate = optarg;
+				break;
+			case 'k':
+				checkConsistency = 1;
+				break;
+			case 'v':
+				serve = 1;
+				socketPath = optarg;
+				break;
+			default:
+				printUsage(argv[0]);
+		}
+	}
+	if (optind != argc - (batchPath != 0 ? 0 : 1))
+		printUsage(argv[0]);
+	//Groups an incremental scan reuses aren't decoded, so there would be nothing to check
+	if (checkConsistency && indexPath != 0) {
+		fprintf(stderr, "%s: --check can't be used with --incremental\n", argv[0]);
+		exit(1);
+	}
+	if (serve && (indexPath != 0 || batchPath != 0)) {
+		fprintf(stderr, "%s: --serve can't be used with --incremental or --batch\n", argv[0]);
+		exit(1);
+	}
+	if (serve && socketPath == 0 && strcmp(argv[optind], "-") == 0) {
+		fprintf(stderr, "%s: --serve without a socket reads queries from stdin, so the "
+			"image can't come from it\n", argv[0]);
+		exit(1);
+	}
+
+	struct imageContext context;
+	if (batchPath != 0) {
+		//Each image's output needs a directory of its own
+		if (outputTemplate == 0 
+				|| (strstr(outputTemplate, "%n") == 0 && strstr(outputTemplate, "%i") == 0)) {
+			fprintf(stderr, "%s: --batch needs an --output-dir template with %%n or %%i\n", 
+				argv[0]);
+			exit(1);
+		}
+		if (indexPath != 0) {
+			fprintf(stderr, "%s: --incremental can't be used with --batch\n", argv[0]);
+			exit(1);
+		}
+		batch.paths = readBatchList(batchPath, argv[0], &batch.pathCount);
+		batch.outputTemplate = outputTemplate;
+		batch.programName = argv[0];
+		batch.mapImage = mapImage;
+		batch.stream = stream;
+		batch.fused = fused;
+		image = 0;
+	}
+	else {
+		char outputDirectory[4096] = ".";
+		if (outputTemplate != 0) {
+			expandOutputDirectory(outputDirectory, sizeof(outputDirectory), outputTemplate, 
+				argv[optind], 1);
+		}
+		initImageContext(&context, outputDirectory);
+		context.buildLookupIndex = serve;
+		image = &context;
+		if (openImage(argv[optind], argv[0], mapImage, stream) == -1 
+				|| !isScannableImage(argv[optind]))
+			exit(1);
+		if (outputTemplate != 0 && makeDirectories(outputDirectory) == -1) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], outputDirectory, strerror(errno));
+			exit(1);
+		}
+	}
+	if (image != 0 && image->imageStream.active) {
+		//Only the fused scan reads the image in order
+		if (indexPath != 0) {
+			fprintf(stderr, "%s: --incremental needs a seekable image\n", argv[0]);
+			exit(1);
+		}
+		fused = 1;
+	}
+	selectBitmapScanner();
+
+	registerThreadCounters();
+	scanStart = currentNanoseconds();
+	pthread_t progressThread;
+	int progressStarted = progressInterval > 0
+		&& pthread_create(&progressThread, 0, reportProgress, 0) == 0;
+
+	if (batchPath != 0)
+		runPhase("batch", runBatch);
+	else scanImage(fused);
+	__atomic_store_n(&currentPhase, "done", __ATOMIC_RELAXED);
+
+	if (progressStarted) {
+		pthread_mutex_lock(&progressLock);
+		progressStopping = 1;
+		pthread_cond_signal(&progressDone);
+		pthread_mutex_unlock(&progressLock);
+		pthread_join(progressThread, 0);
+
+		//Final totals
+		struct scanCounters none;
+		memset(&none, 0, sizeof(none));
+		unsigned long long start = scanStart;
+		printProgress(&none, &start);
+	}
+	if (statsPath != 0)
+		writeStatsJSON(statsPath, batchPath != 0 ? batchPath : argv[optind]);
+
+	if (batchPath != 0) {
+		//Successful batches are silent unless statistics were asked for
+		if (collectStats || batch.failed > 0)
+			fprintf(stderr, "batch: %d images, %d failed\n", batch.pathCount, batch.failed);
+		if (batch.failed > 0)
+			exit(1);
+	}
+	else closeImage(1);
+
+	if (serve) {
+		if (socketPath != 0)
+			serveSocket(context.lookupIndex, socketPath, argv[0]);
+		answerQueries(context.lookupIndex, 0, 1);
+		lab3aFreeIndex(context.lookupIndex);
+	}
+}
+#endif
@@ -0,0 +1,47 @@
+//Lookup API of lab3a, for programs that link liblab3a.a (make liblab3a.a) instead of
+//reading the CSVs. An image is scanned once into an index held in memory, which answers
+//which inode owns a block, which directory holds an inode, what an inode's path is and
+//which inodes have a given name. Lookups only read the index, so any number of threads
+//can make them at once; each takes under a microsecond, apart from paths, which take
+//one lookup per directory on the way up.
+#ifndef LAB3A_H
+#define LAB3A_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct lab3aIndex;
+
+//Scans the ext2 or ext4 image at imagePath and returns an index of its metadata. Its 
+//tables are written to outputDirectory as lab3a writes them, making the directory if it
+//doesn't exist; if outputDirectory is 0 they aren't written anywhere. Returns 0, with the
+//reason on stderr, if the image can't be opened, isn't an ext2 file system lab3a can 
+//scan, or outputDirectory can't be made or written to. Like lab3a, it exits if it runs 
+//out of memory, if writing a table fails partway, or if an image read through a pipe or 
+//a decompressor can't be read to the end.
+struct lab3aIndex* lab3aIndexImage(const char* imagePath, const char* outputDirectory);
+
+void lab3aFreeIndex(struct lab3aIndex* index);
+
+//Returns the inode whose data or block pointers are in block, or 0 if no inode uses it.
+//A block claimed by several inodes, which only happens on a damaged file system, is given
+//to one of them.
+uint32_t lab3aFindBlockOwner(const struct lab3aIndex* index, uint32_t block);
+
+//Returns the directory with an entry for inode, other than "." and "..", or 0 if there is
+//none. An inode with several links gives the directory with the lowest number. The root
+//directory is its own parent.
+uint32_t lab3aFindParent(const struct lab3aIndex* index, uint32_t inode);
+
+//Writes inode's path, from the root directory through the directories lab3aFindParent
+//gives, to path, cut short to fit in size bytes with the terminating null byte. Returns
+//the length of the whole path, or -1 if inode can't be reached from the root.
+long lab3aGetPath(const struct lab3aIndex* index, uint32_t inode, char* path, size_t size);
+
+//Stores the inodes of up to maxInodes directory entries named name (nameLength bytes, not
+//necessarily null terminated) in inodes, ordered by inode number, and returns how many
+//entries have that name
+unsigned long lab3aFindName(const struct lab3aIndex* index, const char* name,
+	size_t nameLength, uint32_t* inodes, unsigned long maxInodes);
+
+#endif
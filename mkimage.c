@@ -0,0 +1,758 @@
+#define _FILE_OFFSET_BITS 64
+#define _DEFAULT_SOURCE
+
+//Builds a synthetic ext2 image for benchmarking lab3a. The whole image is written with plain
+//file I/O, so neither mkfs nor root is needed. Only metadata is written: file data blocks
+//are allocated in the bitmaps but left as holes, so even large images are quick to create
+//and take little disk space.
+//
+//The layout follows what mkfs and the kernel produce: sparse superblock backups, one
+//block bitmap, inode bitmap and inode table per group, directories spread over the groups
+//and files kept in their parent's group. The tree is built breadth first from the root,
+//each directory getting fanout entries until the file count is reached.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <endian.h>
+#include <getopt.h>
+
+//Settings, see printUsage
+unsigned int blockSize = 1024;
+unsigned long imageMegabytes = 64;
+unsigned long requestedInodes = 0; //0 means one inode per 8KiB, like mkfs
+unsigned long fileTarget = 1000;
+unsigned int fanout = 16;
+unsigned int fragmentation = 0;
+unsigned int indirectPercent = 5;
+unsigned long corruptPointers = 0; //Files left to give a bad single indirect pointer
+uint64_t randomState = 1;
+
+//Geometry
+unsigned long blockCount;
+unsigned long blocksPerGroup;
+unsigned long inodesPerGroup;
+unsigned long inodeCount;
+unsigned long firstDataBlock;
+unsigned long numGroups;
+unsigned long descriptorBlocks;
+unsigned long inodeTableBlocks;
+unsigned long pointersPerBlock;
+
+#define INODE_SIZE 128
+#define ROOT_INODE 2
+#define LOST_AND_FOUND_INODE 11
+#define BASE_TIME 1500000000
+
+int imageFD;
+
+//Allocation state. The bitmaps cover the whole image and are split into groups on output.
+unsigned char* blockUsed;
+unsigned char* inodeUsed;
+unsigned long* groupCursor; //Where each group's next block search starts
+unsigned long* groupFreeBlocks;
+unsigned long* groupInodeCursor;
+unsigned long* groupDirectories;
+unsigned long freeBlocks;
+unsigned long nextDirectoryGroup;
+
+struct ext2SuperBlock {
+	uint32_t inodeCount;
+	uint32_t blockCount;
+	uint32_t reservedBlockCount;
+	uint32_t freeBlockCount;
+	uint32_t freeInodeCount;
+	uint32_t firstDataBlock;
+	uint32_t logBlockSize;
+	int32_t logFragmentSize;
+	uint32_t blocksPerGroup;
+	uint32_t fragmentsPerGroup;
+	uint32_t inodesPerGroup;
+	uint32_t mountTime;
+	uint32_t writeTime;
+	uint16_t mountCount;
+	uint16_t maxMountCount;
+	uint16_t magic;
+	uint16_t state;
+	uint16_t errors;
+	uint16_t minorRevision;
+	uint32_t lastCheck;
+	uint32_t checkInterval;
+	uint32_t creatorOS;
+	uint32_t revision;
+	uint16_t defaultReservedUID;
+	uint16_t defaultReservedGID;
+	uint32_t firstInode;
+	uint16_t inodeSize;
+	uint16_t blockGroupNumber;
+	uint32_t featureCompat;
+	uint32_t featureIncompat;
+	uint32_t featureReadOnlyCompat;
+	uint8_t uuid[16];
+	char volumeName[16];
+	uint8_t unused[1024 - 136];
+} __attribute__((packed));
+
+struct ext2GroupDescriptor {
+	uint32_t blockBitmapBlock;
+	uint32_t inodeBitmapBlock;
+	uint32_t inodeTableBlock;
+	uint16_t freeBlockCount;
+	uint16_t freeInodeCount;
+	uint16_t directoryCount;
+	uint16_t padding;
+	uint8_t reserved[12];
+} __attribute__((packed));
+
+struct ext2Inode {
+	uint16_t mode;
+	uint16_t uid;
+	uint32_t size;
+	uint32_t accessTime;
+	uint32_t creationTime;
+	uint32_t modificationTime;
+	uint32_t deletionTime;
+	uint16_t gid;
+	uint16_t linkCount;
+	uint32_t sectorCount;
+	uint32_t flags;
+	uint32_t osDependent1;
+	uint32_t block[15];
+	uint32_t generation;
+	uint32_t fileACL;
+	uint32_t sizeHigh;
+	uint32_t fragmentAddress;
+	uint8_t osDependent2[12];
+} __attribute__((packed));
+
+//xorshift64*, so a seed always gives the same image
+uint64_t nextRandom() {
+	randomState ^= randomState >> 12;
+	randomState ^= randomState << 25;
+	randomState ^= randomState >> 27;
+	return randomState * 0x2545F4914F6CDD1DULL;
+}
+
+unsigned long randomBelow(unsigned long limit) {
+	return nextRandom() % limit;
+}
+
+void* allocateOrExit(size_t size) {
+	void* memory = calloc(1, size);
+	if (memory == 0) {
+		fprintf(stderr, "Memory allocation error in mkimage\n");
+		exit(1);
+	}
+	return memory;
+}
+
+void writeBytes(const void* data, size_t count, off_t offset) {
+	size_t written = 0;
+	while (written < count) {
+		ssize_t writeCount = pwrite(imageFD, (const char*) data + written, count - written,
+			offset + written);
+		if (writeCount == -1) {
+			perror("pwrite");
+			exit(1);
+		}
+		written += writeCount;
+	}
+}
+
+void writeBlock(unsigned long block, const void* data) {
+	writeBytes(data, blockSize, (off_t) block * blockSize);
+}
+
+static inline int testBit(const unsigned char* bitmap, unsigned long bit) {
+	return (bitmap[bit / 8] >> (bit % 8)) & 0x1;
+}
+
+static inline void setBit(unsigned char* bitmap, unsigned long bit) {
+	bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+unsigned long groupStart(unsigned long group) {
+	return firstDataBlock + group * blocksPerGroup;
+}
+
+unsigned long groupBlockCount(unsigned long group) {
+	if (group == numGroups - 1)
+		return blockCount - groupStart(group);
+	return blocksPerGroup;
+}
+
+//With sparse_super, groups 0, 1 and powers of 3, 5 and 7 hold superblock backups
+int hasSuperBlockBackup(unsigned long group) {
+	if (group <= 1)
+		return 1;
+	unsigned long bases[] = { 3, 5, 7 };
+	for (int i = 0; i < 3; i++) {
+		unsigned long power = bases[i];
+		while (power < group)
+			power *= bases[i];
+		if (power == group)
+			return 1;
+	}
+	return 0;
+}
+
+//Group metadata, in the order mkfs lays it out
+unsigned long blockBitmapBlock(unsigned long group) {
+	return groupStart(group) + (hasSuperBlockBackup(group) ? 1 + descriptorBlocks : 0);
+}
+
+unsigned long inodeBitmapBlock(unsigned long group) {
+	return blockBitmapBlock(group) + 1;
+}
+
+unsigned long inodeTableBlock(unsigned long group) {
+	return blockBitmapBlock(group) + 2;
+}
+
+void markBlockUsed(unsigned long block) {
+	if (!testBit(blockUsed, block)) {
+		setBit(blockUsed, block);
+		freeBlocks--;
+		if (block >= firstDataBlock)
+			groupFreeBlocks[(block - firstDataBlock) / blocksPerGroup]--;
+	}
+}
+
+//Returns a free block, searching from the goal group onwards. With fragmentation set, some
+//allocations leave a short run of free blocks behind, like an aged file system.
+unsigned long allocateBlock(unsigned long group) {
+	if (freeBlocks == 0) {
+		fprintf(stderr, "mkimage: image is full, use a larger size or fewer files\n");
+		exit(1);
+	}
+	unsigned long skip = 0;
+	if (fragmentation > 0 && randomBelow(100) < fragmentation)
+		skip = 1 + randomBelow(16);
+
+	//The cursors only move forwards, so blocks left free behind them are found by a 
+	//second pass from the start of each group. Full groups are never scanned.
+	for (int pass = 0; pass < 2; pass++) {
+		for (unsigned long searched = 0; searched < numGroups; searched++) {
+			unsigned long current = (group + searched) % numGroups;
+			unsigned long end = groupStart(current) + groupBlockCount(current);
+			if (groupFreeBlocks[current] == 0)
+				continue;
+			if (pass == 1)
+				groupCursor[current] = groupStart(current);
+			for (unsigned long block = groupCursor[current]; block < end; block++) {
+				if (testBit(blockUsed, block))
+					continue;
+				if (skip > 0) {
+					skip--;
+					continue;
+				}
+				markBlockUsed(block);
+				groupCursor[current] = block + 1;
+				return block;
+			}
+		}
+		skip = 0;
+	}
+	fprintf(stderr, "mkimage: no free block found\n");
+	exit(1);
+}
+
+//Returns a free inode, searching from the goal group onwards
+unsigned long allocateInode(unsigned long group) {
+	for (unsigned long searched = 0; searched < numGroups; searched++) {
+		unsigned long current = (group + searched) % numGroups;
+		for (; groupInodeCursor[current] < inodesPerGroup; groupInodeCursor[current]++) {
+			unsigned long index = current * inodesPerGroup + groupInodeCursor[current];
+			if (!testBit(inodeUsed, index)) {
+				setBit(inodeUsed, index);
+				return index + 1;
+			}
+		}
+	}
+	return 0;
+}
+
+unsigned long inodeGroup(unsigned long inodeNumber) {
+	return (inodeNumber - 1) / inodesPerGroup;
+}
+
+void writeInode(unsigned long inodeNumber, const struct ext2Inode* inode) {
+	unsigned long index = (inodeNumber - 1) % inodesPerGroup;
+	writeBytes(inode, sizeof(struct ext2Inode),
+		(off_t) inodeTableBlock(inodeGroup(inodeNumber)) * blockSize + index * INODE_SIZE);
+}
+
+//Allocates an indirect block of the given level and everything below it, taking data
+//blocks off *remaining. Each indirect block is allocated just ahead of the blocks it points
+//to, as ext2 does.
+uint32_t buildIndirectBlock(int level, unsigned long* remaining, unsigned long group,
+		uint32_t* dataBlocks, unsigned long* dataCount, unsigned long* blocksUsed) {
+	uint32_t* pointers = allocateOrExit(blockSize);
+	unsigned long block = allocateBlock(group);
+	(*blocksUsed)++;
+	for (unsigned long i = 0; i < pointersPerBlock && *remaining > 0; i++) {
+		if (level == 1) {
+			unsigned long dataBlock = allocateBlock(group);
+			pointers[i] = htole32(dataBlock);
+			if (dataBlocks != 0)
+				dataBlocks[*dataCount] = dataBlock;
+			(*dataCount)++;
+			(*remaining)--;
+			(*blocksUsed)++;
+		}
+		else
+			pointers[i] = htole32(buildIndirectBlock(level - 1, remaining, group,
+				dataBlocks, dataCount, blocksUsed));
+	}
+	writeBlock(block, pointers);
+	free(pointers);
+	return block;
+}
+
+//Allocates dataBlockCount data blocks for the inode, plus whatever indirect blocks they
+//need, and fills in its block pointers and sector count. The physical data blocks are
+//stored in dataBlocks if it isn't null.
+void buildBlockMap(struct ext2Inode* inode, unsigned long dataBlockCount, unsigned long group,
+		uint32_t* dataBlocks) {
+	unsigned long remaining = dataBlockCount;
+	unsigned long dataCount = 0;
+	unsigned long blocksUsed = 0;
+	for (int j = 0; j < 12 && remaining > 0; j++) {
+		unsigned long block = allocateBlock(group);
+		inode->block[j] = htole32(block);
+		if (dataBlocks != 0)
+			dataBlocks[dataCount] = block;
+		dataCount++;
+		remaining--;
+		blocksUsed++;
+	}
+	for (int level = 1; level <= 3 && remaining > 0; level++)
+		inode->block[11 + level] = htole32(buildIndirectBlock(level, &remaining, group,
+			dataBlocks, &dataCount, &blocksUsed));
+	inode->sectorCount = htole32(blocksUsed * (blockSize / 512));
+
+	//With -c, point some files' single indirect block far past the end of the image, as
+	//a corrupt file system might
+	if (corruptPointers > 0 && dataBlocks == 0 && inode->block[12] != 0) {
+		inode->block[12] = htole32(0xF0000000);
+		corruptPointers--;
+	}
+}
+
+//Blocks a file of dataBlockCount data blocks takes, counting indirect blocks
+unsigned long blocksNeeded(unsigned long dataBlockCount) {
+	unsigned long total = dataBlockCount;
+	if (dataBlockCount > 12) {
+		unsigned long beyond = dataBlockCount - 12;
+		//Single indirect, then one per pointersPerBlock blocks below each double and
+		//triple indirect block
+		total += 1;
+		if (beyond > pointersPerBlock) {
+			beyond -= pointersPerBlock;
+			total += 1 + (beyond + pointersPerBlock - 1) / pointersPerBlock;
+			if (beyond > pointersPerBlock * pointersPerBlock) {
+				beyond -= pointersPerBlock * pointersPerBlock;
+				total += 1 + (beyond + pointersPerBlock * pointersPerBlock - 1)
+					/ (pointersPerBlock * pointersPerBlock);
+			}
+		}
+		total += total / pointersPerBlock; //Slack for partially filled indirect blocks
+	}
+	return total;
+}
+
+void fillInodeHeader(struct ext2Inode* inode, uint16_t mode, uint16_t linkCount) {
+	memset(inode, 0, sizeof(struct ext2Inode));
+	uint32_t time = BASE_TIME + randomBelow(1000000);
+	inode->mode = htole16(mode);
+	inode->uid = htole16(1000);
+	inode->gid = htole16(1000);
+	inode->linkCount = htole16(linkCount);
+	inode->accessTime = htole32(time);
+	inode->creationTime = htole32(time);
+	inode->modificationTime = htole32(time);
+}
+
+//Writes a regular file. indirectPercent of files are big enough to need indirect blocks,
+//split between ones that stop at the single indirect block and ones reaching the double.
+//Once the image is nearly full, files are left empty.
+void createFile(unsigned long inodeNumber) {
+	unsigned long dataBlockCount = randomBelow(4);
+	if (randomBelow(100) < indirectPercent)
+		dataBlockCount = 13 + randomBelow(2 * pointersPerBlock);
+	//Keep some room for the directories still to be written
+	if (blocksNeeded(dataBlockCount) + blockCount / 16 > freeBlocks)
+		dataBlockCount = 0;
+
+	struct ext2Inode inode;
+	fillInodeHeader(&inode, 0100644, 1);
+	unsigned long long size = (unsigned long long) dataBlockCount * blockSize;
+	if (size > 0)
+		size -= randomBelow(blockSize);
+	inode.size = htole32(size & 0xFFFFFFFF);
+	inode.sizeHigh = htole32(size >> 32);
+	buildBlockMap(&inode, dataBlockCount, inodeGroup(inodeNumber), 0);
+	writeInode(inodeNumber, &inode);
+}
+
+struct directoryEntry {
+	uint32_t inode;
+	uint8_t fileType; //1 for regular files, 2 for directories
+	char name[24];
+};
+
+static inline unsigned int entryLength(const struct directoryEntry* entry) {
+	return (8 + strlen(entry->name) + 3) & ~3u;
+}
+
+//Writes a directory holding the given entries, after "." and "..". Entries never span
+//blocks, and the last one in each block takes up the rest of it.
+void writeDirectory(unsigned long inodeNumber, unsigned long parent,
+		const struct directoryEntry* children, unsigned long childCount, int subdirectoryCount) {
+	unsigned long entryCount = childCount + 2;
+	struct directoryEntry* entries = allocateOrExit(entryCount * sizeof(struct directoryEntry));
+	entries[0].inode = inodeNumber;
+	entries[0].fileType = 2;
+	strcpy(entries[0].name, ".");
+	entries[1].inode = parent;
+	entries[1].fileType = 2;
+	strcpy(entries[1].name, "..");
+	memcpy(entries + 2, children, childCount * sizeof(struct directoryEntry));
+
+	//Count the blocks first so the block map can be built in one go
+	unsigned long dataBlockCount = 1;
+	unsigned int used = 0;
+	for (unsigned long i = 0; i < entryCount; i++) {
+		if (used + entryLength(&entries[i]) > blockSize) {
+			dataBlockCount++;
+			used = 0;
+		}
+		used += entryLength(&entries[i]);
+	}
+
+	struct ext2Inode inode;
+	fillInodeHeader(&inode, 040755, 2 + subdirectoryCount);
+	inode.size = htole32(dataBlockCount * blockSize);
+	uint32_t* dataBlocks = allocateOrExit(dataBlockCount * sizeof(uint32_t));
+	buildBlockMap(&inode, dataBlockCount, inodeGroup(inodeNumber), dataBlocks);
+	writeInode(inodeNumber, &inode);
+
+	unsigned char* block = allocateOrExit(blockSize);
+	unsigned long blockIndex = 0;
+	unsigned long i = 0;
+	while (i < entryCount) {
+		memset(block, 0, blockSize);
+		used = 0;
+		unsigned int lastEntry = 0;
+		for (; i < entryCount && used + entryLength(&entries[i]) <= blockSize; i++) {
+			unsigned int nameLength = strlen(entries[i].name);
+			*(uint32_t*) (block + used) = htole32(entries[i].inode);
+			*(uint16_t*) (block + used + 4) = htole16(entryLength(&entries[i]));
+			block[used + 6] = nameLength;
+			block[used + 7] = entries[i].fileType;
+			memcpy(block + used + 8, entries[i].name, nameLength);
+			lastEntry = used;
+			used += entryLength(&entries[i]);
+		}
+		*(uint16_t*) (block + lastEntry + 4) = htole16(blockSize - lastEntry);
+		writeBlock(dataBlocks[blockIndex++], block);
+	}
+	groupDirectories[inodeGroup(inodeNumber)]++;
+	free(block);
+	free(dataBlocks);
+	free(entries);
+}
+
+struct pendingDirectory {
+	unsigned long inode;
+	unsigned long parent;
+};
+
+//Creates the root, lost+found and then fileTarget files and directories below them,
+//breadth first. One in eight entries of a directory is a subdirectory.
+void buildTree() {
+	unsigned long queueCapacity = 64;
+	unsigned long queueStart = 0;
+	unsigned long queueEnd = 0;
+	struct pendingDirectory* queue = allocateOrExit(queueCapacity * sizeof(*queue));
+	struct directoryEntry* children = allocateOrExit(fanout * sizeof(struct directoryEntry));
+	unsigned long created = 0;
+
+	//Inodes below the first regular one are reserved
+	for (unsigned long i = 0; i < LOST_AND_FOUND_INODE; i++)
+		setBit(inodeUsed, i);
+	writeDirectory(LOST_AND_FOUND_INODE, ROOT_INODE, 0, 0, 0);
+	queue[queueEnd].inode = ROOT_INODE;
+	queue[queueEnd].parent = ROOT_INODE;
+	queueEnd++;
+
+	while (queueStart < queueEnd) {
+		struct pendingDirectory directory = queue[queueStart++];
+		unsigned long childCount = 0;
+		int subdirectoryCount = 0;
+		if (directory.inode == ROOT_INODE) {
+			children[0].inode = LOST_AND_FOUND_INODE;
+			children[0].fileType = 2;
+			strcpy(children[0].name, "lost+found");
+			childCount = 1;
+			subdirectoryCount = 1;
+		}
+		unsigned long firstChild = childCount;
+
+		while (childCount < fanout && created < fileTarget) {
+			struct directoryEntry* child = &children[childCount];
+			//Every eighth child, starting with the first, is a directory, so the tree 
+			//keeps growing however small the fanout
+			int isDirectory = (childCount - firstChild) % 8 == 0;
+			unsigned long goal = isDirectory
+				? nextDirectoryGroup++ % numGroups : inodeGroup(directory.inode);
+			child->inode = allocateInode(goal);
+			if (child->inode == 0)
+				break;
+			created++;
+			childCount++;
+			if (isDirectory) {
+				child->fileType = 2;
+				snprintf(child->name, sizeof(child->name), "dir%" PRIu32, child->inode);
+				subdirectoryCount++;
+				if (queueEnd == queueCapacity) {
+					queueCapacity *= 2;
+					queue = realloc(queue, queueCapacity * sizeof(*queue));
+					if (queue == 0) {
+						fprintf(stderr, "Memory allocation error in buildTree\n");
+						exit(1);
+					}
+				}
+				queue[queueEnd].inode = child->inode;
+				queue[queueEnd].parent = directory.inode;
+				queueEnd++;
+			}
+			else {
+				child->fileType = 1;
+				snprintf(child->name, sizeof(child->name), "file%" PRIu32, child->inode);
+				createFile(child->inode);
+			}
+		}
+		writeDirectory(directory.inode, directory.parent, children, childCount,
+			subdirectoryCount);
+	}
+	free(children);
+	free(queue);
+	if (created < fileTarget)
+		fprintf(stderr, "mkimage: ran out of inodes after %lu files\n", created);
+}
+
+//Works out the group layout and marks each group's metadata blocks as used
+void planLayout() {
+	firstDataBlock = blockSize == 1024 ? 1 : 0;
+	blocksPerGroup = 8 * blockSize;
+	pointersPerBlock = blockSize / 4;
+	blockCount = imageMegabytes * 1024 * 1024 / blockSize;
+	if (blockCount > 0xFFFFFFFFUL)
+		blockCount = 0xFFFFFFFFUL;
+	numGroups = (blockCount - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+
+	inodeCount = requestedInodes ? requestedInodes : blockCount * blockSize / 8192;
+	unsigned long inodesPerBlock = blockSize / INODE_SIZE;
+	inodesPerGroup = (inodeCount + numGroups - 1) / numGroups;
+	if (inodesPerGroup < 16)
+		inodesPerGroup = 16;
+	inodesPerGroup = (inodesPerGroup + inodesPerBlock - 1) / inodesPerBlock * inodesPerBlock;
+	if (inodesPerGroup > 8 * blockSize)
+		inodesPerGroup = 8 * blockSize;
+	inodeTableBlocks = inodesPerGroup / inodesPerBlock;
+	descriptorBlocks =
+		(numGroups * sizeof(struct ext2GroupDescriptor) + blockSize - 1) / blockSize;
+
+	//Drop a last group too small to hold its own metadata and a few blocks, as mkfs does
+	unsigned long overhead = 1 + descriptorBlocks + 2 + inodeTableBlocks;
+	if (numGroups > 1 && groupBlockCount(numGroups - 1) < overhead + 50) {
+		numGroups--;
+		blockCount = groupStart(numGroups);
+	}
+	if (numGroups == 0 || groupBlockCount(0) < overhead + 50) {
+		fprintf(stderr, "mkimage: image too small\n");
+		exit(1);
+	}
+	inodeCount = inodesPerGroup * numGroups;
+
+	blockUsed = allocateOrExit((blockCount + 7) / 8);
+	inodeUsed = allocateOrExit((inodeCount + 7) / 8);
+	groupCursor = allocateOrExit(numGroups * sizeof(unsigned long));
+	groupFreeBlocks = allocateOrExit(numGroups * sizeof(unsigned long));
+	groupInodeCursor = allocateOrExit(numGroups * sizeof(unsigned long));
+	groupDirectories = allocateOrExit(numGroups * sizeof(unsigned long));
+	freeBlocks = blockCount;
+
+	//Blocks before the first data block (the boot block with 1KiB blocks) aren't in
+	//any group and don't count as free
+	for (unsigned long block = 0; block < firstDataBlock; block++)
+		setBit(blockUsed, block);
+	freeBlocks -= firstDataBlock;
+	for (unsigned long group = 0; group < numGroups; group++)
+		groupFreeBlocks[group] = groupBlockCount(group);
+	for (unsigned long group = 0; group < numGroups; group++) {
+		unsigned long metadataEnd = inodeTableBlock(group) + inodeTableBlocks;
+		for (unsigned long block = groupStart(group); block < metadataEnd; block++)
+			markBlockUsed(block);
+		groupCursor[group] = metadataEnd;
+	}
+}
+
+//Writes the superblock, its backups, the descriptor table and every group's bitmaps
+void writeMetadata() {
+	struct ext2GroupDescriptor* descriptors =
+		allocateOrExit(descriptorBlocks * blockSize);
+	unsigned char* bitmap = allocateOrExit(blockSize);
+	unsigned long totalFreeInodes = 0;
+
+	for (unsigned long group = 0; group < numGroups; group++) {
+		//Block bitmap, with the bits past the end of a short last group set
+		memset(bitmap, 0, blockSize);
+		unsigned long freeCount = 0;
+		for (unsigned long i = 0; i < blocksPerGroup; i++) {
+			if (i >= groupBlockCount(group) || testBit(blockUsed, groupStart(group) + i))
+				setBit(bitmap, i);
+			else
+				freeCount++;
+		}
+		writeBlock(blockBitmapBlock(group), bitmap);
+		descriptors[group].blockBitmapBlock = htole32(blockBitmapBlock(group));
+		descriptors[group].freeBlockCount = htole16(freeCount);
+
+		//Inode bitmap, with the bits past inodesPerGroup set
+		memset(bitmap, 0, blockSize);
+		freeCount = 0;
+		for (unsigned long i = 0; i < 8 * (unsigned long) blockSize; i++) {
+			if (i >= inodesPerGroup || testBit(inodeUsed, group * inodesPerGroup + i))
+				setBit(bitmap, i);
+			else
+				freeCount++;
+		}
+		writeBlock(inodeBitmapBlock(group), bitmap);
+		descriptors[group].inodeBitmapBlock = htole32(inodeBitmapBlock(group));
+		descriptors[group].freeInodeCount = htole16(freeCount);
+		totalFreeInodes += freeCount;
+
+		descriptors[group].inodeTableBlock = htole32(inodeTableBlock(group));
+		descriptors[group].directoryCount = htole16(groupDirectories[group]);
+	}
+
+	struct ext2SuperBlock superBlock;
+	memset(&superBlock, 0, sizeof(superBlock));
+	superBlock.inodeCount = htole32(inodeCount);
+	superBlock.blockCount = htole32(blockCount);
+	superBlock.freeBlockCount = htole32(freeBlocks);
+	superBlock.freeInodeCount = htole32(totalFreeInodes);
+	superBlock.firstDataBlock = htole32(firstDataBlock);
+	superBlock.logBlockSize = htole32(__builtin_ctz(blockSize) - 10);
+	superBlock.logFragmentSize = htole32(__builtin_ctz(blockSize) - 10);
+	superBlock.blocksPerGroup = htole32(blocksPerGroup);
+	superBlock.fragmentsPerGroup = htole32(blocksPerGroup);
+	superBlock.inodesPerGroup = htole32(inodesPerGroup);
+	superBlock.writeTime = htole32(BASE_TIME);
+	superBlock.maxMountCount = htole16(0xFFFF);
+	superBlock.magic = htole16(0xEF53);
+	superBlock.state = htole16(1); //Cleanly unmounted
+	superBlock.errors = htole16(1); //Continue
+	superBlock.lastCheck = htole32(BASE_TIME);
+	superBlock.revision = htole32(1);
+	superBlock.firstInode = htole32(LOST_AND_FOUND_INODE);
+	superBlock.inodeSize = htole16(INODE_SIZE);
+	superBlock.featureIncompat = htole32(0x2); //Directory entries record the file type
+	superBlock.featureReadOnlyCompat = htole32(0x1); //Sparse superblock backups
+	for (int i = 0; i < 16; i++)
+		superBlock.uuid[i] = nextRandom();
+	strcpy(superBlock.volumeName, "lab3a-bench");
+
+	for (unsigned long group = 0; group < numGroups; group++) {
+		if (!hasSuperBlockBackup(group))
+			continue;
+		superBlock.blockGroupNumber = htole16(group);
+		//The primary superblock is always at byte 1024, whatever the block size
+		off_t offset = group == 0 ? 1024 : (off_t) groupStart(group) * blockSize;
+		writeBytes(&superBlock, sizeof(superBlock), offset);
+		writeBytes(descriptors, descriptorBlocks * blockSize,
+			(off_t) (groupStart(group) + 1) * blockSize);
+	}
+	free(bitmap);
+	free(descriptors);
+}
+
+void printUsage(const char* programName) {
+	fprintf(stderr, "%s: Usage: %s [-b block-size] [-s size-mb] [-i inodes] [-n files] "
+		"[-d fanout] [-f fragmentation-percent] [-x indirect-percent] [-r seed] "
+		"[-c corrupt-files] image-file\n",
+		programName, programName);
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	int option;
+	while ((option = getopt(argc, argv, "b:s:i:n:d:f:x:r:c:")) != -1) {
+		switch (option) {
+			case 'b':
+				blockSize = atoi(optarg);
+				if (blockSize != 1024 && blockSize != 2048 && blockSize != 4096)
+					printUsage(argv[0]);
+				break;
+			case 's':
+				imageMegabytes = strtoul(optarg, 0, 10);
+				break;
+			case 'i':
+				requestedInodes = strtoul(optarg, 0, 10);
+				break;
+			case 'n':
+				fileTarget = strtoul(optarg, 0, 10);
+				break;
+			case 'd':
+				fanout = atoi(optarg);
+				if (fanout < 1)
+					printUsage(argv[0]);
+				break;
+			case 'f':
+				fragmentation = atoi(optarg);
+				if (fragmentation > 100)
+					printUsage(argv[0]);
+				break;
+			case 'x':
+				indirectPercent = atoi(optarg);
+				if (indirectPercent > 100)
+					printUsage(argv[0]);
+				break;
+			case 'r':
+				randomState = strtoull(optarg, 0, 10) | 1;
+				break;
+			case 'c':
+				corruptPointers = strtoul(optarg, 0, 10);
+				break;
+			default:
+				printUsage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		printUsage(argv[0]);
+
+	imageFD = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (imageFD == -1) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	planLayout();
+	if (ftruncate(imageFD, (off_t) blockCount * blockSize) == -1) {
+		perror("ftruncate");
+		exit(1);
+	}
+	buildTree();
+	writeMetadata();
+	close(imageFD);
+
+	fprintf(stderr, "%s: %lu blocks of %u bytes in %lu groups, %lu inodes, %lu blocks free\n",
+		argv[optind], blockCount, blockSize, numGroups, inodeCount, freeBlocks);
+	return 0;
+}